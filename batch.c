@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <openssl/sha.h>
+
+#include "batch.h"
+#include "recover.h"
+#include "verify.h"
+#include "freemap.h"
+#include "dirwalk.h"
+#include "dirindex.h"
+
+typedef struct {
+    long slot;                  // directory index slot, also used for claiming
+} BatchCandidate;
+
+typedef struct {
+    char *filename;             // path as written in the manifest
+    const char *name;           // last path component
+    unsigned int dir_cluster;   // containing directory, once resolved
+    int resolved;
+    int has_sha1;
+    int empty_sha1;
+    unsigned char sha1[SHA_DIGEST_LENGTH];
+    int next_same_tail;         // next request sharing the name tail, or -1
+    BatchCandidate *candidates;
+    size_t candidate_count;
+    size_t candidate_cap;
+    const char *status;
+} BatchRequest;
+
+typedef struct {
+    BatchRequest *requests;
+    size_t count;
+    size_t cap;
+    int *buckets;               // open-addressed table of request indexes
+    size_t bucket_count;
+} Batch;
+
+static int sameTail(const BatchRequest *req, unsigned int dir_cluster, const char *name){
+    return req->dir_cluster == dir_cluster && strcmp(req->name + 1, name + 1) == 0;
+}
+
+static int isHexDigest(const char *hex){
+    size_t len = strlen(hex);
+    if(len != SHA_DIGEST_LENGTH * 2){
+        return 0;
+    }
+    for(size_t i = 0; i < len; i++){
+        if(!isxdigit((unsigned char)hex[i])){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int addRequest(Batch *batch, const char *filename, const char *sha1){
+    if(batch->count == batch->cap){
+        size_t cap = batch->cap ? batch->cap * 2 : 64;
+        BatchRequest *requests = realloc(batch->requests, cap * sizeof(BatchRequest));
+        if(requests == NULL){
+            perror("Error allocating memory");
+            return -1;
+        }
+        batch->requests = requests;
+        batch->cap = cap;
+    }
+    BatchRequest *req = &batch->requests[batch->count];
+    memset(req, 0, sizeof(*req));
+    req->filename = strdup(filename);
+    if(req->filename == NULL){
+        perror("Error allocating memory");
+        return -1;
+    }
+    batch->count++;
+    req->next_same_tail = -1;
+    if(sha1){
+        req->has_sha1 = 1;
+        req->empty_sha1 = strcmp(sha1, EMPTY_SHA1) == 0;
+        hex_string_to_byte_array(sha1, req->sha1, SHA_DIGEST_LENGTH);
+    }
+    return 0;
+}
+
+// Each manifest line is "filename [sha1]", where filename may be a path
+// such as /DCIM/100/IMG0001.JPG and may contain spaces, as long names do;
+// a trailing 40-digit hex word is the SHA-1. Blank lines and lines
+// starting with '#' are ignored.
+static int readManifest(Batch *batch, const char *manifest_path){
+    FILE *manifest = fopen(manifest_path, "r");
+    if(manifest == NULL){
+        perror("Error opening manifest");
+        return -1;
+    }
+    char line[DIR_PATH_MAX + 64];
+    unsigned int line_no = 0;
+    int status = 0;
+    while(status == 0 && fgets(line, sizeof(line), manifest) != NULL){
+        line_no++;
+        char *filename = line + strspn(line, " \t");
+        size_t len = strlen(filename);
+        while(len > 0 && strchr(" \t\r\n", filename[len - 1])){
+            filename[--len] = '\0';
+        }
+        if(len == 0 || filename[0] == '#'){
+            continue;
+        }
+        char *sha1 = NULL;
+        char *space = strrchr(filename, ' ');
+        char *tab = strrchr(filename, '\t');
+        if(tab > space){
+            space = tab;
+        }
+        if(space && isHexDigest(space + 1)){
+            sha1 = space + 1;
+            while(space > filename && strchr(" \t", space[-1])){
+                space--;
+            }
+            *space = '\0';
+        }
+        if(filename[0] == '\0' || strlen(filename) >= DIR_PATH_MAX){
+            fprintf(stderr, "%s:%u: expected \"filename [sha1]\"\n", manifest_path, line_no);
+            status = -1;
+            break;
+        }
+        status = addRequest(batch, filename, sha1);
+    }
+    fclose(manifest);
+    return status;
+}
+
+// Find the directory each request names. Requests whose directory does not
+// exist stay unresolved and end up "file not found".
+static void resolveRequestPaths(Volume *vol, Batch *batch){
+    for(size_t n = 0; n < batch->count; n++){
+        BatchRequest *req = &batch->requests[n];
+        req->resolved = dirIndexResolvePath(vol, req->filename, &req->dir_cluster, &req->name) == 0;
+        if(!req->resolved){
+            req->name = req->filename;
+        }
+    }
+}
+
+// Requests that share a directory and name tail are chained off a single
+// bucket so a directory entry is looked up once no matter how many
+// requests it serves.
+static int buildIndex(Batch *batch){
+    size_t bucket_count = 16;
+    while(bucket_count < batch->count * 2){
+        bucket_count *= 2;
+    }
+    batch->buckets = malloc(bucket_count * sizeof(int));
+    if(batch->buckets == NULL){
+        perror("Error allocating memory");
+        return -1;
+    }
+    batch->bucket_count = bucket_count;
+    for(size_t i = 0; i < bucket_count; i++){
+        batch->buckets[i] = -1;
+    }
+    // Insert in reverse so each chain lists requests in manifest order
+    for(size_t n = batch->count; n-- > 0;){
+        BatchRequest *req = &batch->requests[n];
+        if(!req->resolved){
+            continue;
+        }
+        size_t slot = dirIndexKeyHash(req->dir_cluster, req->name) & (bucket_count - 1);
+        while(batch->buckets[slot] != -1){
+            BatchRequest *head = &batch->requests[batch->buckets[slot]];
+            if(sameTail(head, req->dir_cluster, req->name)){
+                break;
+            }
+            slot = (slot + 1) & (bucket_count - 1);
+        }
+        req->next_same_tail = batch->buckets[slot];
+        batch->buckets[slot] = (int)n;
+    }
+    return 0;
+}
+
+static int addCandidate(BatchRequest *req, long slot){
+    if(req->candidate_count == req->candidate_cap){
+        size_t cap = req->candidate_cap ? req->candidate_cap * 2 : 4;
+        BatchCandidate *candidates = realloc(req->candidates, cap * sizeof(BatchCandidate));
+        if(candidates == NULL){
+            perror("Error allocating memory");
+            return -1;
+        }
+        req->candidates = candidates;
+        req->candidate_cap = cap;
+    }
+    req->candidates[req->candidate_count++].slot = slot;
+    return 0;
+}
+
+typedef struct {
+    long slot;
+    int head;                   // first request sharing this entry's name tail
+    long hash_slot;             // index into the digest table, or -1
+} BatchMatch;
+
+static int needsHash(const Batch *batch, int head, Volume *vol, long slot){
+    if(vol->dir_index->size[slot] == 0 || !contiguousRangeFree(vol, slot)){
+        return 0;
+    }
+    for(int n = head; n != -1; n = batch->requests[n].next_same_tail){
+        if(batch->requests[n].has_sha1){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int attachMatch(Volume *vol, Batch *batch, const BatchMatch *match, const unsigned char *digest){
+    long slot = match->slot;
+    for(int n = match->head; n != -1; n = batch->requests[n].next_same_tail){
+        BatchRequest *req = &batch->requests[n];
+        // Requests sharing a tail may still differ by long name
+        if(!dirIndexMatches(vol->dir_index, slot, req->name)){
+            continue;
+        }
+        if(req->has_sha1){
+            if(vol->dir_index->size[slot] == 0){
+                if(!req->empty_sha1){
+                    continue;
+                }
+            }else if(!contiguousRangeFree(vol, slot) || memcmp(digest, req->sha1, SHA_DIGEST_LENGTH) != 0){
+                continue;
+            }
+        }
+        if(addCandidate(req, slot) != 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    Batch *batch;
+    BatchMatch *matches;
+    size_t match_count;
+    size_t match_cap;
+    long *to_hash;              // index slots, hashed together afterwards
+    size_t hash_count;
+} BatchScan;
+
+static int collectMatch(Volume *vol, BatchScan *scan, int head, long slot){
+    if(scan->match_count == scan->match_cap){
+        size_t cap = scan->match_cap ? scan->match_cap * 2 : 64;
+        BatchMatch *grown = realloc(scan->matches, cap * sizeof(BatchMatch));
+        if(grown == NULL){
+            perror("Error allocating memory");
+            return -1;
+        }
+        scan->matches = grown;
+        long *grown_hash = realloc(scan->to_hash, cap * sizeof(long));
+        if(grown_hash == NULL){
+            perror("Error allocating memory");
+            return -1;
+        }
+        scan->to_hash = grown_hash;
+        scan->match_cap = cap;
+    }
+    BatchMatch *match = &scan->matches[scan->match_count++];
+    match->slot = slot;
+    match->head = head;
+    match->hash_slot = -1;
+    if(needsHash(scan->batch, head, vol, slot)){
+        match->hash_slot = (long)scan->hash_count;
+        scan->to_hash[scan->hash_count++] = slot;
+    }
+    return 0;
+}
+
+static int compareCandidates(const void *a, const void *b){
+    long x = ((const BatchCandidate *)a)->slot, y = ((const BatchCandidate *)b)->slot;
+    return x < y ? -1 : x > y;
+}
+
+// Look up each distinct (directory, name tail) pair of the manifest in the
+// directory index, collecting every deleted entry it names by short or long
+// name. Entries that some SHA-1 request needs are hashed together on the
+// verification pool, each at most once, and then attached to the requests
+// they satisfy.
+static int scanDirectories(Volume *vol, Batch *batch){
+    const DirIndex *index = vol->dir_index;
+    BatchScan scan = {0};
+    scan.batch = batch;
+    int status = 0;
+
+    // Long names can reach one entry from several requests of a chain
+    uint64_t *seen = calloc((index->count + 63) / 64 + 1, sizeof(uint64_t));
+    if(seen == NULL){
+        perror("Error allocating memory");
+        return -1;
+    }
+    for(size_t b = 0; status == 0 && b < batch->bucket_count; b++){
+        int head = batch->buckets[b];
+        for(int n = head; status == 0 && n != -1; n = batch->requests[n].next_same_tail){
+            const BatchRequest *req = &batch->requests[n];
+            DirIndexMatch match;
+            for(long slot = dirIndexFirstMatch(&match, index, req->dir_cluster, req->name); status == 0 && slot != DIR_INDEX_NONE; slot = dirIndexNextMatch(&match)){
+                if(!dirIndexIsDeletedFile(index, slot) || (seen[slot / 64] >> (slot % 64)) & 1){
+                    continue;
+                }
+                seen[slot / 64] |= (uint64_t)1 << (slot % 64);
+                status = collectMatch(vol, &scan, head, slot);
+            }
+        }
+    }
+    free(seen);
+
+    unsigned char (*digests)[SHA_DIGEST_LENGTH] = NULL;
+    if(status == 0){
+        digests = malloc((scan.hash_count ? scan.hash_count : 1) * SHA_DIGEST_LENGTH);
+        if(digests == NULL || hashIndexedEntries(vol, scan.to_hash, scan.hash_count, digests) != 0){
+            status = -1;
+        }
+    }
+    for(size_t m = 0; status == 0 && m < scan.match_count; m++){
+        const unsigned char *digest = scan.matches[m].hash_slot >= 0 ? digests[scan.matches[m].hash_slot] : NULL;
+        status = attachMatch(vol, batch, &scan.matches[m], digest);
+    }
+
+    // Candidates must be in on-disk order for the last match to win
+    for(size_t n = 0; status == 0 && n < batch->count; n++){
+        if(batch->requests[n].candidate_count > 1){
+            qsort(batch->requests[n].candidates, batch->requests[n].candidate_count, sizeof(BatchCandidate), compareCandidates);
+        }
+    }
+
+    free(digests);
+    free(scan.to_hash);
+    free(scan.matches);
+    return status;
+}
+
+// Decide every request in manifest order. An entry claimed by an earlier
+// request is no longer deleted, which matches running the requests one
+// after another.
+static long *resolveRequests(Volume *vol, Batch *batch, char *first_chars){
+    const DirIndex *index = vol->dir_index;
+    long *restores = malloc((batch->count ? batch->count : 1) * sizeof(long));
+    unsigned char *claimed = calloc(index->count ? index->count : 1, 1);
+    if(restores == NULL || claimed == NULL){
+        perror("Error allocating memory");
+        free(restores);
+        free(claimed);
+        return NULL;
+    }
+    for(size_t n = 0; n < batch->count; n++){
+        BatchRequest *req = &batch->requests[n];
+        restores[n] = DIR_INDEX_NONE;
+        size_t remaining = 0;
+        BatchCandidate *chosen = NULL;
+        for(size_t c = 0; c < req->candidate_count; c++){
+            if(!claimed[req->candidates[c].slot]){
+                remaining++;
+                chosen = &req->candidates[c];
+            }
+        }
+        if(remaining == 0){
+            req->status = "file not found";
+        }else if(remaining > 1 && !req->has_sha1){
+            req->status = "multiple candidates found";
+        }else if(!contiguousRangeFree(vol, chosen->slot)){
+            req->status = "file not found";
+        }else{
+            // Later requests must see these clusters as taken
+            if(index->size[chosen->slot] != 0){
+                markClustersUsed(vol->free_map, index->first_cluster[chosen->slot], clustersForSize(vol, index->size[chosen->slot]));
+            }
+            claimed[chosen->slot] = 1;
+            restores[n] = chosen->slot;
+            first_chars[n] = dirIndexRestoredFirstChar(index, chosen->slot, req->name);
+            req->status = req->has_sha1 ? "successfully recovered with SHA-1" : "successfully recovered";
+        }
+    }
+    free(claimed);
+    return restores;
+}
+
+static void freeBatch(Batch *batch){
+    for(size_t n = 0; n < batch->count; n++){
+        free(batch->requests[n].candidates);
+        free(batch->requests[n].filename);
+    }
+    free(batch->requests);
+    free(batch->buckets);
+}
+
+int recoverBatch(Volume *vol, const char *manifest_path, FILE *out){
+    Batch batch = {0};
+    if(readManifest(&batch, manifest_path) != 0){
+        freeBatch(&batch);
+        return 1;
+    }
+    if(getDirIndex(vol) == NULL){
+        freeBatch(&batch);
+        return 1;
+    }
+    resolveRequestPaths(vol, &batch);
+    if(buildIndex(&batch) != 0 || scanDirectories(vol, &batch) != 0){
+        freeBatch(&batch);
+        return 1;
+    }
+
+    char *first_chars = calloc(batch.count ? batch.count : 1, 1);
+    long *restores = first_chars ? resolveRequests(vol, &batch, first_chars) : NULL;
+    if(restores == NULL){
+        free(first_chars);
+        freeBatch(&batch);
+        return 1;
+    }
+
+    // Apply every directory and FAT rewrite together once all requests are decided
+    int status = 0;
+    for(size_t n = 0; status == 0 && n < batch.count; n++){
+        if(restores[n] != DIR_INDEX_NONE && restoreContiguousFile(vol, restores[n], first_chars[n]) != 0){
+            status = 1;
+        }
+    }
+    for(size_t n = 0; status == 0 && n < batch.count; n++){
+        fprintf(out, "%s: %s\n", batch.requests[n].filename, batch.requests[n].status);
+    }
+
+    free(restores);
+    free(first_chars);
+    freeBatch(&batch);
+    return status;
+}
@@ -0,0 +1,10 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <stdio.h>
+
+#include "volume.h"
+
+int recoverBatch(Volume *vol, const char *manifest_path, FILE *out);
+
+#endif
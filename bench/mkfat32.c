@@ -0,0 +1,522 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <openssl/sha.h>
+
+#include "../volume.h"
+
+// Build a FAT32 image for benchmarks, with no mkfs and no mount: a tree of
+// directories holding live and deleted files, some of them fragmented. The
+// image is sparse, so only metadata and file contents take disk space.
+// Every deleted file is listed, with its SHA-1, in a manifest next to it.
+
+#define SECTOR_SIZE 512
+#define RESERVED_SECTORS 32
+#define MAX_DIRS 1000000
+// The -R target is kept inside the default search budget of nyufile
+#define FRAG_TARGET_CLUSTERS 4
+
+static const char *usage_message =
+    "Usage: mkfat32 [options] image\n"
+    "  -s size      Image size, with an optional K, M, G or T suffix. Default 64M.\n"
+    "  -c bytes     Cluster size, a power of two from 512 to 65536. Default 4096.\n"
+    "  -d depth     Directory levels below the root. Default 2.\n"
+    "  -w width     Subdirectories per directory. Default 4.\n"
+    "  -n files     Live files. Default 1000.\n"
+    "  -x files     Deleted files. Default 100.\n"
+    "  -z bytes     Largest file size. Default 8 clusters.\n"
+    "  -f percent   Share of multi-cluster files and directories split into fragments. Default 0.\n"
+    "  -S seed      Seed for names, sizes and contents. Default 1.\n"
+    "  -m manifest  Where to list deleted files. Default image.files.\n";
+
+typedef struct {
+    uint64_t state;
+} Rng;
+
+static uint64_t nextRandom(Rng *rng){
+    // xorshift64*: fast, and the same sequence on every host
+    rng->state ^= rng->state >> 12;
+    rng->state ^= rng->state << 25;
+    rng->state ^= rng->state >> 27;
+    return rng->state * 0x2545F4914F6CDD1DULL;
+}
+
+static unsigned int randomBelow(Rng *rng, unsigned int bound){
+    return bound ? (unsigned int)(nextRandom(rng) % bound) : 0;
+}
+
+typedef struct {
+    unsigned int parent;        // index of the parent directory
+    unsigned int child_count;
+    unsigned int first_child;   // children are numbered consecutively
+    unsigned int entry_count;
+    unsigned int *clusters;     // the directory's chain
+    unsigned int cluster_total;
+} BenchDir;
+
+typedef struct {
+    int fd;
+    uint64_t size;
+    unsigned int cluster_size;
+    unsigned int cluster_count;
+    unsigned int fat_sectors;
+    uint64_t data_offset;
+    uint32_t *fat;
+    unsigned int cursor;        // next cluster to hand out
+    unsigned int stride;        // free clusters left after each object
+    unsigned int frag_percent;
+    Rng rng;
+} Image;
+
+static int parseSize(const char *text, uint64_t *value){
+    char *end = NULL;
+    unsigned long long parsed = strtoull(text, &end, 10);
+    if(end == text){
+        return -1;
+    }
+    switch(*end){
+        case 'T': case 't': parsed <<= 10; // fall through
+        case 'G': case 'g': parsed <<= 10; // fall through
+        case 'M': case 'm': parsed <<= 10; // fall through
+        case 'K': case 'k': parsed <<= 10; end++; break;
+        case '\0': break;
+        default: return -1;
+    }
+    if(*end != '\0' || parsed == 0){
+        return -1;
+    }
+    *value = parsed;
+    return 0;
+}
+
+static int parseNumber(const char *text, unsigned int *value){
+    char *end = NULL;
+    unsigned long parsed = strtoul(text, &end, 10);
+    if(end == text || *end != '\0' || parsed > 0xFFFFFFFFUL){
+        return -1;
+    }
+    *value = (unsigned int)parsed;
+    return 0;
+}
+
+static int writeAt(const Image *img, const void *bytes, size_t length, uint64_t offset){
+    const unsigned char *data = bytes;
+    while(length > 0){
+        ssize_t written = pwrite(img->fd, data, length, (off_t)offset);
+        if(written < 0 && errno == EINTR){
+            continue;
+        }
+        if(written < 0){
+            perror("Error writing image");
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+        offset += (uint64_t)written;
+    }
+    return 0;
+}
+
+static uint64_t clusterAt(const Image *img, unsigned int cluster){
+    return img->data_offset + (uint64_t)(cluster - 2) * img->cluster_size;
+}
+
+// Size the FAT for the clusters that remain once both copies are reserved
+static int planGeometry(Image *img){
+    uint64_t total_sectors = img->size / SECTOR_SIZE;
+    unsigned int sectors_per_cluster = img->cluster_size / SECTOR_SIZE;
+    if(total_sectors > 0xFFFFFFFFULL){
+        fprintf(stderr, "Image too large for FAT32\n");
+        return -1;
+    }
+    uint64_t fat_sectors = 1;
+    uint64_t cluster_count = 0;
+    for(int pass = 0; pass < 4; pass++){
+        uint64_t data_sectors = total_sectors - RESERVED_SECTORS - 2 * fat_sectors;
+        cluster_count = data_sectors / sectors_per_cluster;
+        if(cluster_count + 2 > FAT_ENTRY_MASK){
+            cluster_count = FAT_ENTRY_MASK - 2;
+        }
+        fat_sectors = ((cluster_count + 2) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        if(RESERVED_SECTORS + 2 * fat_sectors + sectors_per_cluster * 16ULL > total_sectors){
+            fprintf(stderr, "Image too small\n");
+            return -1;
+        }
+    }
+    img->fat_sectors = (unsigned int)fat_sectors;
+    img->cluster_count = (unsigned int)cluster_count;
+    img->data_offset = (uint64_t)(RESERVED_SECTORS + 2 * fat_sectors) * SECTOR_SIZE;
+    img->fat = calloc(cluster_count + 2, sizeof(uint32_t));
+    if(img->fat == NULL){
+        perror("Error allocating memory");
+        return -1;
+    }
+    img->fat[0] = 0x0FFFFFF8;
+    img->fat[1] = FAT_EOC;
+    return 0;
+}
+
+// Hand out count clusters from the cursor. A fragmented object is split
+// into two to four pieces with a few free clusters between them. Deleted
+// objects leave the FAT free, as a deletion would.
+static int allocClusters(Image *img, unsigned int count, int linked, unsigned int *clusters){
+    unsigned int pieces = 1;
+    if(count >= 2 && randomBelow(&img->rng, 100) < img->frag_percent){
+        pieces = 2 + randomBelow(&img->rng, 3);
+        if(pieces > count){
+            pieces = count;
+        }
+    }
+    unsigned int done = 0;
+    for(unsigned int p = 0; p < pieces; p++){
+        unsigned int length = p + 1 == pieces ? count - done : (count - done) / (pieces - p);
+        if(p > 0){
+            img->cursor += 1 + randomBelow(&img->rng, 4);
+        }
+        if(img->cursor + length > img->cluster_count + 2){
+            fprintf(stderr, "Image too small for the requested files\n");
+            return -1;
+        }
+        for(unsigned int k = 0; k < length; k++){
+            clusters[done++] = img->cursor++;
+        }
+    }
+    if(linked){
+        for(unsigned int k = 0; k < count; k++){
+            img->fat[clusters[k]] = k + 1 < count ? clusters[k + 1] : FAT_EOC;
+        }
+    }
+    img->cursor += img->stride;
+    return 0;
+}
+
+static void fillContent(unsigned char *buffer, size_t length, uint64_t seed){
+    Rng rng = { seed * 0x9E3779B97F4A7C15ULL + 1 };
+    for(size_t n = 0; n < length; n += 8){
+        uint64_t word = nextRandom(&rng);
+        memcpy(buffer + n, &word, length - n < 8 ? length - n : 8);
+    }
+}
+
+// Write a file's contents over its clusters and return its SHA-1
+static int writeFile(const Image *img, const unsigned int *clusters, unsigned int size, uint64_t seed, unsigned char *buffer, unsigned char *digest){
+    fillContent(buffer, size, seed);
+    SHA1(buffer, size, digest);
+    unsigned int count = (size + img->cluster_size - 1) / img->cluster_size;
+    for(unsigned int k = 0; k < count; k++){
+        unsigned int length = k + 1 < count ? img->cluster_size : size - k * img->cluster_size;
+        if(writeAt(img, buffer + (size_t)k * img->cluster_size, length, clusterAt(img, clusters[k])) != 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void makeEntry(DirEntry *entry, const char *name, const char *ext, unsigned char attr, unsigned int cluster, unsigned int size){
+    memset(entry, 0, sizeof(*entry));
+    memset(entry->DIR_Name, ' ', sizeof(entry->DIR_Name));
+    memcpy(entry->DIR_Name, name, strlen(name));
+    memcpy(entry->DIR_Name + 8, ext, strlen(ext));
+    entry->DIR_Attr = attr;
+    entry->DIR_FstClusHI = (unsigned short)(cluster >> 16);
+    entry->DIR_FstClusLO = (unsigned short)(cluster & 0xFFFF);
+    entry->DIR_FileSize = size;
+}
+
+static void printPath(FILE *out, const BenchDir *dirs, unsigned int d){
+    if(d > 0){
+        printPath(out, dirs, dirs[d].parent);
+        fprintf(out, "/D%07u", d);
+    }
+}
+
+static int writeBootSector(const Image *img){
+    unsigned char sector[SECTOR_SIZE] = {0};
+    BootEntry bs;
+    memset(&bs, 0, sizeof(bs));
+    memcpy(bs.BS_jmpBoot, "\xEB\x58\x90", 3);
+    memcpy(bs.BS_OEMName, "NYUBENCH", 8);
+    bs.BPB_BytsPerSec = SECTOR_SIZE;
+    bs.BPB_SecPerClus = (unsigned char)(img->cluster_size / SECTOR_SIZE);
+    bs.BPB_RsvdSecCnt = RESERVED_SECTORS;
+    bs.BPB_NumFATs = 2;
+    bs.BPB_Media = 0xF8;
+    bs.BPB_SecPerTrk = 32;
+    bs.BPB_NumHeads = 64;
+    bs.BPB_TotSec32 = (unsigned int)(img->size / SECTOR_SIZE);
+    bs.BPB_FATSz32 = img->fat_sectors;
+    bs.BPB_RootClus = 2;
+    bs.BPB_FSInfo = 1;
+    bs.BPB_BkBootSec = 6;
+    bs.BS_DrvNum = 0x80;
+    bs.BS_BootSig = 0x29;
+    bs.BS_VolID = 0x4E595542;
+    memcpy(bs.BS_VolLab, "BENCH      ", 11);
+    memcpy(bs.BS_FilSysType, "FAT32   ", 8);
+    memcpy(sector, &bs, sizeof(bs));
+    sector[510] = 0x55;
+    sector[511] = 0xAA;
+    if(writeAt(img, sector, sizeof(sector), 0) != 0){
+        return -1;
+    }
+    return writeAt(img, sector, sizeof(sector), (uint64_t)bs.BPB_BkBootSec * SECTOR_SIZE);
+}
+
+static int writeFats(const Image *img){
+    size_t length = ((size_t)img->cluster_count + 2) * sizeof(uint32_t);
+    for(unsigned int fat_num = 0; fat_num < 2; fat_num++){
+        uint64_t offset = ((uint64_t)RESERVED_SECTORS + (uint64_t)fat_num * img->fat_sectors) * SECTOR_SIZE;
+        if(writeAt(img, img->fat, length, offset) != 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv){
+    uint64_t size = (uint64_t)64 << 20;
+    unsigned int cluster_size = 4096, depth = 2, width = 4, live_files = 1000, deleted_files = 100;
+    unsigned int max_file = 0, frag_percent = 0, seed = 1;
+    const char *manifest_path = NULL;
+    int option;
+    while((option = getopt(argc, argv, "s:c:d:w:n:x:z:f:S:m:")) != -1){
+        int bad = 0;
+        switch(option){
+            case 's': bad = parseSize(optarg, &size); break;
+            case 'c': bad = parseNumber(optarg, &cluster_size); break;
+            case 'd': bad = parseNumber(optarg, &depth); break;
+            case 'w': bad = parseNumber(optarg, &width); break;
+            case 'n': bad = parseNumber(optarg, &live_files); break;
+            case 'x': bad = parseNumber(optarg, &deleted_files); break;
+            case 'z': bad = parseNumber(optarg, &max_file); break;
+            case 'f': bad = parseNumber(optarg, &frag_percent) || frag_percent > 100; break;
+            case 'S': bad = parseNumber(optarg, &seed); break;
+            case 'm': manifest_path = optarg; break;
+            default: bad = 1; break;
+        }
+        if(bad){
+            fprintf(stderr, "%s", usage_message);
+            return 1;
+        }
+    }
+    if(optind + 1 != argc || cluster_size < SECTOR_SIZE || cluster_size > 65536 || (cluster_size & (cluster_size - 1)) != 0){
+        fprintf(stderr, "%s", usage_message);
+        return 1;
+    }
+    const char *image_path = argv[optind];
+    char *default_manifest = NULL;
+    if(manifest_path == NULL){
+        default_manifest = malloc(strlen(image_path) + sizeof(".files"));
+        if(default_manifest == NULL){
+            perror("Error allocating memory");
+            return 1;
+        }
+        sprintf(default_manifest, "%s.files", image_path);
+        manifest_path = default_manifest;
+    }
+    if(max_file == 0){
+        max_file = 8 * cluster_size;
+    }
+
+    Image img = {0};
+    img.size = size - size % SECTOR_SIZE;
+    img.cluster_size = cluster_size;
+    img.frag_percent = frag_percent;
+    img.rng.state = (uint64_t)seed * 0x9E3779B97F4A7C15ULL + 0x1234567;
+    if(planGeometry(&img) != 0){
+        return 1;
+    }
+
+    // The directory tree, breadth first: every directory above the last
+    // level has width children
+    unsigned int dir_count = 1, level_count = 1;
+    for(unsigned int level = 0; level < depth && width > 0; level++){
+        uint64_t next = (uint64_t)level_count * width;
+        if(dir_count + next > MAX_DIRS){
+            fprintf(stderr, "Too many directories\n");
+            return 1;
+        }
+        dir_count += (unsigned int)next;
+        level_count = (unsigned int)next;
+    }
+    BenchDir *dirs = calloc(dir_count, sizeof(BenchDir));
+    unsigned int *sizes = malloc(((size_t)live_files + deleted_files) * sizeof(unsigned int));
+    unsigned int *clusters = malloc(((size_t)max_file / cluster_size + 2) * sizeof(unsigned int));
+    unsigned char *buffer = malloc((size_t)max_file + 8);
+    if(dirs == NULL || sizes == NULL || clusters == NULL || buffer == NULL){
+        perror("Error allocating memory");
+        return 1;
+    }
+    unsigned int made = 1;
+    for(unsigned int d = 0; d < dir_count && made < dir_count; d++){
+        dirs[d].first_child = made;
+        for(unsigned int c = 0; c < width && made < dir_count; c++){
+            dirs[made].parent = d;
+            dirs[d].child_count++;
+            made++;
+        }
+    }
+
+    // Files are dealt round-robin over the directories; file n of either
+    // kind lives in directory n % dir_count
+    uint64_t needed = FRAG_TARGET_CLUSTERS + 1;
+    for(unsigned int f = 0; f < live_files + deleted_files; f++){
+        sizes[f] = 1 + randomBelow(&img.rng, max_file);
+        needed += (sizes[f] + cluster_size - 1) / cluster_size + 3;
+    }
+    for(unsigned int d = 0; d < dir_count; d++){
+        unsigned int files_here = live_files / dir_count + (d < live_files % dir_count)
+                                + deleted_files / dir_count + (d < deleted_files % dir_count);
+        dirs[d].entry_count = (d ? 2 : 1) + dirs[d].child_count + files_here;
+        dirs[d].cluster_total = ((uint64_t)dirs[d].entry_count * sizeof(DirEntry) + cluster_size - 1) / cluster_size;
+        needed += dirs[d].cluster_total + 3;
+        dirs[d].clusters = malloc(dirs[d].cluster_total * sizeof(unsigned int));
+        if(dirs[d].clusters == NULL){
+            perror("Error allocating memory");
+            return 1;
+        }
+    }
+    if(needed > img.cluster_count){
+        fprintf(stderr, "Image too small for the requested files\n");
+        return 1;
+    }
+    // Spread the objects over the whole image, keeping half the slack free
+    img.stride = (unsigned int)((img.cluster_count - needed) / 2 / (dir_count + live_files + deleted_files + 1));
+
+    img.fd = open(image_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(img.fd < 0 || ftruncate(img.fd, (off_t)img.size) != 0){
+        perror("Error creating image");
+        return 1;
+    }
+    FILE *manifest = fopen(manifest_path, "w");
+    if(manifest == NULL){
+        perror("Error creating manifest");
+        return 1;
+    }
+
+    // The root starts at cluster 2 and the -R target follows it, out of
+    // order, so a non-contiguous search always has a fragmented file
+    // within its budget
+    img.cursor = 2;
+    int status = 0;
+    unsigned int root_first = img.cursor++;
+    unsigned int frag_clusters[FRAG_TARGET_CLUSTERS];
+    for(unsigned int k = 0; k < FRAG_TARGET_CLUSTERS; k++){
+        frag_clusters[k] = img.cursor + (k % 2 ? k - 1 : k + 1);
+    }
+    img.cursor += FRAG_TARGET_CLUSTERS;
+    unsigned int frag_size = (FRAG_TARGET_CLUSTERS - 1) * cluster_size + cluster_size / 2;
+    unsigned char frag_digest[SHA_DIGEST_LENGTH];
+    unsigned char *frag_buffer = malloc((size_t)FRAG_TARGET_CLUSTERS * cluster_size);
+    if(frag_buffer == NULL){
+        perror("Error allocating memory");
+        return 1;
+    }
+    status = writeFile(&img, frag_clusters, frag_size, (uint64_t)seed << 32, frag_buffer, frag_digest);
+    free(frag_buffer);
+
+    for(unsigned int d = 0; status == 0 && d < dir_count; d++){
+        BenchDir *dir = &dirs[d];
+        if(d == 0){
+            // The root keeps cluster 2 and continues wherever the cursor is
+            dir->clusters[0] = root_first;
+            if(dir->cluster_total > 1){
+                status = allocClusters(&img, dir->cluster_total - 1, 0, dir->clusters + 1);
+            }
+            for(unsigned int k = 0; k < dir->cluster_total; k++){
+                img.fat[dir->clusters[k]] = k + 1 < dir->cluster_total ? dir->clusters[k + 1] : FAT_EOC;
+            }
+        }else{
+            status = allocClusters(&img, dir->cluster_total, 1, dir->clusters);
+        }
+    }
+
+    // Directory contents are built one directory at a time, files included
+    for(unsigned int d = 0; status == 0 && d < dir_count; d++){
+        BenchDir *dir = &dirs[d];
+        DirEntry *entries = calloc((size_t)dir->cluster_total * cluster_size / sizeof(DirEntry), sizeof(DirEntry));
+        if(entries == NULL){
+            perror("Error allocating memory");
+            status = -1;
+            break;
+        }
+        unsigned int count = 0;
+        char name[16];
+        if(d > 0){
+            unsigned int parent_cluster = dir->parent ? dirs[dir->parent].clusters[0] : 0;
+            makeEntry(&entries[count++], ".", "", 0x10, dir->clusters[0], 0);
+            makeEntry(&entries[count++], "..", "", 0x10, parent_cluster, 0);
+        }else{
+            makeEntry(&entries[count], "RFRAG", "DAT", 0x20, frag_clusters[0], frag_size);
+            entries[count++].DIR_Name[0] = 0xE5;
+            fprintf(manifest, "/RFRAG.DAT ");
+            for(int b = 0; b < SHA_DIGEST_LENGTH; b++){
+                fprintf(manifest, "%02x", frag_digest[b]);
+            }
+            fprintf(manifest, " fragmented\n");
+        }
+        for(unsigned int c = 0; c < dir->child_count; c++){
+            unsigned int child = dir->first_child + c;
+            snprintf(name, sizeof(name), "D%07u", child);
+            makeEntry(&entries[count++], name, "", 0x10, dirs[child].clusters[0], 0);
+        }
+        for(unsigned int kind = 0; status == 0 && kind < 2; kind++){
+            unsigned int first = kind ? live_files : 0;
+            unsigned int total = kind ? deleted_files : live_files;
+            for(unsigned int n = d; status == 0 && n < total; n += dir_count){
+                unsigned int f = first + n;
+                unsigned int file_clusters = (sizes[f] + cluster_size - 1) / cluster_size;
+                status = allocClusters(&img, file_clusters, !kind, clusters);
+                if(status != 0){
+                    break;
+                }
+                // Anything but a straight run of clusters is fragmented
+                int fragmented = clusters[file_clusters - 1] - clusters[0] != file_clusters - 1;
+                unsigned char digest[SHA_DIGEST_LENGTH];
+                status = writeFile(&img, clusters, sizes[f], ((uint64_t)seed << 32) + f + 1, buffer, digest);
+                snprintf(name, sizeof(name), "%c%07u", kind ? 'R' : 'F', n + 1);
+                makeEntry(&entries[count], name, "DAT", 0x20, clusters[0], sizes[f]);
+                if(kind){
+                    entries[count].DIR_Name[0] = 0xE5;
+                    printPath(manifest, dirs, d);
+                    fprintf(manifest, "/%s.DAT ", name);
+                    for(int b = 0; b < SHA_DIGEST_LENGTH; b++){
+                        fprintf(manifest, "%02x", digest[b]);
+                    }
+                    fprintf(manifest, " %s\n", fragmented ? "fragmented" : "contiguous");
+                }
+                count++;
+            }
+        }
+        for(unsigned int k = 0; status == 0 && k < dir->cluster_total; k++){
+            status = writeAt(&img, (unsigned char *)entries + (size_t)k * cluster_size, cluster_size, clusterAt(&img, dir->clusters[k]));
+        }
+        free(entries);
+    }
+
+    if(status == 0){
+        status = writeFats(&img);
+    }
+    if(status == 0){
+        status = writeBootSector(&img);
+    }
+    if(fclose(manifest) != 0 || close(img.fd) != 0){
+        perror("Error closing image");
+        status = -1;
+    }
+    for(unsigned int d = 0; d < dir_count; d++){
+        free(dirs[d].clusters);
+    }
+    free(dirs);
+    free(sizes);
+    free(clusters);
+    free(buffer);
+    free(img.fat);
+    free(default_manifest);
+    return status == 0 ? 0 : 1;
+}
@@ -0,0 +1,102 @@
+#!/bin/bash
+# Time nyufile on generated FAT32 images of growing size.
+#
+#   bench/run.sh [size...]          sizes default to "64M 256M 1G"
+#
+# Every run prints one JSON object per line, on stdout and to the results
+# file, so two result files can be compared by any script. Recovery modes
+# run with --dry-run, which does all the searching but leaves the image as
+# generated. Settings come from the environment:
+#
+#   BENCH_DIR       where images are built (default bench/images)
+#   BENCH_RESULTS   results file (default bench/results.jsonl, appended)
+#   BENCH_REPEAT    runs per mode (default 3)
+#   BENCH_CLUSTER   cluster size in bytes (default 4096)
+#   BENCH_FILES_PER_GB, BENCH_DELETED_PER_GB  files per GB of image
+#                   (default 4000 and 400, at least 200 and 20)
+#   BENCH_DEPTH, BENCH_WIDTH, BENCH_FRAG  passed to mkfat32 -d, -w and -f
+#   BENCH_ARGS      extra nyufile options, such as --io=direct or --cache
+#   BENCH_KEEP      set to 1 to keep the images afterwards
+
+cd "$(dirname "$0")/.." || exit 1
+NYUFILE=./nyufile
+MKFAT32=bench/mkfat32
+DIR=${BENCH_DIR:-bench/images}
+RESULTS=${BENCH_RESULTS:-bench/results.jsonl}
+REPEAT=${BENCH_REPEAT:-3}
+CLUSTER=${BENCH_CLUSTER:-4096}
+FILES_PER_GB=${BENCH_FILES_PER_GB:-4000}
+DELETED_PER_GB=${BENCH_DELETED_PER_GB:-400}
+DEPTH=${BENCH_DEPTH:-2}
+WIDTH=${BENCH_WIDTH:-4}
+FRAG=${BENCH_FRAG:-10}
+SIZES=${*:-64M 256M 1G}
+REVISION=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+if [ ! -x $NYUFILE ] || [ ! -x $MKFAT32 ]; then
+    echo "Build nyufile and $MKFAT32 first (make bench)" >&2
+    exit 1
+fi
+mkdir -p "$DIR" || exit 1
+
+bytes() {
+    numfmt --from=iec "$1"
+}
+
+now() {
+    date +%s.%N
+}
+
+# seconds since a time from now()
+since() {
+    awk -v start="$1" -v end="$(now)" 'BEGIN { printf "%.6f", end - start }'
+}
+
+# run <image> <mode> <expect> <nyufile options...>
+# expect is text the output must contain for the run to count as ok
+run() {
+    local image=$1 mode=$2 expect=$3
+    shift 3
+    for ((n = 1; n <= REPEAT; n++)); do
+        local start seconds output status ok
+        start=$(now)
+        output=$($NYUFILE "$image" "$@" $BENCH_ARGS 2>&1)
+        status=$?
+        seconds=$(since "$start")
+        ok=false
+        if [ $status -eq 0 ] && grep -q -- "$expect" <<< "$output"; then
+            ok=true
+        fi
+        printf '{"revision":"%s","size":"%s","bytes":%s,"cluster":%s,"files":%s,"deleted":%s,"mode":"%s","args":"%s","run":%d,"seconds":%s,"status":%d,"ok":%s}\n' \
+            "$REVISION" "$SIZE" "$(bytes "$SIZE")" "$CLUSTER" "$FILES" "$DELETED" "$mode" "$BENCH_ARGS" \
+            $n "$seconds" $status $ok | tee -a "$RESULTS"
+    done
+}
+
+for SIZE in $SIZES; do
+    mb=$(( $(bytes "$SIZE") >> 20 ))
+    FILES=$(( mb * FILES_PER_GB / 1024 > 200 ? mb * FILES_PER_GB / 1024 : 200 ))
+    DELETED=$(( mb * DELETED_PER_GB / 1024 > 20 ? mb * DELETED_PER_GB / 1024 : 20 ))
+    image=$DIR/bench-$SIZE.img
+    start=$(now)
+    if ! $MKFAT32 -s "$SIZE" -c "$CLUSTER" -d "$DEPTH" -w "$WIDTH" -n "$FILES" -x "$DELETED" -f "$FRAG" "$image"; then
+        exit 1
+    fi
+    echo "Generated $image in $(since "$start") s" >&2
+
+    # Recovery targets come from the generator's manifest of deleted files
+    read -r contiguous contiguous_sha1 _ < <(grep ' contiguous$' "$image.files" | tail -1)
+    read -r _ fragmented_sha1 _ < <(grep '^/RFRAG.DAT ' "$image.files")
+    grep ' contiguous$' "$image.files" | cut -d' ' -f1,2 > "$image.batch"
+
+    run "$image" list "(starting cluster" -l
+    run "$image" list-recursive "(starting cluster" -l --recursive
+    run "$image" recover "successfully recovered" -r "$contiguous" --dry-run
+    run "$image" recover-sha1 "successfully recovered with SHA-1" -r "$contiguous" -s "$contiguous_sha1" --dry-run
+    run "$image" recover-fragmented "successfully recovered with SHA-1" -R RFRAG.DAT -s "$fragmented_sha1" --dry-run
+    run "$image" batch "successfully recovered" -b "$image.batch" --dry-run
+
+    if [ "$BENCH_KEEP" != 1 ]; then
+        rm -f "$image" "$image.files" "$image.batch" "$image.nyucache"
+    fi
+done
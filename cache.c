@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "dirindex.h"
+#include "freemap.h"
+#include "window.h"
+#include "chain.h"
+
+// The sidecar file is the header followed by fixed-order sections, each
+// padded to 8 bytes so every array can be used in place from a mapping.
+// The image is identified by its volume ID, size and geometry; the cache
+// is only trusted while the active FAT and every directory cluster still hash to
+// the fingerprints recorded here.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t vol_id;
+    uint64_t image_size;
+    uint64_t fat_fingerprint;
+    uint64_t dir_fingerprint;
+    uint32_t cluster_size;
+    uint32_t cluster_count;
+    uint64_t entry_count;
+    uint64_t bucket_count;
+    uint64_t paths_used;
+    uint64_t run_count;
+    uint32_t free_count;
+    uint32_t reserved;
+} CacheHeader;
+
+static const char cache_magic[8] = { 'N', 'Y', 'U', 'C', 'A', 'C', 'H', 'E' };
+
+typedef struct {
+    void **array;
+    size_t elem_size;
+} SlotSection;
+
+#define SLOT_SECTION(field) { (void **)&(field), sizeof(*(field)) }
+
+// Every per-slot array of the index except the entry offsets, which are
+// stored first.
+static size_t slotSections(DirIndex *index, SlotSection *sections){
+    SlotSection all[] = {
+        SLOT_SECTION(index->parent),
+        SLOT_SECTION(index->dir_path),
+        SLOT_SECTION(index->first_cluster),
+        SLOT_SECTION(index->size),
+        SLOT_SECTION(index->attr),
+        SLOT_SECTION(index->wrt_date),
+        SLOT_SECTION(index->wrt_time),
+        SLOT_SECTION(index->names),
+        SLOT_SECTION(index->next_same_key),
+        SLOT_SECTION(index->long_name),
+        SLOT_SECTION(index->lfn_parts),
+        SLOT_SECTION(index->short_first),
+        SLOT_SECTION(index->next_same_long),
+        SLOT_SECTION(index->digests),
+        SLOT_SECTION(index->has_digest),
+    };
+    memcpy(sections, all, sizeof(all));
+    return sizeof(all) / sizeof(all[0]);
+}
+
+// Word-at-a-time multiplicative hash; only needs to notice changes
+static uint64_t fingerprint(uint64_t hash, const unsigned char *data, size_t len){
+    size_t n = 0;
+    for(; n + 8 <= len; n += 8){
+        uint64_t word;
+        memcpy(&word, data + n, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 29;
+    }
+    for(; n < len; n++){
+        hash = (hash ^ data[n]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static uint64_t fatFingerprint(const Volume *vol){
+    return fingerprint(0xCBF29CE484222325ULL, vol->fat, vol->fat_size);
+}
+
+static uint64_t chainFingerprint(const Volume *vol, uint64_t hash, unsigned int cluster){
+    unsigned int max_extent = VIEW_CHUNK / vol->cluster_size ? (unsigned int)(VIEW_CHUNK / vol->cluster_size) : 1;
+    ChainWalk walk;
+    ChainExtent extent;
+    startChain(&walk, vol, cluster, max_extent);
+    while(nextExtent(&walk, &extent)){
+        VolumeView view;
+        const unsigned char *data = viewClusters(vol, extent.first, extent.count, &view);
+        if(data == NULL){
+            // An unreadable directory never matches a recorded fingerprint
+            return hash ^ 1;
+        }
+        // Cluster by cluster, so the fingerprint does not depend on how
+        // the chain was split
+        for(unsigned int c = 0; c < extent.count; c++){
+            hash = fingerprint(hash ^ (extent.first + c), data + (size_t)c * vol->cluster_size, vol->cluster_size);
+        }
+        releaseView(vol, &view);
+    }
+    return hash;
+}
+
+// Hash the contents of the root directory and of every live directory the
+// index knows about. A new, renamed or deleted entry changes some cluster
+// here even when the FAT stays the same.
+static uint64_t dirFingerprint(const Volume *vol, const DirIndex *index){
+    uint64_t hash = chainFingerprint(vol, 0xCBF29CE484222325ULL, vol->bs.BPB_RootClus);
+    for(size_t slot = 0; slot < index->count; slot++){
+        if((unsigned char)index->names[slot][0] != 0xE5 && (index->attr[slot] & 0x10) && index->first_cluster[slot] != 0){
+            hash = chainFingerprint(vol, hash, index->first_cluster[slot]);
+        }
+    }
+    return hash;
+}
+
+static int writeSection(FILE *out, const void *data, size_t len){
+    static const unsigned char padding[8] = {0};
+    if(len > 0 && fwrite(data, 1, len, out) != len){
+        return -1;
+    }
+    size_t pad = (8 - len % 8) % 8;
+    return pad > 0 && fwrite(padding, 1, pad, out) != pad ? -1 : 0;
+}
+
+typedef struct {
+    const unsigned char *data;
+    size_t size;
+    size_t offset;
+} CacheReader;
+
+// Next section of len bytes, or NULL when the file is truncated
+static const void *readSection(CacheReader *reader, size_t len){
+    if(len > reader->size - reader->offset){
+        return NULL;
+    }
+    const void *section = reader->data + reader->offset;
+    size_t padded = len + (8 - len % 8) % 8;
+    reader->offset = padded > reader->size - reader->offset ? reader->size : reader->offset + padded;
+    return section;
+}
+
+static int sameImage(const Volume *vol, const CacheHeader *header){
+    return memcmp(header->magic, cache_magic, sizeof(cache_magic)) == 0 &&
+        header->version == CACHE_VERSION &&
+        header->vol_id == vol->bs.BS_VolID &&
+        header->image_size == vol->disk->size &&
+        header->cluster_size == vol->cluster_size &&
+        header->cluster_count == vol->cluster_count;
+}
+
+// Rebuild the index from the mapped sections, checking every value that
+// is later used as a pointer or array index.
+static DirIndex *readIndex(const Volume *vol, const CacheHeader *header, CacheReader *reader){
+    size_t count = header->entry_count;
+    DirIndex *index = calloc(1, sizeof(DirIndex));
+    if(index == NULL || reserveDirIndex(index, count ? count : 1) != 0){
+        perror("Error allocating memory");
+        freeDirIndex(index);
+        return NULL;
+    }
+    index->count = count;
+    index->complete = 1;
+
+    const uint64_t *offsets = readSection(reader, count * sizeof(uint64_t));
+    int valid = offsets != NULL;
+    for(size_t slot = 0; valid && slot < count; slot++){
+        valid = offsets[slot] >= vol->data_offset && offsets[slot] <= vol->disk->size - sizeof(DirEntry);
+        if(valid){
+            index->entry_offset[slot] = offsets[slot];
+        }
+    }
+    SlotSection sections[16];
+    size_t section_count = slotSections(index, sections);
+    for(size_t s = 0; valid && s < section_count; s++){
+        const void *data = readSection(reader, count * sections[s].elem_size);
+        valid = data != NULL;
+        if(valid && count > 0){
+            memcpy(*sections[s].array, data, count * sections[s].elem_size);
+        }
+    }
+
+    size_t bucket_count = header->bucket_count;
+    const int32_t *buckets = valid ? readSection(reader, bucket_count * sizeof(int32_t)) : NULL;
+    const int32_t *long_buckets = buckets ? readSection(reader, bucket_count * sizeof(int32_t)) : NULL;
+    const char *paths = long_buckets ? readSection(reader, header->paths_used) : NULL;
+    // Sizes come from the file, so only allocate once the sections exist
+    if(paths != NULL){
+        index->buckets = malloc((bucket_count ? bucket_count : 1) * sizeof(int32_t));
+        index->long_buckets = malloc((bucket_count ? bucket_count : 1) * sizeof(int32_t));
+        index->paths = malloc(header->paths_used ? header->paths_used : 1);
+    }
+    valid = paths != NULL && index->buckets != NULL && index->long_buckets != NULL && index->paths != NULL &&
+        bucket_count > 0 && (bucket_count & (bucket_count - 1)) == 0 &&
+        header->paths_used > 0 && paths[header->paths_used - 1] == '\0';
+    if(valid){
+        memcpy(index->buckets, buckets, bucket_count * sizeof(int32_t));
+        memcpy(index->long_buckets, long_buckets, bucket_count * sizeof(int32_t));
+        memcpy(index->paths, paths, header->paths_used);
+        index->bucket_count = bucket_count;
+        index->paths_used = index->paths_cap = header->paths_used;
+    }
+    for(size_t b = 0; valid && b < bucket_count; b++){
+        valid = index->buckets[b] >= -1 && index->buckets[b] < (int64_t)count &&
+            index->long_buckets[b] >= -1 && index->long_buckets[b] < (int64_t)count;
+    }
+    for(size_t slot = 0; valid && slot < count; slot++){
+        valid = index->next_same_key[slot] >= -1 && index->next_same_key[slot] < (int64_t)count &&
+            index->next_same_long[slot] >= -1 && index->next_same_long[slot] < (int64_t)count &&
+            (index->long_name[slot] == DIR_INDEX_NO_NAME || index->long_name[slot] < header->paths_used) &&
+            index->dir_path[slot] < header->paths_used && memchr(index->names[slot], '\0', 13) != NULL &&
+            index->entry_offset[slot] - vol->data_offset >= (uint64_t)index->lfn_parts[slot] * sizeof(DirEntry);
+    }
+    if(!valid){
+        freeDirIndex(index);
+        return NULL;
+    }
+    return index;
+}
+
+static FreeMap *readFreeMap(const Volume *vol, const CacheHeader *header, CacheReader *reader){
+    size_t words = ((size_t)vol->cluster_count + 63) / 64;
+    const uint64_t *bits = readSection(reader, words * sizeof(uint64_t));
+    const ClusterRun *runs = bits ? readSection(reader, header->run_count * sizeof(ClusterRun)) : NULL;
+    if(runs == NULL){
+        return NULL;
+    }
+    FreeMap *map = calloc(1, sizeof(FreeMap));
+    if(map == NULL ||
+       (map->bits = malloc((words ? words : 1) * sizeof(uint64_t))) == NULL ||
+       (map->runs = malloc((header->run_count ? header->run_count : 1) * sizeof(ClusterRun))) == NULL){
+        perror("Error allocating memory");
+        freeFreeMap(map);
+        return NULL;
+    }
+    memcpy(map->bits, bits, words * sizeof(uint64_t));
+    memcpy(map->runs, runs, header->run_count * sizeof(ClusterRun));
+    map->cluster_count = vol->cluster_count;
+    map->free_count = header->free_count;
+    map->run_count = header->run_count;
+    return map;
+}
+
+// Install the directory index and free map from cache_path when it still
+// describes this image. Returns 0 when the cache was used and 1 when it
+// is missing or stale, in which case everything is rebuilt as usual.
+int loadScanCache(Volume *vol, const char *cache_path){
+    int fd = open(cache_path, O_RDONLY);
+    if(fd < 0){
+        return 1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(CacheHeader)){
+        close(fd);
+        return 1;
+    }
+    unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED){
+        return 1;
+    }
+
+    CacheReader reader = { data, (size_t)st.st_size, 0 };
+    const CacheHeader *header = readSection(&reader, sizeof(CacheHeader));
+    DirIndex *index = NULL;
+    FreeMap *map = NULL;
+    // The FAT is checked first: it is cheaper than decoding the sections
+    if(sameImage(vol, header) && header->fat_fingerprint == fatFingerprint(vol)){
+        index = readIndex(vol, header, &reader);
+        map = index ? readFreeMap(vol, header, &reader) : NULL;
+    }
+    int stale = map == NULL || dirFingerprint(vol, index) != header->dir_fingerprint;
+    munmap(data, st.st_size);
+    if(stale){
+        freeDirIndex(index);
+        freeFreeMap(map);
+        return 1;
+    }
+
+    freeDirIndex(vol->dir_index);
+    freeFreeMap(vol->free_map);
+    vol->dir_index = index;
+    vol->free_map = map;
+    return 0;
+}
+
+// Write the directory index, a fresh free map and every digest computed
+// so far to cache_path. Nothing is written when the loaded cache is still
+// current. The file is replaced atomically so a reader never sees half of it.
+int saveScanCache(Volume *vol, const char *cache_path){
+    DirIndex *index = vol->dir_index;
+    if(index == NULL || !index->dirty){
+        return 0;
+    }
+    // A command that named its files only read their directories
+    if(!index->complete && (index = getDirIndex(vol)) == NULL){
+        return -1;
+    }
+    // Restores leave the run list behind the bitmap, so rescan the active FAT
+    FreeMap *map = buildFreeMap(vol);
+    size_t tmp_len = strlen(cache_path) + 5;
+    char *tmp_path = malloc(tmp_len);
+    if(map == NULL || tmp_path == NULL){
+        perror("Error allocating memory");
+        freeFreeMap(map);
+        free(tmp_path);
+        return -1;
+    }
+    snprintf(tmp_path, tmp_len, "%s.tmp", cache_path);
+
+    CacheHeader header = {0};
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    header.version = CACHE_VERSION;
+    header.vol_id = vol->bs.BS_VolID;
+    header.image_size = vol->disk->size;
+    header.fat_fingerprint = fatFingerprint(vol);
+    header.dir_fingerprint = dirFingerprint(vol, index);
+    header.cluster_size = vol->cluster_size;
+    header.cluster_count = vol->cluster_count;
+    header.entry_count = index->count;
+    header.bucket_count = index->bucket_count;
+    header.paths_used = index->paths_used;
+    header.run_count = map->run_count;
+    header.free_count = map->free_count;
+
+    int status = -1;
+    FILE *out = fopen(tmp_path, "wb");
+    if(out != NULL){
+        SlotSection sections[16];
+        size_t section_count = slotSections(index, sections);
+        status = writeSection(out, &header, sizeof(header));
+        status |= writeSection(out, index->entry_offset, index->count * sizeof(uint64_t));
+        for(size_t s = 0; s < section_count; s++){
+            status |= writeSection(out, *sections[s].array, index->count * sections[s].elem_size);
+        }
+        status |= writeSection(out, index->buckets, index->bucket_count * sizeof(int32_t));
+        status |= writeSection(out, index->long_buckets, index->bucket_count * sizeof(int32_t));
+        status |= writeSection(out, index->paths, index->paths_used);
+        status |= writeSection(out, map->bits, ((size_t)map->cluster_count + 63) / 64 * sizeof(uint64_t));
+        status |= writeSection(out, map->runs, map->run_count * sizeof(ClusterRun));
+        if(fclose(out) != 0){
+            status = -1;
+        }
+    }
+    if(status == 0 && rename(tmp_path, cache_path) != 0){
+        status = -1;
+    }
+    if(status != 0){
+        perror("Error writing cache");
+        unlink(tmp_path);
+    }else{
+        index->dirty = 0;
+    }
+    freeFreeMap(map);
+    free(tmp_path);
+    return status;
+}
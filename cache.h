@@ -0,0 +1,12 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include "volume.h"
+
+#define CACHE_SUFFIX ".nyucache"
+#define CACHE_VERSION 2
+
+int loadScanCache(Volume *vol, const char *cache_path);
+int saveScanCache(Volume *vol, const char *cache_path);
+
+#endif
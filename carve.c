@@ -0,0 +1,516 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "carve.h"
+#include "freemap.h"
+#include "verify.h"
+#include "window.h"
+#include "stats.h"
+
+// Where a carved file ends
+enum {
+    CARVE_END_FIRST,            // at the first footer
+    CARVE_END_LAST,             // at the last footer before another file of the type
+    CARVE_END_JPEG,             // at the end of image that follows the last scan
+};
+
+// A file type recognised by the bytes it starts and ends with
+typedef struct {
+    const char *ext;
+    const char *header;
+    size_t header_len;
+    const char *footer;
+    size_t footer_len;
+    size_t trailer;             // bytes after the footer that still belong to the file
+    size_t length_field;        // offset in the footer of a 16-bit count of further bytes, or 0
+    int eol;                    // a line ending after the footer belongs to the file
+    int end;                    // CARVE_END_*
+    uint64_t max_size;
+} Signature;
+
+static const Signature signatures[] = {
+    // An EXIF thumbnail has an end of image of its own, so the markers are
+    // followed instead of looking for the footer
+    { "jpg", "\xFF\xD8\xFF", 3, "\xFF\xD9", 2, 0, 0, 0, CARVE_END_JPEG, (uint64_t)32 << 20 },
+    { "png", "\x89PNG\r\n\x1A\n", 8, "IEND\xAE\x42\x60\x82", 8, 0, 0, 0, CARVE_END_FIRST, (uint64_t)64 << 20 },
+    // A PDF updated in place ends each revision with %%EOF
+    { "pdf", "%PDF-", 5, "%%EOF", 5, 0, 0, 1, CARVE_END_LAST, (uint64_t)256 << 20 },
+    // The end of central directory record is 22 bytes plus its comment
+    { "zip", "PK\x03\x04", 4, "PK\x05\x06", 4, 18, 20, 0, CARVE_END_FIRST, (uint64_t)1 << 30 },
+};
+
+#define SIGNATURE_COUNT (sizeof(signatures) / sizeof(signatures[0]))
+
+// Free runs are cut into chunks of this many clusters so that a volume
+// with one huge free run still keeps every thread busy
+#define CARVE_CHUNK_CLUSTERS 4096
+
+typedef struct {
+    unsigned int start;         // first cluster of the chunk
+    unsigned int length;
+    unsigned int run_end;       // first cluster past the free run
+} CarveChunk;
+
+typedef struct {
+    unsigned int cluster;
+    uint64_t size;
+    unsigned int type;          // index into signatures
+} CarvedFile;
+
+typedef struct {
+    const Volume *vol;
+    CarveChunk *chunks;
+    size_t chunk_count;
+    unsigned char first_byte[256];  // signature index + 1 per leading byte
+    CarvedFile *found;
+    size_t found_count;
+    size_t found_cap;
+    pthread_mutex_t lock;           // guards found
+} CarveJobs;
+
+// Find the footer between from and end. memchr does the scanning, so the
+// search runs at the speed of the C library's vectorised byte search.
+static const unsigned char *findFooter(const Signature *sig, const unsigned char *from, const unsigned char *end){
+    const unsigned char first = (unsigned char)sig->footer[0];
+    while(from + sig->footer_len <= end){
+        const unsigned char *p = memchr(from, first, (size_t)(end - from) - sig->footer_len + 1);
+        if(p == NULL){
+            return NULL;
+        }
+        if(memcmp(p, sig->footer, sig->footer_len) == 0){
+            return p;
+        }
+        from = p + 1;
+    }
+    return NULL;
+}
+
+// Find the footer of a file starting at start whose bytes lie within span,
+// searching pieces one mapping window long. Pieces overlap by the footer
+// length so no footer is missed at a seam. With CARVE_END_LAST the search
+// goes on to the last footer before a cluster that starts with the header
+// again, since files only start on cluster boundaries.
+static int findFooterAt(const Volume *vol, const Signature *sig, uint64_t start, uint64_t span, uint64_t *footer_at){
+    int last = sig->end == CARVE_END_LAST;
+    int found = 0;
+    uint64_t pos = sig->header_len;
+    while(pos + sig->footer_len <= span){
+        size_t piece = span - pos < VIEW_CHUNK ? (size_t)(span - pos) : VIEW_CHUNK;
+        VolumeView view;
+        const unsigned char *data = viewRange(vol, start + pos, piece, &view);
+        if(data == NULL){
+            return -1;
+        }
+        const unsigned char *end = data + piece;
+        uint64_t boundary = (pos / vol->cluster_size + 1) * vol->cluster_size;
+        for(; last && boundary + sig->header_len <= pos + piece; boundary += vol->cluster_size){
+            if(memcmp(data + (boundary - pos), sig->header, sig->header_len) == 0){
+                end = data + (boundary - pos);
+                span = boundary;
+                break;
+            }
+        }
+        const unsigned char *footer = findFooter(sig, data, end);
+        for(; footer != NULL; footer = last ? findFooter(sig, footer + 1, end) : NULL){
+            *footer_at = pos + (uint64_t)(footer - data);
+            found = 1;
+        }
+        releaseView(vol, &view);
+        if((found && !last) || pos + piece >= span){
+            break;
+        }
+        pos += piece - (sig->footer_len - 1);
+    }
+    return found;
+}
+
+// Reads a file being carved a byte at a time, one mapping window at a time
+typedef struct {
+    const Volume *vol;
+    uint64_t start;             // where the file starts in the image
+    uint64_t span;              // bytes of it that may be read
+    VolumeView view;
+    const unsigned char *data;  // file bytes from to to, or NULL
+    uint64_t from;
+    uint64_t to;
+} CarveCursor;
+
+// Make pos readable. Returns 1, 0 past the span, or -1 on a read error.
+static int cursorSeek(CarveCursor *cursor, uint64_t pos){
+    if(pos >= cursor->span){
+        return 0;
+    }
+    if(cursor->data != NULL && pos >= cursor->from && pos < cursor->to){
+        return 1;
+    }
+    if(cursor->data != NULL){
+        releaseView(cursor->vol, &cursor->view);
+    }
+    size_t piece = cursor->span - pos < VIEW_CHUNK ? (size_t)(cursor->span - pos) : VIEW_CHUNK;
+    cursor->data = viewRange(cursor->vol, cursor->start + pos, piece, &cursor->view);
+    if(cursor->data == NULL){
+        return -1;
+    }
+    cursor->from = pos;
+    cursor->to = pos + piece;
+    return 1;
+}
+
+static int cursorByte(CarveCursor *cursor, uint64_t pos, unsigned char *byte){
+    int status = cursorSeek(cursor, pos);
+    if(status > 0){
+        *byte = cursor->data[pos - cursor->from];
+    }
+    return status;
+}
+
+// Move pos to the next 0xFF, with memchr doing the scanning
+static int cursorFindFF(CarveCursor *cursor, uint64_t *pos){
+    for(;;){
+        int status = cursorSeek(cursor, *pos);
+        if(status <= 0){
+            return status;
+        }
+        const unsigned char *here = cursor->data + (*pos - cursor->from);
+        const unsigned char *ff = memchr(here, 0xFF, (size_t)(cursor->to - *pos));
+        if(ff != NULL){
+            *pos += (uint64_t)(ff - here);
+            return 1;
+        }
+        *pos = cursor->to;
+    }
+}
+
+// Follow the markers of a JPEG from its start of image: segments are
+// skipped by their length fields, so a thumbnail inside APP1 is passed
+// over, and the entropy-coded data after each start of scan runs to the
+// first 0xFF that is not a stuffed zero or a restart marker. The file ends
+// with the end of image found this way.
+static int jpegLength(const Volume *vol, uint64_t start, uint64_t span, uint64_t *length){
+    CarveCursor cursor = { vol, start, span, { 0 }, NULL, 0, 0 };
+    uint64_t pos = 2;
+    int status;
+    for(;;){
+        unsigned char byte, marker;
+        if((status = cursorByte(&cursor, pos, &byte)) <= 0){
+            break;
+        }
+        if(byte != 0xFF){
+            status = 0;
+            break;
+        }
+        // Any number of 0xFF may pad a marker
+        do{
+            pos++;
+        }while((status = cursorByte(&cursor, pos, &marker)) > 0 && marker == 0xFF);
+        if(status <= 0){
+            break;
+        }
+        pos++;
+        if(marker == 0xD9){
+            *length = pos;
+            break;
+        }
+        if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)){
+            continue;
+        }
+        unsigned char high, low;
+        if(marker == 0x00 || (status = cursorByte(&cursor, pos, &high)) <= 0 || (status = cursorByte(&cursor, pos + 1, &low)) <= 0){
+            status = status > 0 ? 0 : status;
+            break;
+        }
+        unsigned int segment = (unsigned int)high << 8 | low;
+        if(segment < 2){
+            status = 0;
+            break;
+        }
+        pos += segment;
+        while(marker == 0xDA && (status = cursorFindFF(&cursor, &pos)) > 0 && (status = cursorByte(&cursor, pos + 1, &byte)) > 0){
+            if(byte != 0x00 && !(byte >= 0xD0 && byte <= 0xD7)){
+                break;
+            }
+            pos += 2;
+        }
+        if(status <= 0){
+            break;
+        }
+    }
+    if(cursor.data != NULL){
+        releaseView(vol, &cursor.view);
+    }
+    return status;
+}
+
+// Length of the file that starts at start, or 0 when no footer follows
+// within span bytes of the free run
+static int carvedLength(const Volume *vol, const Signature *sig, uint64_t start, uint64_t span, uint64_t *length){
+    if(span > sig->max_size){
+        span = sig->max_size;
+    }
+    *length = 0;
+    if(sig->end == CARVE_END_JPEG){
+        return jpegLength(vol, start, span, length);
+    }
+    uint64_t footer_at;
+    int found = findFooterAt(vol, sig, start, span, &footer_at);
+    if(found <= 0){
+        return found;
+    }
+    // The comment length and line ending sit within a few bytes of the footer
+    unsigned char tail[32] = {0};
+    size_t tail_len = span - footer_at < sizeof(tail) ? (size_t)(span - footer_at) : sizeof(tail);
+    VolumeView view;
+    const unsigned char *data = viewRange(vol, start + footer_at, tail_len, &view);
+    if(data == NULL){
+        return -1;
+    }
+    memcpy(tail, data, tail_len);
+    releaseView(vol, &view);
+
+    uint64_t end = span - footer_at;
+    uint64_t used = sig->footer_len + sig->trailer;
+    if(sig->length_field && sig->length_field + 2 <= end){
+        used += (uint64_t)tail[sig->length_field] | (uint64_t)tail[sig->length_field + 1] << 8;
+    }
+    for(int k = 0; sig->eol && k < 2 && used < tail_len; k++){
+        unsigned char c = tail[used];
+        if(!(c == '\n' || (c == '\r' && k == 0))){
+            break;
+        }
+        used++;
+        if(c == '\n'){
+            break;
+        }
+    }
+    *length = footer_at + (used > end ? end : used);
+    return 1;
+}
+
+static int addCarved(CarveJobs *jobs, unsigned int cluster, uint64_t size, unsigned int type){
+    pthread_mutex_lock(&jobs->lock);
+    int status = 0;
+    if(jobs->found_count == jobs->found_cap){
+        size_t cap = jobs->found_cap ? jobs->found_cap * 2 : 64;
+        CarvedFile *found = realloc(jobs->found, cap * sizeof(CarvedFile));
+        if(found == NULL){
+            perror("Error allocating memory");
+            status = -1;
+        }else{
+            jobs->found = found;
+            jobs->found_cap = cap;
+        }
+    }
+    if(status == 0){
+        jobs->found[jobs->found_count].cluster = cluster;
+        jobs->found[jobs->found_count].size = size;
+        jobs->found[jobs->found_count].type = type;
+        jobs->found_count++;
+    }
+    pthread_mutex_unlock(&jobs->lock);
+    return status;
+}
+
+// Files are allocated from cluster boundaries, so headers are only looked
+// for at the start of each free cluster; one table lookup on the first
+// byte picks the single signature that could match. The chunk is read in
+// slices of one mapping window. A file may run on past the chunk, up to
+// the end of its free run.
+static int carveChunk(CarveJobs *jobs, const CarveChunk *chunk){
+    const Volume *vol = jobs->vol;
+    unsigned int slice = VIEW_CHUNK / vol->cluster_size ? (unsigned int)(VIEW_CHUNK / vol->cluster_size) : 1;
+    unsigned int offset = 0;
+    int status = 0;
+    while(status == 0 && offset < chunk->length){
+        unsigned int count = chunk->length - offset < slice ? chunk->length - offset : slice;
+        VolumeView view;
+        const unsigned char *slice_data = viewClusters(vol, chunk->start + offset, count, &view);
+        if(slice_data == NULL){
+            return -1;
+        }
+        adviseRange(slice_data, (size_t)count * vol->cluster_size, MADV_SEQUENTIAL);
+        unsigned int k = 0;
+        while(status == 0 && k < count){
+            unsigned int cluster = chunk->start + offset + k;
+            const unsigned char *data = slice_data + (size_t)k * vol->cluster_size;
+            unsigned int type = jobs->first_byte[data[0]];
+            uint64_t length = 0;
+            if(type != 0){
+                const Signature *sig = &signatures[type - 1];
+                if(memcmp(data, sig->header, sig->header_len) == 0){
+                    uint64_t span = (uint64_t)(chunk->run_end - cluster) * vol->cluster_size;
+                    status = carvedLength(vol, sig, clusterOffset(vol, cluster), span, &length) < 0 ? -1 : 0;
+                }
+            }
+            if(status != 0 || length == 0){
+                k++;
+                continue;
+            }
+            status = addCarved(jobs, cluster, length, type - 1);
+            k += (unsigned int)((length + vol->cluster_size - 1) / vol->cluster_size);
+        }
+        releaseView(vol, &view);
+        statAdd(STAT_CLUSTERS_VISITED, k);
+        offset += k;
+    }
+    return status;
+}
+
+static int carveJob(void *ctx, size_t job){
+    CarveJobs *jobs = ctx;
+    return carveChunk(jobs, &jobs->chunks[job]);
+}
+
+static int compareCarved(const void *a, const void *b){
+    unsigned int x = ((const CarvedFile *)a)->cluster, y = ((const CarvedFile *)b)->cluster;
+    return x < y ? -1 : x > y;
+}
+
+static CarveChunk *splitRuns(const FreeMap *map, size_t *chunk_count){
+    size_t count = 0;
+    for(size_t r = 0; r < map->run_count; r++){
+        count += (map->runs[r].length + CARVE_CHUNK_CLUSTERS - 1) / CARVE_CHUNK_CLUSTERS;
+    }
+    CarveChunk *chunks = malloc((count ? count : 1) * sizeof(CarveChunk));
+    if(chunks == NULL){
+        return NULL;
+    }
+    size_t c = 0;
+    for(size_t r = 0; r < map->run_count; r++){
+        const ClusterRun *run = &map->runs[r];
+        for(unsigned int offset = 0; offset < run->length; offset += CARVE_CHUNK_CLUSTERS){
+            chunks[c].start = run->start + offset;
+            chunks[c].length = run->length - offset < CARVE_CHUNK_CLUSTERS ? run->length - offset : CARVE_CHUNK_CLUSTERS;
+            chunks[c].run_end = run->start + run->length;
+            c++;
+        }
+    }
+    *chunk_count = count;
+    return chunks;
+}
+
+// A chunk that starts inside a file carved from an earlier chunk can only
+// have found data of that file; keep the earlier, longer carve.
+static size_t dropOverlaps(CarvedFile *found, size_t count, unsigned int cluster_size){
+    size_t kept = 0;
+    uint64_t covered_end = 0;
+    for(size_t n = 0; n < count; n++){
+        uint64_t start = (uint64_t)found[n].cluster * cluster_size;
+        if(kept > 0 && start < covered_end){
+            continue;
+        }
+        found[kept++] = found[n];
+        covered_end = start + found[n].size;
+    }
+    return kept;
+}
+
+static int writeCarved(const Volume *vol, const char *path, const CarvedFile *file){
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        return -1;
+    }
+    uint64_t start = clusterOffset(vol, file->cluster);
+    uint64_t written = 0;
+    while(written < file->size){
+        size_t piece = file->size - written < VIEW_CHUNK ? (size_t)(file->size - written) : VIEW_CHUNK;
+        VolumeView view;
+        const unsigned char *data = viewRange(vol, start + written, piece, &view);
+        ssize_t n = data ? write(fd, data, piece) : -1;
+        if(data){
+            releaseView(vol, &view);
+        }
+        if(n <= 0){
+            close(fd);
+            return -1;
+        }
+        written += (uint64_t)n;
+    }
+    return close(fd);
+}
+
+static double elapsedSeconds(const struct timespec *start){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Sweep every free run of the volume for files with a known signature and
+// write each one to out_dir, named after its starting cluster. Runs are
+// spread over the verification thread pool; the image is never modified.
+int carveVolume(Volume *vol, const char *out_dir, FILE *out){
+    const FreeMap *map = getFreeMap(vol);
+    if(map == NULL){
+        return 1;
+    }
+    if(mkdir(out_dir, 0755) != 0 && errno != EEXIST){
+        perror("Error creating output directory");
+        return 1;
+    }
+
+    CarveJobs jobs = {0};
+    jobs.vol = vol;
+    jobs.chunks = splitRuns(map, &jobs.chunk_count);
+    if(jobs.chunks == NULL){
+        perror("Error allocating memory");
+        return 1;
+    }
+    pthread_mutex_init(&jobs.lock, NULL);
+    for(unsigned int s = 0; s < SIGNATURE_COUNT; s++){
+        jobs.first_byte[(unsigned char)signatures[s].header[0]] = (unsigned char)(s + 1);
+    }
+    uint64_t scanned = 0;
+    for(size_t r = 0; r < map->run_count; r++){
+        scanned += (uint64_t)map->runs[r].length * vol->cluster_size;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int failed = runPool(jobs.chunk_count, carveJob, &jobs) != 0;
+    double seconds = elapsedSeconds(&start);
+    pthread_mutex_destroy(&jobs.lock);
+    free(jobs.chunks);
+    if(failed){
+        fprintf(stderr, "Error carving free clusters\n");
+        free(jobs.found);
+        return 1;
+    }
+
+    // Report in cluster order whatever order the workers finished in
+    if(jobs.found_count > 1){
+        qsort(jobs.found, jobs.found_count, sizeof(CarvedFile), compareCarved);
+    }
+    jobs.found_count = dropOverlaps(jobs.found, jobs.found_count, vol->cluster_size);
+    int status = 0;
+    size_t path_len = strlen(out_dir) + 32;
+    char *path = malloc(path_len);
+    if(path == NULL){
+        perror("Error allocating memory");
+        free(jobs.found);
+        return 1;
+    }
+    for(size_t n = 0; n < jobs.found_count; n++){
+        const CarvedFile *file = &jobs.found[n];
+        snprintf(path, path_len, "%s/%08u.%s", out_dir, file->cluster, signatures[file->type].ext);
+        if(writeCarved(vol, path, file) != 0){
+            perror(path);
+            status = 1;
+            continue;
+        }
+        fprintf(out, "%s: carved (size = %llu, starting cluster = %u)\n", path, (unsigned long long)file->size, file->cluster);
+    }
+    double megabytes = (double)scanned / (1024.0 * 1024.0);
+    fprintf(out, "Carved %zu files from %.1f MB of free clusters in %.3f s (%.1f MB/s)\n",
+           jobs.found_count, megabytes, seconds, seconds > 0 ? megabytes / seconds : 0.0);
+    free(path);
+    free(jobs.found);
+    return status;
+}
@@ -0,0 +1,10 @@
+#ifndef _CARVE_H_
+#define _CARVE_H_
+
+#include <stdio.h>
+
+#include "volume.h"
+
+int carveVolume(Volume *vol, const char *out_dir, FILE *out);
+
+#endif
@@ -0,0 +1,73 @@
+#include <stdint.h>
+
+#include "chain.h"
+#include "window.h"
+
+// Read the extent that starts at walk->next. Links are followed while each
+// cluster points at the one after it, so a contiguous file costs one pass
+// over its FAT entries and nothing else.
+static void readAhead(ChainWalk *walk){
+    const Volume *vol = walk->vol;
+    unsigned int cluster = walk->next;
+    walk->ahead.count = 0;
+    if(!isDataCluster(vol, cluster)){
+        return;
+    }
+    // Brent's cycle check on extent starts: a chain that comes back to a
+    // cluster it already passed would go round forever. It stops within
+    // two laps of the loop, long before the budget runs out.
+    if(cluster == walk->lap || walk->budget == 0){
+        walk->looped = 1;
+        return;
+    }
+    if(walk->lap_length == walk->lap_power){
+        walk->lap = cluster;
+        walk->lap_power *= 2;
+        walk->lap_length = 0;
+    }
+    walk->lap_length++;
+
+    unsigned int count = 1;
+    unsigned int link = nextCluster(vol, cluster);
+    while(link == cluster + 1 && count < walk->max_extent && count < walk->budget){
+        cluster = link;
+        count++;
+        link = nextCluster(vol, cluster);
+    }
+    walk->ahead.first = walk->next;
+    walk->ahead.count = count;
+    walk->budget -= count;
+    walk->next = link;
+
+    // The entry the walk reads next is somewhere else in the FAT
+    if(isDataCluster(vol, link)){
+        __builtin_prefetch(vol->fat + (uint64_t)link * 4);
+    }
+    prefetchRange(vol, clusterOffset(vol, walk->ahead.first), (uint64_t)count * vol->cluster_size);
+}
+
+// Start a walk at first. No extent handed out is longer than max_extent
+// clusters, so callers can view each one whole.
+void startChain(ChainWalk *walk, const Volume *vol, unsigned int first, unsigned int max_extent){
+    walk->vol = vol;
+    walk->next = first;
+    walk->max_extent = max_extent ? max_extent : 1;
+    walk->budget = vol->cluster_count;
+    // The first extent becomes the first lap mark
+    walk->lap = 0;
+    walk->lap_length = 1;
+    walk->lap_power = 1;
+    walk->looped = 0;
+    readAhead(walk);
+}
+
+// Hand out the next extent of the chain. Returns 0 once the chain ends,
+// leaves the data region or is found to loop.
+int nextExtent(ChainWalk *walk, ChainExtent *extent){
+    if(walk->ahead.count == 0){
+        return 0;
+    }
+    *extent = walk->ahead;
+    readAhead(walk);
+    return 1;
+}
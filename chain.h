@@ -0,0 +1,32 @@
+#ifndef _CHAIN_H_
+#define _CHAIN_H_
+
+#include <stdint.h>
+
+#include "volume.h"
+
+// A stretch of a cluster chain stored in consecutive clusters
+typedef struct {
+    unsigned int first;
+    unsigned int count;
+} ChainExtent;
+
+// Walks a cluster chain an extent at a time. The walk stays one extent
+// ahead of the caller and asks for that extent's data while the caller
+// works on the current one.
+typedef struct {
+    const Volume *vol;
+    unsigned int next;          // where the chain goes after the extent ahead
+    ChainExtent ahead;          // handed out next; count 0 once the chain ends
+    unsigned int max_extent;    // longest extent handed out, in clusters
+    unsigned int budget;        // clusters left before the chain must be a loop
+    unsigned int lap;           // loop check: first cluster of a recent extent
+    unsigned int lap_length;
+    unsigned int lap_power;
+    int looped;                 // the chain ran into itself
+} ChainWalk;
+
+void startChain(ChainWalk *walk, const Volume *vol, unsigned int first, unsigned int max_extent);
+int nextExtent(ChainWalk *walk, ChainExtent *extent);
+
+#endif
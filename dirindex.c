@@ -0,0 +1,457 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "dirindex.h"
+#include "dirwalk.h"
+#include "stats.h"
+
+typedef struct {
+    DirIndex *index;
+    unsigned int last_parent;       // directory whose path was interned last
+    uint32_t last_path;
+    int has_last;
+} IndexBuild;
+
+// FNV-1a over the containing directory and the name without its first
+// byte, which is the part a deleted entry still carries. The batch table of
+// requested names uses it too.
+uint32_t dirIndexKeyHash(unsigned int dir_cluster, const char *name){
+    uint32_t hash = 2166136261u;
+    for(int shift = 0; shift < 32; shift += 8){
+        hash = (hash ^ ((dir_cluster >> shift) & 0xFF)) * 16777619u;
+    }
+    for(const char *p = name[0] ? name + 1 : name; *p; p++){
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+    return hash;
+}
+
+static int sameKey(const DirIndex *index, long slot, unsigned int dir_cluster, const char *name){
+    return index->parent[slot] == dir_cluster && name[0] && strcmp(index->names[slot] + 1, name + 1) == 0;
+}
+
+// FNV-1a over the containing directory and the whole name folded to lower case
+static uint32_t longKeyHash(unsigned int dir_cluster, const char *name){
+    uint32_t hash = 2166136261u;
+    for(int shift = 0; shift < 32; shift += 8){
+        hash = (hash ^ ((dir_cluster >> shift) & 0xFF)) * 16777619u;
+    }
+    for(const char *p = name; *p; p++){
+        unsigned char c = (unsigned char)*p;
+        hash = (hash ^ (c >= 'A' && c <= 'Z' ? c + 32 : c)) * 16777619u;
+    }
+    return hash;
+}
+
+const char *dirIndexLongName(const DirIndex *index, long slot){
+    return index->long_name[slot] == DIR_INDEX_NO_NAME ? NULL : index->paths + index->long_name[slot];
+}
+
+static int sameLongKey(const DirIndex *index, long slot, unsigned int dir_cluster, const char *name){
+    const char *long_name = dirIndexLongName(index, slot);
+    return index->parent[slot] == dir_cluster && long_name && strcasecmp(long_name, name) == 0;
+}
+
+#define GROW_ARRAY(array, cap) do { \
+        void *grown = realloc((array), (cap) * sizeof(*(array))); \
+        if(grown == NULL){ \
+            return -1; \
+        } \
+        (array) = grown; \
+    } while(0)
+
+// Grow every per-slot array to hold at least cap entries
+int reserveDirIndex(DirIndex *index, size_t cap){
+    if(cap <= index->cap){
+        return 0;
+    }
+    GROW_ARRAY(index->entry_offset, cap);
+    GROW_ARRAY(index->parent, cap);
+    GROW_ARRAY(index->dir_path, cap);
+    GROW_ARRAY(index->first_cluster, cap);
+    GROW_ARRAY(index->size, cap);
+    GROW_ARRAY(index->attr, cap);
+    GROW_ARRAY(index->wrt_date, cap);
+    GROW_ARRAY(index->wrt_time, cap);
+    GROW_ARRAY(index->names, cap);
+    GROW_ARRAY(index->next_same_key, cap);
+    GROW_ARRAY(index->long_name, cap);
+    GROW_ARRAY(index->lfn_parts, cap);
+    GROW_ARRAY(index->short_first, cap);
+    GROW_ARRAY(index->next_same_long, cap);
+    GROW_ARRAY(index->digests, cap);
+    GROW_ARRAY(index->has_digest, cap);
+    index->cap = cap;
+    return 0;
+}
+
+static int internPath(DirIndex *index, const char *path, uint32_t *offset){
+    size_t len = strlen(path) + 1;
+    if(index->paths_used + len > index->paths_cap){
+        size_t cap = index->paths_cap ? index->paths_cap * 2 : 4096;
+        while(index->paths_used + len > cap){
+            cap *= 2;
+        }
+        GROW_ARRAY(index->paths, cap);
+        index->paths_cap = cap;
+    }
+    memcpy(index->paths + index->paths_used, path, len);
+    *offset = (uint32_t)index->paths_used;
+    index->paths_used += len;
+    return 0;
+}
+
+// Copy the fields lookups need out of the raw entry
+static void fillSlot(DirIndex *index, long slot, const DirEntry *dirEntry){
+    index->first_cluster[slot] = entryFirstCluster(dirEntry);
+    index->size[slot] = dirEntry->DIR_FileSize;
+    index->attr[slot] = dirEntry->DIR_Attr;
+    index->wrt_date[slot] = dirEntry->DIR_WrtDate;
+    index->wrt_time[slot] = dirEntry->DIR_WrtTime;
+    formatShortName(dirEntry, index->names[slot]);
+    index->dirty = 1;
+}
+
+static int indexEntry(Volume *vol, const DirWalkEntry *item, void *ctx){
+    IndexBuild *build = ctx;
+    DirIndex *index = build->index;
+    (void)vol;
+    if(isLfnEntry(item->entry)){
+        return 0;
+    }
+    if(index->count == index->cap && reserveDirIndex(index, index->cap ? index->cap * 2 : 1024) != 0){
+        perror("Error allocating memory");
+        return -1;
+    }
+    // Entries arrive directory by directory, so each path is stored once
+    if(!build->has_last || build->last_parent != item->dir_cluster){
+        if(internPath(index, item->dir_path, &build->last_path) != 0){
+            perror("Error allocating memory");
+            return -1;
+        }
+        build->last_parent = item->dir_cluster;
+        build->has_last = 1;
+    }
+    uint32_t long_name = DIR_INDEX_NO_NAME;
+    if(item->long_name && internPath(index, item->long_name, &long_name) != 0){
+        perror("Error allocating memory");
+        return -1;
+    }
+    size_t slot = index->count++;
+    index->entry_offset[slot] = item->offset;
+    index->parent[slot] = item->dir_cluster;
+    index->dir_path[slot] = build->last_path;
+    index->long_name[slot] = long_name;
+    index->lfn_parts[slot] = (unsigned char)item->lfn_parts;
+    index->short_first[slot] = item->first_char;
+    index->has_digest[slot] = 0;
+    fillSlot(index, (long)slot, item->entry);
+    return 0;
+}
+
+// Chain every slot into the hashes, replacing any built before. Inserting
+// in reverse leaves each chain in on-disk order, which keeps "last match
+// wins" rules intact.
+static int buildHash(DirIndex *index){
+    size_t bucket_count = 1024;
+    while(bucket_count < index->count * 2){
+        bucket_count *= 2;
+    }
+    free(index->buckets);
+    free(index->long_buckets);
+    index->buckets = malloc(bucket_count * sizeof(int32_t));
+    index->long_buckets = malloc(bucket_count * sizeof(int32_t));
+    if(index->buckets == NULL || index->long_buckets == NULL){
+        return -1;
+    }
+    index->bucket_count = bucket_count;
+    for(size_t b = 0; b < bucket_count; b++){
+        index->buckets[b] = -1;
+        index->long_buckets[b] = -1;
+    }
+    for(size_t n = index->count; n-- > 0;){
+        const char *name = index->names[n];
+        size_t bucket = dirIndexKeyHash(index->parent[n], name) & (bucket_count - 1);
+        while(index->buckets[bucket] != -1 && !sameKey(index, index->buckets[bucket], index->parent[n], name)){
+            bucket = (bucket + 1) & (bucket_count - 1);
+        }
+        index->next_same_key[n] = index->buckets[bucket];
+        index->buckets[bucket] = (int32_t)n;
+
+        const char *long_name = dirIndexLongName(index, (long)n);
+        index->next_same_long[n] = -1;
+        if(long_name == NULL){
+            continue;
+        }
+        bucket = longKeyHash(index->parent[n], long_name) & (bucket_count - 1);
+        while(index->long_buckets[bucket] != -1 && !sameLongKey(index, index->long_buckets[bucket], index->parent[n], long_name)){
+            bucket = (bucket + 1) & (bucket_count - 1);
+        }
+        index->next_same_long[n] = index->long_buckets[bucket];
+        index->long_buckets[bucket] = (int32_t)n;
+    }
+    return 0;
+}
+
+// Decode every directory of the volume in one walk
+DirIndex *buildDirIndex(Volume *vol){
+    DirIndex *index = calloc(1, sizeof(DirIndex));
+    if(index == NULL){
+        perror("Error allocating memory");
+        return NULL;
+    }
+    IndexBuild build = { index, 0, 0, 0 };
+    uint64_t span = statBegin();
+    int walked = walkVolume(vol, indexEntry, &build);
+    statEnd(SPAN_DIR_SCAN, span);
+    if(walked != 0){
+        freeDirIndex(index);
+        return NULL;
+    }
+    if(buildHash(index) != 0){
+        perror("Error allocating memory");
+        freeDirIndex(index);
+        return NULL;
+    }
+    index->complete = 1;
+    return index;
+}
+
+void freeDirIndex(DirIndex *index){
+    if(index){
+        free(index->entry_offset);
+        free(index->parent);
+        free(index->dir_path);
+        free(index->first_cluster);
+        free(index->size);
+        free(index->attr);
+        free(index->wrt_date);
+        free(index->wrt_time);
+        free(index->names);
+        free(index->next_same_key);
+        free(index->long_name);
+        free(index->lfn_parts);
+        free(index->short_first);
+        free(index->next_same_long);
+        free(index->long_buckets);
+        free(index->digests);
+        free(index->has_digest);
+        free(index->buckets);
+        free(index->paths);
+        free(index->dirs);
+        free(index);
+    }
+}
+
+// The index of the whole volume is built on first use and shared by every
+// later query. One holding only some directories is replaced.
+DirIndex *getDirIndex(Volume *vol){
+    if(vol->dir_index != NULL && !vol->dir_index->complete){
+        freeDirIndex(vol->dir_index);
+        vol->dir_index = NULL;
+    }
+    if(vol->dir_index == NULL){
+        vol->dir_index = buildDirIndex(vol);
+    }
+    return vol->dir_index;
+}
+
+// The index with the entries of one directory in it, for commands that
+// name their files. Without a whole-volume index only the directories
+// asked for are read, each once; dir_path is the path the whole-volume
+// walk would give the directory.
+DirIndex *getDirIndexFor(Volume *vol, unsigned int dir_cluster, const char *dir_path){
+    DirIndex *index = vol->dir_index;
+    if(index == NULL){
+        index = calloc(1, sizeof(DirIndex));
+        if(index == NULL){
+            perror("Error allocating memory");
+            return NULL;
+        }
+        vol->dir_index = index;
+    }
+    if(index->complete){
+        return index;
+    }
+    for(size_t d = 0; d < index->dir_count; d++){
+        if(index->dirs[d] == dir_cluster){
+            return index;
+        }
+    }
+    if(index->dir_count == index->dir_cap){
+        size_t cap = index->dir_cap ? index->dir_cap * 2 : 8;
+        unsigned int *dirs = realloc(index->dirs, cap * sizeof(unsigned int));
+        if(dirs == NULL){
+            perror("Error allocating memory");
+            return NULL;
+        }
+        index->dirs = dirs;
+        index->dir_cap = cap;
+    }
+
+    size_t count = index->count;
+    IndexBuild build = { index, 0, 0, 0 };
+    uint64_t span = statBegin();
+    int walked = walkDirectory(vol, dir_cluster, dir_path, indexEntry, &build);
+    statEnd(SPAN_DIR_SCAN, span);
+    if(walked != 0){
+        index->count = count;
+        return NULL;
+    }
+    if(buildHash(index) != 0){
+        perror("Error allocating memory");
+        index->count = count;
+        return NULL;
+    }
+    index->dirs[index->dir_count++] = dir_cluster;
+    return index;
+}
+
+// First slot in dir_cluster whose name matches everything but the first byte
+long dirIndexFind(const DirIndex *index, unsigned int dir_cluster, const char *name){
+    if(name[0] == '\0'){
+        return DIR_INDEX_NONE;
+    }
+    size_t bucket = dirIndexKeyHash(dir_cluster, name) & (index->bucket_count - 1);
+    while(index->buckets[bucket] != -1){
+        if(sameKey(index, index->buckets[bucket], dir_cluster, name)){
+            return index->buckets[bucket];
+        }
+        bucket = (bucket + 1) & (index->bucket_count - 1);
+    }
+    return DIR_INDEX_NONE;
+}
+
+long dirIndexNext(const DirIndex *index, long slot){
+    return index->next_same_key[slot];
+}
+
+static long dirIndexFindLong(const DirIndex *index, unsigned int dir_cluster, const char *name){
+    size_t bucket = longKeyHash(dir_cluster, name) & (index->bucket_count - 1);
+    while(index->long_buckets[bucket] != -1){
+        if(sameLongKey(index, index->long_buckets[bucket], dir_cluster, name)){
+            return index->long_buckets[bucket];
+        }
+        bucket = (bucket + 1) & (index->bucket_count - 1);
+    }
+    return DIR_INDEX_NONE;
+}
+
+// A name longer than 8.3 can only be a long name
+static int mayBeShortName(const char *name){
+    return name[0] && strlen(name) <= 12;
+}
+
+int dirIndexMatches(const DirIndex *index, long slot, const char *name){
+    const char *long_name = dirIndexLongName(index, slot);
+    return (mayBeShortName(name) && strcmp(index->names[slot] + 1, name + 1) == 0) ||
+        (long_name && strcasecmp(long_name, name) == 0);
+}
+
+// Merge the short and long name chains; both are in on-disk order
+long dirIndexNextMatch(DirIndexMatch *match){
+    long short_slot = match->short_slot, long_slot = match->long_slot;
+    if(short_slot == DIR_INDEX_NONE && long_slot == DIR_INDEX_NONE){
+        return DIR_INDEX_NONE;
+    }
+    long slot = long_slot == DIR_INDEX_NONE || (short_slot != DIR_INDEX_NONE && short_slot < long_slot) ? short_slot : long_slot;
+    if(short_slot == slot){
+        match->short_slot = dirIndexNext(match->index, short_slot);
+    }
+    if(long_slot == slot){
+        match->long_slot = match->index->next_same_long[long_slot];
+    }
+    return slot;
+}
+
+long dirIndexFirstMatch(DirIndexMatch *match, const DirIndex *index, unsigned int dir_cluster, const char *name){
+    match->index = index;
+    match->name = name;
+    match->short_slot = mayBeShortName(name) ? dirIndexFind(index, dir_cluster, name) : DIR_INDEX_NONE;
+    match->long_slot = dirIndexFindLong(index, dir_cluster, name);
+    return dirIndexNextMatch(match);
+}
+
+// The first byte to give back to a deleted short name. A request by short
+// name supplies it; a request by long name relies on the long name's checksum.
+char dirIndexRestoredFirstChar(const DirIndex *index, long slot, const char *name){
+    if(mayBeShortName(name) && strcmp(index->names[slot] + 1, name + 1) == 0){
+        return name[0];
+    }
+    return (char)index->short_first[slot];
+}
+
+// Undelete the entry in slot, together with the long name in front of it.
+// The image only changes once the plan is applied, so the index is updated
+// here rather than re-read from the entry.
+void dirIndexRestoreName(Volume *vol, long slot, char first_char){
+    DirIndex *index = vol->dir_index;
+    writeVolume(vol, index->entry_offset[slot], &first_char, 1);
+    lfnRestore(vol, index->entry_offset[slot], index->lfn_parts[slot]);
+    index->names[slot][0] = first_char;
+    index->short_first[slot] = (unsigned char)first_char;
+    index->dirty = 1;
+}
+
+static int isIndexedDirectory(const DirIndex *index, long slot){
+    return (unsigned char)index->names[slot][0] != 0xE5 && (index->attr[slot] & 0x10);
+}
+
+// Deleted regular files are the only recoverable entries
+int dirIndexIsDeletedFile(const DirIndex *index, long slot){
+    return (unsigned char)index->names[slot][0] == 0xE5 && index->attr[slot] != 0x10;
+}
+
+// Split "/DIR/SUB/NAME" into the first cluster of /DIR/SUB and "NAME",
+// resolving each directory through the index, which reads only the
+// directories on the way. A name without any '/' refers to the root
+// directory. Returns -1 when an intermediate directory does not exist.
+int dirIndexResolvePath(Volume *vol, const char *path, unsigned int *dir_cluster, const char **name){
+    unsigned int cluster = vol->bs.BPB_RootClus;
+    char dir_path[DIR_PATH_MAX] = "";
+    const char *p = path;
+    for(;;){
+        while(*p == '/'){
+            p++;
+        }
+        const DirIndex *index = getDirIndexFor(vol, cluster, dir_path);
+        if(index == NULL){
+            return -1;
+        }
+        const char *slash = strchr(p, '/');
+        if(slash == NULL){
+            *dir_cluster = cluster;
+            *name = p;
+            return *p ? 0 : -1;
+        }
+        char component[LFN_NAME_MAX];
+        size_t len = (size_t)(slash - p);
+        if(len >= sizeof(component)){
+            return -1;
+        }
+        memcpy(component, p, len);
+        component[len] = '\0';
+
+        // A live directory matches by its exact short name or its long name
+        DirIndexMatch match;
+        long slot = dirIndexFirstMatch(&match, index, cluster, component);
+        while(slot != DIR_INDEX_NONE && !(isIndexedDirectory(index, slot) &&
+              (strcmp(index->names[slot], component) == 0 || (dirIndexLongName(index, slot) && strcasecmp(dirIndexLongName(index, slot), component) == 0)))){
+            slot = dirIndexNextMatch(&match);
+        }
+        if(slot == DIR_INDEX_NONE){
+            return -1;
+        }
+        cluster = index->first_cluster[slot] ? index->first_cluster[slot] : vol->bs.BPB_RootClus;
+        const char *dir_name = dirIndexLongName(index, slot) ? dirIndexLongName(index, slot) : index->names[slot];
+        size_t used = strlen(dir_path);
+        if(used + 1 + strlen(dir_name) >= sizeof(dir_path)){
+            return -1;
+        }
+        sprintf(dir_path + used, "/%s", dir_name);
+        p = slash + 1;
+    }
+}
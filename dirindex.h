@@ -0,0 +1,79 @@
+#ifndef _DIRINDEX_H_
+#define _DIRINDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/sha.h>
+
+#include "volume.h"
+
+#define DIR_INDEX_NONE (-1L)
+#define DIR_INDEX_NO_NAME UINT32_MAX
+
+// Every used directory entry of the volume, live and deleted, decoded once
+// into parallel arrays. A hash on (containing directory, name without its
+// first byte) chains entries sharing that key in on-disk order, so a
+// deleted file is found without touching any directory cluster. A second
+// hash does the same for long names, compared without regard to case.
+typedef struct DirIndex {
+    size_t count;
+    size_t cap;
+    uint64_t *entry_offset;         // where the raw entry is in the image
+    unsigned int *parent;           // first cluster of the containing directory
+    uint32_t *dir_path;             // offset of the directory's path in paths
+    unsigned int *first_cluster;    // DIR_FstClusHI:DIR_FstClusLO
+    unsigned int *size;
+    unsigned char *attr;
+    unsigned short *wrt_date;
+    unsigned short *wrt_time;
+    char (*names)[13];              // "NAME.EXT", first byte as on disk
+    int32_t *next_same_key;
+    uint32_t *long_name;            // offset of the long name in paths, or DIR_INDEX_NO_NAME
+    unsigned char *lfn_parts;       // long name entries right before the entry
+    unsigned char *short_first;     // short name byte 0, recovered if deleted
+    int32_t *next_same_long;
+    unsigned char (*digests)[SHA_DIGEST_LENGTH];    // contiguous-data SHA-1
+    unsigned char *has_digest;
+
+    int32_t *buckets;
+    int32_t *long_buckets;
+    size_t bucket_count;            // of each table
+
+    char *paths;                    // NUL-terminated directory paths and long names
+    size_t paths_used;
+    size_t paths_cap;
+
+    int dirty;                      // differs from the cache it was loaded from
+    int complete;                   // holds every directory reachable from the root
+    unsigned int *dirs;             // otherwise, the directories read so far
+    size_t dir_count;
+    size_t dir_cap;
+} DirIndex;
+
+// Iterates the entries a requested name may refer to: the short name with
+// any first byte, or the long name in any case, in on-disk order.
+typedef struct {
+    const DirIndex *index;
+    const char *name;
+    long short_slot;
+    long long_slot;
+} DirIndexMatch;
+
+uint32_t dirIndexKeyHash(unsigned int dir_cluster, const char *name);
+DirIndex *buildDirIndex(Volume *vol);
+int reserveDirIndex(DirIndex *index, size_t cap);
+void freeDirIndex(DirIndex *index);
+DirIndex *getDirIndex(Volume *vol);
+DirIndex *getDirIndexFor(Volume *vol, unsigned int dir_cluster, const char *dir_path);
+long dirIndexFind(const DirIndex *index, unsigned int dir_cluster, const char *name);
+long dirIndexNext(const DirIndex *index, long slot);
+int dirIndexIsDeletedFile(const DirIndex *index, long slot);
+const char *dirIndexLongName(const DirIndex *index, long slot);
+int dirIndexMatches(const DirIndex *index, long slot, const char *name);
+long dirIndexFirstMatch(DirIndexMatch *match, const DirIndex *index, unsigned int dir_cluster, const char *name);
+long dirIndexNextMatch(DirIndexMatch *match);
+char dirIndexRestoredFirstChar(const DirIndex *index, long slot, const char *name);
+void dirIndexRestoreName(Volume *vol, long slot, char first_char);
+int dirIndexResolvePath(Volume *vol, const char *path, unsigned int *dir_cluster, const char **name);
+
+#endif
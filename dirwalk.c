@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dirwalk.h"
+#include "chain.h"
+#include "window.h"
+#include "stats.h"
+
+typedef struct {
+    unsigned int cluster;       // first cluster of the directory
+    size_t path;                // offset of its path in the path arena
+} DirFrame;
+
+typedef struct {
+    DirFrame *frames;
+    size_t count;
+    size_t cap;
+} DirStack;
+
+typedef struct {
+    char *data;
+    size_t used;
+    size_t cap;
+} PathArena;
+
+// "." and ".." carry no data of their own and would loop the walk
+int isDotEntry(const DirEntry *dirEntry){
+    return dirEntry->DIR_Name[0] == '.';
+}
+
+int isLiveDirectory(const DirEntry *dirEntry){
+    return dirEntry->DIR_Name[0] != 0x00 && dirEntry->DIR_Name[0] != 0xE5 &&
+        dirEntry->DIR_Attr != 0x0F && (dirEntry->DIR_Attr & 0x10) && !isDotEntry(dirEntry);
+}
+
+// First cluster of a directory entry; 0 stands for the root directory
+unsigned int directoryCluster(const Volume *vol, const DirEntry *dirEntry){
+    unsigned int cluster = entryFirstCluster(dirEntry);
+    return cluster == 0 ? vol->bs.BPB_RootClus : cluster;
+}
+
+// Fill in the entry and, for a short entry, the long name in front of it
+static void prepareItem(DirWalkEntry *item, LfnState *lfn, const DirEntry *dirEntry, uint64_t offset){
+    item->entry = dirEntry;
+    item->offset = offset;
+    item->long_name = NULL;
+    item->lfn_parts = 0;
+    item->first_char = dirEntry->DIR_Name[0];
+    statAdd(STAT_DIR_ENTRIES, 1);
+    if(isLfnEntry(dirEntry)){
+        lfnPush(lfn, dirEntry, offset);
+        return;
+    }
+    item->long_name = lfnFinish(lfn, dirEntry, offset);
+    item->lfn_parts = lfn->part_count;
+    item->first_char = lfn->first_char;
+}
+
+// Longest stretch of a directory viewed at once
+static unsigned int directoryExtentMax(const Volume *vol){
+    return VIEW_CHUNK / vol->cluster_size ? (unsigned int)(VIEW_CHUNK / vol->cluster_size) : 1;
+}
+
+// Visit every used entry of one directory, following its cluster chain an
+// extent at a time. A chain that loops ends once the loop is noticed.
+int walkDirectory(Volume *vol, unsigned int dir_cluster, const char *dir_path, DirWalkVisitor visit, void *ctx){
+    DirWalkEntry item = { NULL, 0, dir_cluster, dir_path, NULL, 0, 0 };
+    LfnState lfn;
+    lfnReset(&lfn);
+    ChainWalk walk;
+    ChainExtent extent;
+    int status = 0;
+    startChain(&walk, vol, dir_cluster, directoryExtentMax(vol));
+    while (status == 0 && nextExtent(&walk, &extent)) {
+        VolumeView view;
+        const unsigned char *dir_data = viewClusters(vol, extent.first, extent.count, &view);
+        if(dir_data == NULL){
+            return -1;
+        }
+
+        uint64_t extent_offset = clusterOffset(vol, extent.first);
+        size_t extent_bytes = (size_t)extent.count * vol->cluster_size;
+        for(size_t i = 0; status == 0 && i < extent_bytes; i+= sizeof(DirEntry)){
+            const DirEntry *dirEntry = (const DirEntry *)(dir_data + i);
+            if(dirEntry->DIR_Name[0] == 0x00 || isDotEntry(dirEntry)){
+                lfnReset(&lfn);
+                continue;
+            }
+            prepareItem(&item, &lfn, dirEntry, extent_offset + i);
+            status = visit(vol, &item, ctx);
+        }
+        releaseView(vol, &view);
+        statAdd(STAT_CLUSTERS_VISITED, extent.count);
+    }
+    return status;
+}
+
+static int pushFrame(DirStack *stack, unsigned int cluster, size_t path){
+    if(stack->count == stack->cap){
+        size_t cap = stack->cap ? stack->cap * 2 : 64;
+        DirFrame *frames = realloc(stack->frames, cap * sizeof(DirFrame));
+        if(frames == NULL){
+            return -1;
+        }
+        stack->frames = frames;
+        stack->cap = cap;
+    }
+    stack->frames[stack->count].cluster = cluster;
+    stack->frames[stack->count].path = path;
+    stack->count++;
+    return 0;
+}
+
+// A path that would reach DIR_PATH_MAX, as returned by appendPath()
+#define PATH_TOO_LONG (-2L)
+
+// Append "parent/name" to the arena and return its offset, PATH_TOO_LONG,
+// or -1 when out of memory. The long name is used when the directory has
+// one.
+static long appendPath(PathArena *arena, size_t parent, const DirWalkEntry *item){
+    char short_name[13];
+    const char *name = item->long_name;
+    if(name == NULL){
+        formatShortName(item->entry, short_name);
+        name = short_name;
+    }
+    size_t parent_len = strlen(arena->data + parent);
+    size_t len = parent_len + 1 + strlen(name);
+    if(len >= DIR_PATH_MAX){
+        return PATH_TOO_LONG;
+    }
+    if(arena->used + len + 1 > arena->cap){
+        size_t cap = arena->cap * 2;
+        while(arena->used + len + 1 > cap){
+            cap *= 2;
+        }
+        char *data = realloc(arena->data, cap);
+        if(data == NULL){
+            return -1;
+        }
+        arena->data = data;
+        arena->cap = cap;
+    }
+    size_t offset = arena->used;
+    memcpy(arena->data + offset, arena->data + parent, parent_len);
+    arena->data[offset + parent_len] = '/';
+    strcpy(arena->data + offset + parent_len + 1, name);
+    arena->used += len + 1;
+    return (long)offset;
+}
+
+// Walk every directory reachable from the root with an explicit stack, so
+// depth is bounded only by memory. Each directory is entered once even if
+// the tree is cross-linked; children are visited in on-disk order.
+int walkVolume(Volume *vol, DirWalkVisitor visit, void *ctx){
+    DirStack stack = {0};
+    DirStack children = {0};
+    PathArena arena = { malloc(4096), 1, 4096 };
+    size_t words = ((size_t)vol->cluster_count + 63) / 64;
+    uint64_t *visited = calloc(words ? words : 1, sizeof(uint64_t));
+    LfnState lfn;
+    int status = 0;
+    if(arena.data == NULL || visited == NULL || pushFrame(&stack, vol->bs.BPB_RootClus, 0) != 0){
+        perror("Error allocating memory");
+        status = -1;
+    }else{
+        arena.data[0] = '\0';
+    }
+
+    while(status == 0 && stack.count > 0){
+        DirFrame frame = stack.frames[--stack.count];
+        unsigned int index = frame.cluster - 2;
+        if(!isDataCluster(vol, frame.cluster) || (visited[index / 64] >> (index % 64)) & 1){
+            continue;
+        }
+        visited[index / 64] |= (uint64_t)1 << (index % 64);
+
+        children.count = 0;
+        lfnReset(&lfn);
+        ChainWalk walk;
+        ChainExtent extent;
+        startChain(&walk, vol, frame.cluster, directoryExtentMax(vol));
+        while (status == 0 && nextExtent(&walk, &extent)) {
+            VolumeView view;
+            const unsigned char *dir_data = viewClusters(vol, extent.first, extent.count, &view);
+            if(dir_data == NULL){
+                status = -1;
+                break;
+            }
+
+            uint64_t extent_offset = clusterOffset(vol, extent.first);
+            size_t extent_bytes = (size_t)extent.count * vol->cluster_size;
+            for(size_t i = 0; status == 0 && i < extent_bytes; i+= sizeof(DirEntry)){
+                const DirEntry *dirEntry = (const DirEntry *)(dir_data + i);
+                if(dirEntry->DIR_Name[0] == 0x00 || isDotEntry(dirEntry)){
+                    lfnReset(&lfn);
+                    continue;
+                }
+                // The arena may move while children are added, so the
+                // directory path is looked up again for every entry.
+                DirWalkEntry item = { NULL, 0, frame.cluster, arena.data + frame.path, NULL, 0, 0 };
+                prepareItem(&item, &lfn, dirEntry, extent_offset + i);
+                status = visit(vol, &item, ctx);
+                if(status == 0 && isLiveDirectory(dirEntry) && isDataCluster(vol, entryFirstCluster(dirEntry))){
+                    long path = appendPath(&arena, frame.path, &item);
+                    if(path == PATH_TOO_LONG){
+                        // Nothing below it can be named; the rest is still walked
+                        fprintf(stderr, "%s: a subdirectory path is longer than %d bytes and was not walked\n",
+                                arena.data[frame.path] ? arena.data + frame.path : "/", DIR_PATH_MAX - 1);
+                    }else if(path < 0 || pushFrame(&children, entryFirstCluster(dirEntry), (size_t)path) != 0){
+                        perror("Error allocating memory");
+                        status = -1;
+                    }
+                }
+            }
+            releaseView(vol, &view);
+            statAdd(STAT_CLUSTERS_VISITED, extent.count);
+        }
+        // Push in reverse so the first subdirectory is walked next
+        for(size_t c = children.count; status == 0 && c-- > 0;){
+            if(pushFrame(&stack, children.frames[c].cluster, children.frames[c].path) != 0){
+                perror("Error allocating memory");
+                status = -1;
+            }
+        }
+    }
+
+    free(visited);
+    free(arena.data);
+    free(children.frames);
+    free(stack.frames);
+    return status;
+}
@@ -0,0 +1,33 @@
+#ifndef _DIRWALK_H_
+#define _DIRWALK_H_
+
+#include <stdint.h>
+
+#include "volume.h"
+#include "lfn.h"
+
+#define DIR_PATH_MAX 4096
+
+// entry points into a view of the directory cluster and is only valid
+// during the visit; offset locates it for good.
+typedef struct {
+    const DirEntry *entry;
+    uint64_t offset;            // of the entry in the image
+    unsigned int dir_cluster;   // first cluster of the containing directory
+    const char *dir_path;       // containing directory, "" for the root
+    const char *long_name;      // assembled long name, or NULL
+    unsigned int lfn_parts;     // long name entries right before this one
+    unsigned char first_char;   // short name byte 0, recovered if deleted
+} DirWalkEntry;
+
+// Return nonzero from a visitor to stop the walk with that value. Long name
+// entries are visited too; the short entry after them carries the name.
+typedef int (*DirWalkVisitor)(Volume *vol, const DirWalkEntry *item, void *ctx);
+
+int isDotEntry(const DirEntry *dirEntry);
+int isLiveDirectory(const DirEntry *dirEntry);
+unsigned int directoryCluster(const Volume *vol, const DirEntry *dirEntry);
+int walkDirectory(Volume *vol, unsigned int dir_cluster, const char *dir_path, DirWalkVisitor visit, void *ctx);
+int walkVolume(Volume *vol, DirWalkVisitor visit, void *ctx);
+
+#endif
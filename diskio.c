@@ -0,0 +1,166 @@
+#define _GNU_SOURCE    // O_DIRECT
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "diskio.h"
+#include "volume.h"
+#include "window.h"
+#include "uring.h"
+#include "stats.h"
+
+static int mmapOpen(DiskData *disk, const char *disk_path, const DiskIoConfig *config){
+    return 0;
+}
+
+// Mapping is cheap; the reads show up as page faults instead
+static unsigned char *mmapLoad(const DiskData *disk, uint64_t start, size_t length){
+    uint64_t span = statBegin();
+    void *data = mmap(NULL, length, PROT_READ, MAP_SHARED, disk->fd, (off_t)start);
+    statEnd(SPAN_LOAD, span);
+    if(data == MAP_FAILED){
+        perror("Error mapping file");
+        return NULL;
+    }
+    return data;
+}
+
+static void mmapUnload(const DiskData *disk, unsigned char *data, size_t length){
+    munmap(data, length);
+}
+
+static void mmapClose(DiskData *disk){
+}
+
+// The reads of the direct backend bypass the page cache: a second
+// descriptor opened with O_DIRECT, and one ring shared by every thread.
+typedef struct DirectIo {
+    int fd;
+    int have_ring;      // 0 when io_uring is unavailable; pread() is used
+    Uring ring;
+    pthread_mutex_t lock;
+} DirectIo;
+
+static int directOpen(DiskData *disk, const char *disk_path, const DiskIoConfig *config){
+    DirectIo *io = calloc(1, sizeof(DirectIo));
+    if(io == NULL){
+        perror("Error allocating memory");
+        return -1;
+    }
+    io->fd = open(disk_path, O_RDONLY | O_DIRECT);
+    if(io->fd < 0){
+        perror("Error opening file for direct I/O");
+        free(io);
+        return -1;
+    }
+    unsigned int depth = config->queue_depth ? config->queue_depth : DISK_IO_DEFAULT_QUEUE_DEPTH;
+    io->have_ring = uringInit(&io->ring, depth) == 0;
+    pthread_mutex_init(&io->lock, NULL);
+    disk->io = io;
+    return 0;
+}
+
+// Plain reads for kernels without io_uring; the end of the file reads as zero
+static int preadAll(int fd, unsigned char *buffer, size_t length, uint64_t offset){
+    size_t done = 0;
+    while(done < length){
+        ssize_t got = pread(fd, buffer + done, length - done, (off_t)(offset + done));
+        if(got < 0 && errno == EINTR){
+            continue;
+        }
+        if(got < 0){
+            return -1;
+        }
+        if(got == 0){
+            memset(buffer + done, 0, length - done);
+            break;
+        }
+        done += (size_t)got;
+    }
+    return 0;
+}
+
+static unsigned char *directLoad(const DiskData *disk, uint64_t start, size_t length){
+    DirectIo *io = disk->io;
+    if(start % DISK_IO_ALIGN != 0){
+        errno = EINVAL;
+        perror("Error reading file");
+        return NULL;
+    }
+    size_t aligned = (length + DISK_IO_ALIGN - 1) / DISK_IO_ALIGN * DISK_IO_ALIGN;
+    void *buffer;
+    if(posix_memalign(&buffer, DISK_IO_ALIGN, aligned) != 0){
+        perror("Error allocating memory");
+        return NULL;
+    }
+    uint64_t span = statBegin();
+    pthread_mutex_lock(&io->lock);
+    int status = -1;
+    if(io->have_ring){
+        status = uringRead(&io->ring, io->fd, buffer, aligned, start, DISK_IO_PIECE);
+        if(status != 0 && errno == EINVAL){
+            // A kernel whose ring has no plain read operation
+            uringFree(&io->ring);
+            io->have_ring = 0;
+        }
+    }
+    if(!io->have_ring){
+        status = preadAll(io->fd, buffer, aligned, start);
+    }
+    pthread_mutex_unlock(&io->lock);
+    statEnd(SPAN_LOAD, span);
+    if(status != 0){
+        perror("Error reading file");
+        free(buffer);
+        return NULL;
+    }
+    statAdd(STAT_BYTES_LOADED, aligned);
+    return buffer;
+}
+
+static void directUnload(const DiskData *disk, unsigned char *data, size_t length){
+    free(data);
+}
+
+static void directClose(DiskData *disk){
+    DirectIo *io = disk->io;
+    if(io){
+        if(io->have_ring){
+            uringFree(&io->ring);
+        }
+        close(io->fd);
+        pthread_mutex_destroy(&io->lock);
+        free(io);
+        disk->io = NULL;
+    }
+}
+
+static const DiskBackend mmap_backend = {
+    "mmap", mmapOpen, mmapLoad, mmapUnload, mmapClose, 1, 1, WINDOW_SIZE,
+};
+
+static const DiskBackend direct_backend = {
+    "direct", directOpen, directLoad, directUnload, directClose, 0, 0, DISK_IO_DIRECT_WINDOW,
+};
+
+const DiskBackend *diskBackend(DiskIoMode mode){
+    return mode == DISK_IO_DIRECT ? &direct_backend : &mmap_backend;
+}
+
+int parseDiskIoMode(const char *text, DiskIoMode *mode){
+    if(strcmp(text, mmap_backend.name) == 0){
+        *mode = DISK_IO_MMAP;
+    }else if(strcmp(text, direct_backend.name) == 0){
+        *mode = DISK_IO_DIRECT;
+    }else{
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef _DISKIO_H_
+#define _DISKIO_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DISK_IO_DEFAULT_QUEUE_DEPTH 32
+#define DISK_IO_MAX_QUEUE_DEPTH 4096
+// Direct reads start on, and are a multiple of, this many bytes
+#define DISK_IO_ALIGN 4096
+// Bytes per read request when a load is split into a batch
+#define DISK_IO_PIECE ((size_t)128 << 10)
+// Direct reads fill every byte they load, so their windows are smaller
+#define DISK_IO_DIRECT_WINDOW ((size_t)4 << 20)
+
+typedef enum {
+    DISK_IO_MMAP,       // map the image, the kernel pages it in
+    DISK_IO_DIRECT,     // O_DIRECT reads batched through io_uring
+} DiskIoMode;
+
+typedef struct {
+    DiskIoMode mode;
+    unsigned int queue_depth;   // reads in flight for DISK_IO_DIRECT
+    int read_only;              // open the image O_RDONLY and never write it
+} DiskIoConfig;
+
+struct DiskData;
+
+// How bytes of the image reach memory. load() returns length bytes of the
+// image from start, a multiple of the page size, until unload(); both are
+// safe to call from several threads. Writes never go through a backend.
+typedef struct DiskBackend {
+    const char *name;
+    int (*open)(struct DiskData *disk, const char *disk_path, const DiskIoConfig *config);
+    unsigned char *(*load)(const struct DiskData *disk, uint64_t start, size_t length);
+    void (*unload)(const struct DiskData *disk, unsigned char *data, size_t length);
+    void (*close)(struct DiskData *disk);
+    int whole;          // the whole image may be loaded at once
+    int coherent;       // loaded bytes follow later writes to the image
+    size_t window_size; // bytes per cached window, see window.c
+} DiskBackend;
+
+const DiskBackend *diskBackend(DiskIoMode mode);
+int parseDiskIoMode(const char *text, DiskIoMode *mode);
+
+#endif
@@ -0,0 +1,206 @@
+#define _GNU_SOURCE    // copy_file_range
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "extract.h"
+#include "dirindex.h"
+#include "window.h"
+#include "stats.h"
+
+// Create out_dir and every directory of a path inside it. path is a
+// directory path from the index, "" for the root or "/A/B".
+static int makeDirs(char *path, size_t base_len){
+    for(char *p = path + base_len; ; p++){
+        if(*p != '/' && *p != '\0'){
+            continue;
+        }
+        char saved = *p;
+        *p = '\0';
+        int made = mkdir(path, 0755) == 0 || errno == EEXIST;
+        *p = saved;
+        if(!made){
+            return -1;
+        }
+        if(saved == '\0'){
+            return 0;
+        }
+    }
+}
+
+// Copy length bytes of the image from offset to fd. The kernel copies them
+// itself when it can; otherwise they are written out of views of the image
+// a piece at a time.
+static int copyRange(const Volume *vol, int fd, uint64_t offset, uint64_t length){
+    loff_t in_offset = (loff_t)offset;
+    while(length > 0){
+        ssize_t copied = copy_file_range(vol->disk->fd, &in_offset, fd, NULL, (size_t)length, 0);
+        if(copied > 0){
+            length -= (uint64_t)copied;
+            continue;
+        }
+        if(copied < 0 && errno != EINVAL && errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP){
+            return -1;
+        }
+        break;
+    }
+    offset = (uint64_t)in_offset;
+    while(length > 0){
+        size_t piece = length < VIEW_CHUNK ? (size_t)length : VIEW_CHUNK;
+        VolumeView view;
+        const unsigned char *data = viewRange(vol, offset, piece, &view);
+        if(data == NULL){
+            return -1;
+        }
+        adviseRange(data, piece, MADV_SEQUENTIAL);
+        size_t done = 0;
+        while(done < piece){
+            ssize_t written = write(fd, data + done, piece - done);
+            if(written <= 0){
+                releaseView(vol, &view);
+                return -1;
+            }
+            done += (size_t)written;
+        }
+        releaseView(vol, &view);
+        offset += piece;
+        length -= piece;
+    }
+    return 0;
+}
+
+// Append "/" and one name from the image to path. The name may say
+// anything, so a '/' in it becomes '_', and a name that is empty, "." or
+// ".." has each of its dots replaced too: nothing written under -o ever
+// leaves the output directory.
+static void appendComponent(char *path, const char *name, size_t name_len){
+    char *p = path + strlen(path);
+    *p++ = '/';
+    int dots_only = 1;
+    for(size_t i = 0; i < name_len; i++){
+        dots_only = dots_only && name[i] == '.';
+    }
+    if(name_len == 0){
+        *p++ = '_';
+    }
+    for(size_t i = 0; i < name_len; i++){
+        *p++ = name[i] == '/' || (dots_only && name_len <= 2) ? '_' : name[i];
+    }
+    *p = '\0';
+}
+
+// Create path for writing, never over an existing file: two deleted files
+// of the same name are kept apart as NAME~1.EXT, NAME~2.EXT and so on.
+// path must have room for EXTRACT_SUFFIX_MAX more bytes.
+static int createOutput(char *path){
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if(fd >= 0 || errno != EEXIST){
+        return fd;
+    }
+    char *base = strrchr(path, '/') + 1;
+    char *dot = strrchr(base, '.');
+    if(dot == NULL || dot == base){
+        dot = base + strlen(base);
+    }
+    char ext[EXTRACT_SUFFIX_MAX + 1];
+    size_t ext_len = strlen(dot);
+    if(ext_len > EXTRACT_SUFFIX_MAX / 2){
+        dot += ext_len;
+        ext_len = 0;
+    }
+    memcpy(ext, dot, ext_len + 1);
+    for(unsigned int n = 1; n <= EXTRACT_MAX_COPIES; n++){
+        sprintf(dot, "~%u%s", n, ext);
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if(fd >= 0 || errno != EEXIST){
+            return fd;
+        }
+    }
+    return -1;
+}
+
+// Write a recovered file, whose clusters are the given runs in order, to
+// the same path under vol->extract_dir. The image is only read. The name
+// is the long name when there is one, and the restored short name
+// otherwise.
+int extractFile(Volume *vol, long slot, const ClusterRun *runs, size_t run_count){
+    const DirIndex *index = vol->dir_index;
+    const char *dir_path = index->paths + index->dir_path[slot];
+    const char *name = dirIndexLongName(index, slot) ? dirIndexLongName(index, slot) : index->names[slot];
+    size_t base_len = strlen(vol->extract_dir);
+    // An empty name between two slashes grows to "_"
+    char *path = malloc(base_len + 2 * strlen(dir_path) + strlen(name) + EXTRACT_SUFFIX_MAX + 3);
+    if(path == NULL){
+        perror("Error allocating memory");
+        return -1;
+    }
+    strcpy(path, vol->extract_dir);
+    for(const char *part = dir_path; *part == '/'; ){
+        const char *end = strchr(part + 1, '/');
+        size_t part_len = end ? (size_t)(end - part - 1) : strlen(part + 1);
+        appendComponent(path, part + 1, part_len);
+        part += 1 + part_len;
+    }
+    if(makeDirs(path, base_len) != 0){
+        perror("Error creating output directory");
+        free(path);
+        return -1;
+    }
+    appendComponent(path, name, strlen(name));
+
+    int fd = createOutput(path);
+    if(fd < 0){
+        perror("Error creating output file");
+        free(path);
+        return -1;
+    }
+    int status = 0;
+    uint64_t left = index->size[slot];
+    for(size_t r = 0; status == 0 && r < run_count && left > 0; r++){
+        uint64_t length = (uint64_t)runs[r].length * vol->cluster_size;
+        if(length > left){
+            length = left;
+        }
+        status = copyRange(vol, fd, clusterOffset(vol, runs[r].start), length);
+        left -= length;
+    }
+    if(close(fd) != 0){
+        status = -1;
+    }
+    if(status != 0){
+        perror("Error writing output file");
+        unlink(path);
+    }
+    statAdd(STAT_CLUSTERS_VISITED, clustersForSize(vol, index->size[slot]));
+    free(path);
+    return status;
+}
+
+// extractFile() for a chain listed cluster by cluster. Consecutive
+// clusters are copied as one run.
+int extractChain(Volume *vol, long slot, const unsigned int *chain, unsigned int length){
+    ClusterRun *runs = malloc((length ? length : 1) * sizeof(ClusterRun));
+    if(runs == NULL){
+        perror("Error allocating memory");
+        return -1;
+    }
+    size_t run_count = 0;
+    for(unsigned int i = 0; i < length; i++){
+        if(run_count > 0 && runs[run_count - 1].start + runs[run_count - 1].length == chain[i]){
+            runs[run_count - 1].length++;
+        }else{
+            runs[run_count].start = chain[i];
+            runs[run_count++].length = 1;
+        }
+    }
+    int status = extractFile(vol, slot, runs, run_count);
+    free(runs);
+    return status;
+}
@@ -0,0 +1,15 @@
+#ifndef _EXTRACT_H_
+#define _EXTRACT_H_
+
+#include "volume.h"
+#include "freemap.h"
+
+// Copies of one name kept apart as NAME~1.EXT and so on, and the room the
+// "~N" and a kept extension may take
+#define EXTRACT_MAX_COPIES 9999
+#define EXTRACT_SUFFIX_MAX 32
+
+int extractFile(Volume *vol, long slot, const ClusterRun *runs, size_t run_count);
+int extractChain(Volume *vol, long slot, const unsigned int *chain, unsigned int length);
+
+#endif
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fatcheck.h"
+#include "window.h"
+
+// Clusters of one copy whose entries differ from the active FAT, reported
+// as maximal ranges
+typedef struct {
+    FILE *out;
+    unsigned int fat_num;
+    unsigned int active_fat;
+    unsigned int start;         // current range, valid while length > 0
+    unsigned int length;
+    uint64_t clusters;
+    uint64_t ranges;
+} FatDiff;
+
+static void endRange(FatDiff *diff){
+    if(diff->length == 0){
+        return;
+    }
+    if(diff->ranges == 0){
+        fprintf(diff->out, "FAT #%u differs from FAT #%u:\n", diff->fat_num, diff->active_fat);
+    }
+    if(diff->ranges < FAT_CHECK_MAX_RANGES){
+        if(diff->length == 1){
+            fprintf(diff->out, "  cluster %u\n", diff->start);
+        }else{
+            fprintf(diff->out, "  clusters %u-%u\n", diff->start, diff->start + diff->length - 1);
+        }
+    }
+    diff->clusters += diff->length;
+    diff->ranges++;
+    diff->length = 0;
+}
+
+static void addCluster(FatDiff *diff, unsigned int cluster){
+    if(diff->length > 0 && diff->start + diff->length == cluster){
+        diff->length++;
+        return;
+    }
+    endRange(diff);
+    diff->start = cluster;
+    diff->length = 1;
+}
+
+// Compare count entries from first_cluster. Equal stretches cost one
+// memcmp(), which the C library runs with vector instructions; only a
+// block that differs is compared entry by entry, ignoring the reserved
+// high bits.
+static void diffEntries(FatDiff *diff, const unsigned char *active, const unsigned char *copy, unsigned int first_cluster, size_t count){
+    size_t block_entries = FAT_CHECK_BLOCK / 4;
+    for(size_t done = 0; done < count; done += block_entries){
+        size_t n = count - done < block_entries ? count - done : block_entries;
+        const unsigned char *a = active + done * 4, *b = copy + done * 4;
+        if(memcmp(a, b, n * 4) == 0){
+            continue;
+        }
+        for(size_t e = 0; e < n; e++){
+            uint32_t x, y;
+            memcpy(&x, a + e * 4, sizeof(x));
+            memcpy(&y, b + e * 4, sizeof(y));
+            if(((x ^ y) & FAT_ENTRY_MASK) != 0){
+                addCluster(diff, first_cluster + (unsigned int)(done + e));
+            }
+        }
+    }
+}
+
+// Compare every FAT copy with the active one over the entries of the data
+// clusters and list the cluster ranges where they disagree. With mirroring
+// off the other copies are not kept up to date, so differences there are
+// expected.
+int checkFats(Volume *vol, FILE *out){
+    unsigned int fat_count = vol->bs.BPB_NumFATs;
+    if(!vol->fat_mirrored){
+        fprintf(out, "FAT mirroring is off, FAT #%u is active\n", vol->active_fat);
+    }
+    if(fat_count < 2){
+        fprintf(out, "Only one FAT, nothing to compare\n");
+        return 0;
+    }
+    // Pieces start on a block boundary of the copy so views stay aligned
+    size_t piece_entries = VIEW_CHUNK / 4 - (VIEW_CHUNK / 4) % (FAT_CHECK_BLOCK / 4);
+    for(unsigned int fat_num = 0; fat_num < fat_count; fat_num++){
+        if(fat_num == vol->active_fat){
+            continue;
+        }
+        FatDiff diff = { out, fat_num, vol->active_fat, 0, 0, 0, 0 };
+        for(size_t done = 0; done < vol->cluster_count; done += piece_entries){
+            size_t n = vol->cluster_count - done < piece_entries ? vol->cluster_count - done : piece_entries;
+            unsigned int cluster = (unsigned int)(done + 2);
+            VolumeView view;
+            const unsigned char *copy = viewRange(vol, fatEntryOffset(vol, fat_num, cluster), n * 4, &view);
+            if(copy == NULL){
+                return 1;
+            }
+            diffEntries(&diff, vol->fat + (uint64_t)cluster * 4, copy, cluster, n);
+            releaseView(vol, &view);
+        }
+        endRange(&diff);
+        if(diff.ranges == 0){
+            fprintf(out, "FAT #%u matches FAT #%u\n", fat_num, vol->active_fat);
+            continue;
+        }
+        if(diff.ranges > FAT_CHECK_MAX_RANGES){
+            fprintf(out, "  ... %llu more ranges\n", (unsigned long long)(diff.ranges - FAT_CHECK_MAX_RANGES));
+        }
+        fprintf(out, "FAT #%u: %llu cluster%s differ in %llu range%s\n", fat_num,
+                (unsigned long long)diff.clusters, diff.clusters == 1 ? "" : "s",
+                (unsigned long long)diff.ranges, diff.ranges == 1 ? "" : "s");
+    }
+    return 0;
+}
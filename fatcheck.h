@@ -0,0 +1,15 @@
+#ifndef _FATCHECK_H_
+#define _FATCHECK_H_
+
+#include <stdio.h>
+
+#include "volume.h"
+
+// Bytes of two FAT copies compared in one go before looking at entries
+#define FAT_CHECK_BLOCK 4096
+// Divergent ranges listed per FAT copy; the rest are only counted
+#define FAT_CHECK_MAX_RANGES 100
+
+int checkFats(Volume *vol, FILE *out);
+
+#endif
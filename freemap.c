@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "freemap.h"
+#include "stats.h"
+
+// Build the 64-bit bitmap word for 64 consecutive FAT entries. The FAT
+// need not be aligned, so the entries are copied out first, as fatEntry()
+// does; the loop then has no branches or early exits so the compiler can
+// turn it into vector compares against zero.
+static uint64_t freeBits(const unsigned char *fat, unsigned int count){
+    uint32_t entries[64];
+    memcpy(entries, fat, (size_t)count * sizeof(uint32_t));
+    uint64_t word = 0;
+    for(unsigned int k = 0; k < count; k++){
+        word |= (uint64_t)((entries[k] & FAT_ENTRY_MASK) == 0) << k;
+    }
+    return word;
+}
+
+static int addRun(FreeMap *map, size_t *cap, unsigned int start, unsigned int length){
+    if(map->run_count == *cap){
+        *cap = *cap ? *cap * 2 : 64;
+        ClusterRun *runs = realloc(map->runs, *cap * sizeof(ClusterRun));
+        if(runs == NULL){
+            return -1;
+        }
+        map->runs = runs;
+    }
+    map->runs[map->run_count].start = start;
+    map->runs[map->run_count].length = length;
+    map->run_count++;
+    return 0;
+}
+
+// Turn the bitmap into maximal runs, skipping whole words at a time
+static int buildRuns(FreeMap *map){
+    size_t cap = 0;
+    size_t words = ((size_t)map->cluster_count + 63) / 64;
+    unsigned int run_start = 0, run_length = 0;
+    for(size_t w = 0; w < words; w++){
+        uint64_t word = map->bits[w];
+        if(word == 0 && run_length == 0){
+            continue;
+        }
+        for(unsigned int k = 0; k < 64; k++){
+            unsigned int index = (unsigned int)(w * 64 + k);
+            if(index >= map->cluster_count){
+                break;
+            }
+            if(word & ((uint64_t)1 << k)){
+                if(run_length++ == 0){
+                    run_start = index + 2;
+                }
+            }else if(run_length){
+                if(addRun(map, &cap, run_start, run_length) != 0){
+                    return -1;
+                }
+                run_length = 0;
+            }
+        }
+    }
+    if(run_length && addRun(map, &cap, run_start, run_length) != 0){
+        return -1;
+    }
+    return 0;
+}
+
+// Scan the active FAT once and record which data clusters are free
+FreeMap *buildFreeMap(const Volume *vol){
+    FreeMap *map = calloc(1, sizeof(FreeMap));
+    size_t words = ((size_t)vol->cluster_count + 63) / 64;
+    if(map == NULL || (map->bits = calloc(words ? words : 1, sizeof(uint64_t))) == NULL){
+        perror("Error allocating memory");
+        free(map);
+        return NULL;
+    }
+    map->cluster_count = vol->cluster_count;
+    uint64_t span = statBegin();
+
+    // Entry n + 2 describes data cluster n + 2, i.e. bit n
+    const unsigned char *entries = vol->fat + 2 * sizeof(uint32_t);
+    for(size_t w = 0; w < words; w++){
+        unsigned int count = 64;
+        if(w == words - 1 && vol->cluster_count % 64 != 0){
+            count = vol->cluster_count % 64;
+        }
+        map->bits[w] = freeBits(entries + w * 64 * sizeof(uint32_t), count);
+        map->free_count += (unsigned int)__builtin_popcountll(map->bits[w]);
+    }
+
+    int built = buildRuns(map);
+    statEnd(SPAN_FREE_MAP, span);
+    if(built != 0){
+        perror("Error allocating memory");
+        freeFreeMap(map);
+        return NULL;
+    }
+    return map;
+}
+
+void freeFreeMap(FreeMap *map){
+    if(map){
+        free(map->bits);
+        free(map->runs);
+        free(map);
+    }
+}
+
+// The map is built on first use and shared by every later query on the volume
+const FreeMap *getFreeMap(Volume *vol){
+    if(vol->free_map == NULL){
+        vol->free_map = buildFreeMap(vol);
+    }
+    return vol->free_map;
+}
+
+int isClusterFree(const FreeMap *map, unsigned int cluster){
+    if(cluster < 2 || cluster - 2 >= map->cluster_count){
+        return 0;
+    }
+    unsigned int index = cluster - 2;
+    return (map->bits[index / 64] >> (index % 64)) & 1;
+}
+
+int isRangeFree(const FreeMap *map, unsigned int cluster, unsigned int count){
+    if(cluster < 2 || cluster - 2 >= map->cluster_count || count > map->cluster_count - (cluster - 2)){
+        return 0;
+    }
+    unsigned int index = cluster - 2;
+    unsigned int end = index + count;
+    while(index < end){
+        unsigned int bit = index % 64;
+        unsigned int span = 64 - bit < end - index ? 64 - bit : end - index;
+        uint64_t mask = span == 64 ? ~(uint64_t)0 : (((uint64_t)1 << span) - 1) << bit;
+        if((map->bits[index / 64] & mask) != mask){
+            return 0;
+        }
+        index += span;
+    }
+    return 1;
+}
+
+// Record clusters that a recovery has just allocated. The run list is a
+// snapshot of the scan and is not updated.
+void markClustersUsed(FreeMap *map, unsigned int cluster, unsigned int count){
+    for(unsigned int n = 0; n < count; n++){
+        if(isClusterFree(map, cluster + n)){
+            unsigned int index = cluster + n - 2;
+            map->bits[index / 64] &= ~((uint64_t)1 << (index % 64));
+            map->free_count--;
+        }
+    }
+}
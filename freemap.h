@@ -0,0 +1,31 @@
+#ifndef _FREEMAP_H_
+#define _FREEMAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "volume.h"
+
+typedef struct {
+    unsigned int start;         // first cluster of the run
+    unsigned int length;        // number of clusters
+} ClusterRun;
+
+// Free clusters of the active FAT: one bit per data cluster (set = free) plus the
+// same information as a list of maximal free runs.
+typedef struct FreeMap {
+    uint64_t *bits;             // bit n describes cluster n + 2
+    unsigned int cluster_count;
+    unsigned int free_count;
+    ClusterRun *runs;
+    size_t run_count;
+} FreeMap;
+
+FreeMap *buildFreeMap(const Volume *vol);
+void freeFreeMap(FreeMap *map);
+const FreeMap *getFreeMap(Volume *vol);
+int isClusterFree(const FreeMap *map, unsigned int cluster);
+int isRangeFree(const FreeMap *map, unsigned int cluster, unsigned int count);
+void markClustersUsed(FreeMap *map, unsigned int cluster, unsigned int count);
+
+#endif
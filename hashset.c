@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <openssl/sha.h>
+
+#include "hashset.h"
+#include "recover.h"
+#include "verify.h"
+#include "dirwalk.h"
+#include "dirindex.h"
+
+// The target digests, deduplicated, with an open-addressed table over them.
+// SHA-1 output is already uniform, so its leading bytes serve as the hash.
+typedef struct {
+    unsigned char (*digests)[SHA_DIGEST_LENGTH];
+    size_t count;
+    size_t cap;
+    int32_t *buckets;
+    size_t bucket_count;
+} HashSet;
+
+static uint64_t digestKey(const unsigned char *digest){
+    uint64_t key;
+    memcpy(&key, digest, sizeof(key));
+    return key;
+}
+
+static int32_t *findBucket(const HashSet *set, const unsigned char *digest){
+    size_t b = digestKey(digest) & (set->bucket_count - 1);
+    while(set->buckets[b] != -1 && memcmp(set->digests[set->buckets[b]], digest, SHA_DIGEST_LENGTH) != 0){
+        b = (b + 1) & (set->bucket_count - 1);
+    }
+    return &set->buckets[b];
+}
+
+static int hashSetContains(const HashSet *set, const unsigned char *digest){
+    return *findBucket(set, digest) != -1;
+}
+
+static int growHashSet(HashSet *set){
+    size_t bucket_count = set->bucket_count ? set->bucket_count * 2 : 1024;
+    int32_t *buckets = malloc(bucket_count * sizeof(int32_t));
+    if(buckets == NULL){
+        perror("Error allocating memory");
+        return -1;
+    }
+    free(set->buckets);
+    set->buckets = buckets;
+    set->bucket_count = bucket_count;
+    for(size_t b = 0; b < bucket_count; b++){
+        buckets[b] = -1;
+    }
+    for(size_t n = 0; n < set->count; n++){
+        *findBucket(set, set->digests[n]) = (int32_t)n;
+    }
+    return 0;
+}
+
+static int addDigest(HashSet *set, const unsigned char *digest){
+    // Keep the table at most half full
+    if((set->count + 1) * 2 > set->bucket_count && growHashSet(set) != 0){
+        return -1;
+    }
+    int32_t *bucket = findBucket(set, digest);
+    if(*bucket != -1){
+        return 0;
+    }
+    if(set->count == set->cap){
+        size_t cap = set->cap ? set->cap * 2 : 256;
+        unsigned char (*digests)[SHA_DIGEST_LENGTH] = realloc(set->digests, cap * SHA_DIGEST_LENGTH);
+        if(digests == NULL){
+            perror("Error allocating memory");
+            return -1;
+        }
+        set->digests = digests;
+        set->cap = cap;
+    }
+    memcpy(set->digests[set->count], digest, SHA_DIGEST_LENGTH);
+    *bucket = (int32_t)set->count++;
+    return 0;
+}
+
+// Each line starts with a 40-digit hex SHA-1; anything after it, such as
+// the filename sha1sum prints, is ignored. Blank lines and lines starting
+// with '#' are ignored.
+static int readDigests(HashSet *set, const char *digest_path){
+    FILE *file = fopen(digest_path, "r");
+    if(file == NULL){
+        perror("Error opening digest list");
+        return -1;
+    }
+    char line[DIR_PATH_MAX + 64];
+    unsigned int line_no = 0;
+    int status = 0;
+    while(status == 0 && fgets(line, sizeof(line), file) != NULL){
+        line_no++;
+        char *hex = line + strspn(line, " \t");
+        if(strchr("#\r\n", hex[0])){
+            continue;
+        }
+        size_t len = 0;
+        while(len < SHA_DIGEST_LENGTH * 2 && isxdigit((unsigned char)hex[len])){
+            len++;
+        }
+        if(len != SHA_DIGEST_LENGTH * 2 || !(hex[len] == '\0' || isspace((unsigned char)hex[len]))){
+            fprintf(stderr, "%s:%u: expected a SHA-1\n", digest_path, line_no);
+            status = -1;
+            break;
+        }
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        hex_string_to_byte_array(hex, digest, SHA_DIGEST_LENGTH);
+        status = addDigest(set, digest);
+    }
+    fclose(file);
+    return status;
+}
+
+// Print where a recovered entry now lives, by its long name if it has one
+static void printRecoveredPath(const DirIndex *index, long slot, FILE *out){
+    const char *long_name = dirIndexLongName(index, slot);
+    fprintf(out, "%s/%s: successfully recovered with SHA-1\n", index->paths + index->dir_path[slot], long_name ? long_name : index->names[slot]);
+}
+
+// Recover every deleted file of the volume whose contiguous data hashes to
+// one of the listed digests. Each candidate is hashed once on the
+// verification pool, whatever the number of digests, and restored in
+// on-disk order; an entry whose clusters an earlier match took is skipped.
+int recoverHashSet(Volume *vol, const char *digest_path, FILE *out){
+    HashSet set = {0};
+    if(readDigests(&set, digest_path) != 0 || (set.bucket_count == 0 && growHashSet(&set) != 0)){
+        free(set.digests);
+        free(set.buckets);
+        return 1;
+    }
+    DirIndex *index = getDirIndex(vol);
+    long *slots = index ? malloc((index->count ? index->count : 1) * sizeof(long)) : NULL;
+    if(slots == NULL){
+        if(index){
+            perror("Error allocating memory");
+        }
+        free(set.digests);
+        free(set.buckets);
+        return 1;
+    }
+    size_t candidate_count = 0;
+    for(size_t slot = 0; slot < index->count; slot++){
+        if(dirIndexIsDeletedFile(index, (long)slot) && contiguousRangeFree(vol, (long)slot)){
+            slots[candidate_count++] = (long)slot;
+        }
+    }
+
+    unsigned char (*digests)[SHA_DIGEST_LENGTH] = malloc((candidate_count ? candidate_count : 1) * SHA_DIGEST_LENGTH);
+    unsigned char *found = calloc(set.count ? set.count : 1, 1);
+    if(digests == NULL || found == NULL){
+        perror("Error allocating memory");
+    }
+    if(digests == NULL || found == NULL || hashIndexedEntries(vol, slots, candidate_count, digests) != 0){
+        free(found);
+        free(digests);
+        free(slots);
+        free(set.digests);
+        free(set.buckets);
+        return 1;
+    }
+
+    size_t recovered = 0;
+    int status = 0;
+    for(size_t n = 0; n < candidate_count; n++){
+        long slot = slots[n];
+        if(!hashSetContains(&set, digests[n]) || !contiguousRangeFree(vol, slot)){
+            continue;
+        }
+        // Without a long name to recover it from, the first byte is unknown
+        char first_char = (char)index->short_first[slot];
+        if((unsigned char)first_char == 0xE5){
+            first_char = '_';
+        }
+        if(restoreContiguousFile(vol, slot, first_char) != 0){
+            status = 1;
+            break;
+        }
+        printRecoveredPath(index, slot, out);
+        found[*findBucket(&set, digests[n])] = 1;
+        recovered++;
+    }
+    size_t matched = 0;
+    for(size_t d = 0; d < set.count; d++){
+        matched += found[d];
+    }
+    fprintf(out, "Recovered %zu files matching %zu of %zu digests\n", recovered, matched, set.count);
+
+    free(found);
+    free(digests);
+    free(slots);
+    free(set.digests);
+    free(set.buckets);
+    return status;
+}
@@ -0,0 +1,10 @@
+#ifndef _HASHSET_H_
+#define _HASHSET_H_
+
+#include <stdio.h>
+
+#include "volume.h"
+
+int recoverHashSet(Volume *vol, const char *digest_path, FILE *out);
+
+#endif
@@ -0,0 +1,451 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+// A journal is this header, one JournalRecord per write and then the new
+// bytes of every write back to back. It is fsynced before the image is
+// touched, so after a crash it is either complete, and replayed, or torn,
+// and the image was never written.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t write_count;
+    uint64_t image_size;
+    uint64_t data_bytes;
+    uint64_t checksum;          // of the records and the data
+} JournalHeader;
+
+typedef struct {
+    uint64_t offset;
+    uint64_t length;
+} JournalRecord;
+
+static const char journal_magic[8] = { 'N', 'Y', 'U', 'J', 'R', 'N', 'L', '1' };
+
+// A run of the image to rewrite, built from one or more changes
+typedef struct {
+    uint64_t offset;
+    size_t length;
+    unsigned char *bytes;
+} VolumeWrite;
+
+// Remember the new contents of length bytes at offset. The mapping is
+// read-only, so nothing reaches the image until applyChanges().
+int addChange(ChangeList **list_ptr, uint64_t offset, const void *bytes, size_t length){
+    ChangeList *list = *list_ptr;
+    if(list == NULL){
+        list = calloc(1, sizeof(ChangeList));
+        if(list == NULL){
+            perror("Error allocating memory");
+            return -1;
+        }
+        *list_ptr = list;
+    }
+    if(list->failed){
+        return -1;
+    }
+    if(list->count == list->cap){
+        size_t cap = list->cap ? list->cap * 2 : 64;
+        VolumeChange *changes = realloc(list->changes, cap * sizeof(VolumeChange));
+        if(changes == NULL){
+            perror("Error allocating memory");
+            list->failed = 1;
+            return -1;
+        }
+        list->changes = changes;
+        list->cap = cap;
+    }
+    if(list->bytes_used + length > list->bytes_cap){
+        size_t cap = list->bytes_cap ? list->bytes_cap : 256;
+        while(cap < list->bytes_used + length){
+            cap *= 2;
+        }
+        unsigned char *grown = realloc(list->bytes, cap);
+        if(grown == NULL){
+            perror("Error allocating memory");
+            list->failed = 1;
+            return -1;
+        }
+        list->bytes = grown;
+        list->bytes_cap = cap;
+    }
+    VolumeChange *change = &list->changes[list->count++];
+    change->offset = offset;
+    change->length = (uint32_t)length;
+    change->data = (uint32_t)list->bytes_used;
+    memcpy(list->bytes + list->bytes_used, bytes, length);
+    list->bytes_used += length;
+    return 0;
+}
+
+void freeChangeList(ChangeList *list){
+    if(list){
+        free(list->changes);
+        free(list->bytes);
+        free(list);
+    }
+}
+
+static int compareChangeOffsets(const void *a, const void *b){
+    const VolumeChange *x = *(const VolumeChange *const *)a, *y = *(const VolumeChange *const *)b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static void freeWrites(VolumeWrite *writes, size_t count){
+    for(size_t w = 0; w < count; w++){
+        free(writes[w].bytes);
+    }
+    free(writes);
+}
+
+// Copy every change of the active FAT to the other FAT copies, right after
+// the change itself, unless mirroring is off. Returns the changes to write,
+// or NULL.
+static VolumeChange *mirrorFatChanges(const Volume *vol, size_t *count){
+    const ChangeList *list = vol->changes;
+    unsigned int copies = vol->fat_mirrored ? vol->bs.BPB_NumFATs : 1;
+    uint64_t active_start = fatEntryOffset(vol, vol->active_fat, 0);
+    size_t total = 0;
+    for(size_t n = 0; n < list->count; n++){
+        uint64_t offset = list->changes[n].offset;
+        total += offset >= active_start && offset < active_start + vol->fat_size ? copies : 1;
+    }
+    VolumeChange *changes = malloc((total ? total : 1) * sizeof(VolumeChange));
+    if(changes == NULL){
+        perror("Error allocating memory");
+        return NULL;
+    }
+    size_t used = 0;
+    for(size_t n = 0; n < list->count; n++){
+        const VolumeChange *change = &list->changes[n];
+        changes[used++] = *change;
+        if(copies == 1 || change->offset < active_start || change->offset >= active_start + vol->fat_size){
+            continue;
+        }
+        for(unsigned int fat_num = 0; fat_num < copies; fat_num++){
+            if(fat_num != vol->active_fat){
+                changes[used] = *change;
+                changes[used++].offset = fatEntryOffset(vol, fat_num, 0) + (change->offset - active_start);
+            }
+        }
+    }
+    *count = used;
+    return changes;
+}
+
+// Merge the changes into as few writes as possible. Changes closer than
+// JOURNAL_MERGE_GAP share a write, with the image bytes between them
+// rewritten unchanged; a contiguous chain in one FAT copy becomes a single
+// write, and so does each of its mirrors. Changes are then laid over the
+// writes in the order they were made, so a later edit of the same bytes
+// wins.
+static VolumeWrite *coalesceChanges(const Volume *vol, size_t *write_count){
+    const ChangeList *list = vol->changes;
+    size_t change_count = 0;
+    VolumeChange *changes = mirrorFatChanges(vol, &change_count);
+    if(changes == NULL){
+        return NULL;
+    }
+    const VolumeChange **sorted = malloc(change_count * sizeof(VolumeChange *));
+    VolumeWrite *writes = calloc(change_count, sizeof(VolumeWrite));
+    if(sorted == NULL || writes == NULL){
+        perror("Error allocating memory");
+        free(sorted);
+        free(writes);
+        free(changes);
+        return NULL;
+    }
+    for(size_t n = 0; n < change_count; n++){
+        sorted[n] = &changes[n];
+    }
+    qsort(sorted, change_count, sizeof(VolumeChange *), compareChangeOffsets);
+
+    size_t count = 0;
+    uint64_t end = 0;
+    for(size_t n = 0; n < change_count; n++){
+        const VolumeChange *change = sorted[n];
+        if(count > 0 && change->offset <= end + JOURNAL_MERGE_GAP){
+            if(change->offset + change->length > end){
+                end = change->offset + change->length;
+            }
+            writes[count - 1].length = (size_t)(end - writes[count - 1].offset);
+            continue;
+        }
+        writes[count].offset = change->offset;
+        writes[count].length = change->length;
+        end = change->offset + change->length;
+        count++;
+    }
+    free(sorted);
+
+    for(size_t w = 0; w < count; w++){
+        writes[w].bytes = malloc(writes[w].length);
+        if(writes[w].bytes == NULL){
+            perror("Error allocating memory");
+            freeWrites(writes, count);
+            free(changes);
+            return NULL;
+        }
+        // Fill the gaps with the image as it is
+        if(pread(vol->disk->fd, writes[w].bytes, writes[w].length, (off_t)writes[w].offset) != (ssize_t)writes[w].length){
+            perror("Error reading image");
+            freeWrites(writes, count);
+            free(changes);
+            return NULL;
+        }
+    }
+    for(size_t n = 0; n < change_count; n++){
+        const VolumeChange *change = &changes[n];
+        size_t lo = 0, hi = count;
+        while(hi - lo > 1){
+            size_t mid = (lo + hi) / 2;
+            if(writes[mid].offset <= change->offset){
+                lo = mid;
+            }else{
+                hi = mid;
+            }
+        }
+        memcpy(writes[lo].bytes + (change->offset - writes[lo].offset), list->bytes + change->data, change->length);
+    }
+    free(changes);
+    *write_count = count;
+    return writes;
+}
+
+// Name the part of the image a write falls in, for the dry-run plan
+static void describeOffset(const Volume *vol, uint64_t offset, char *out, size_t out_len){
+    if(offset < vol->fat_offset){
+        snprintf(out, out_len, "reserved sectors");
+    }else if(offset < vol->data_offset){
+        snprintf(out, out_len, "FAT #%llu", (unsigned long long)((offset - vol->fat_offset) / vol->fat_size));
+    }else{
+        snprintf(out, out_len, "cluster %llu", (unsigned long long)((offset - vol->data_offset) / vol->cluster_size + 2));
+    }
+}
+
+// Show the writes applyChanges() would make, without making them
+void printChanges(const Volume *vol, FILE *out){
+    if(vol->changes == NULL || vol->changes->count == 0){
+        fprintf(out, "Dry run: no changes, the image is unchanged\n");
+        return;
+    }
+    size_t write_count = 0;
+    VolumeWrite *writes = coalesceChanges(vol, &write_count);
+    if(writes == NULL){
+        return;
+    }
+    size_t total = 0;
+    for(size_t w = 0; w < write_count; w++){
+        total += writes[w].length;
+    }
+    fprintf(out, "Dry run: %zu bytes in %zu writes planned, the image is unchanged\n", total, write_count);
+    for(size_t w = 0; w < write_count; w++){
+        char where[32];
+        describeOffset(vol, writes[w].offset, where, sizeof(where));
+        fprintf(out, "  %s: %zu bytes at offset %llu\n", where, writes[w].length, (unsigned long long)writes[w].offset);
+    }
+    freeWrites(writes, write_count);
+}
+
+static uint64_t journalChecksum(uint64_t hash, const void *data, size_t len){
+    const unsigned char *bytes = data;
+    for(size_t n = 0; n < len; n++){
+        hash = (hash ^ bytes[n]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static int writeAll(int fd, const void *data, size_t len, uint64_t offset){
+    const unsigned char *bytes = data;
+    while(len > 0){
+        ssize_t written = pwrite(fd, bytes, len, (off_t)offset);
+        if(written <= 0){
+            return -1;
+        }
+        bytes += written;
+        len -= (size_t)written;
+        offset += (uint64_t)written;
+    }
+    return 0;
+}
+
+// fsync() the directory holding path, so a file just created there
+// survives a crash along with its contents
+static int syncParentDirectory(const char *path){
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+    if(dir == NULL){
+        return -1;
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if(fd < 0){
+        return -1;
+    }
+    int status = fsync(fd);
+    if(close(fd) != 0){
+        status = -1;
+    }
+    return status;
+}
+
+static int writeJournal(const char *journal_path, const Volume *vol, const VolumeWrite *writes, size_t write_count){
+    JournalHeader header = {0};
+    memcpy(header.magic, journal_magic, sizeof(journal_magic));
+    header.version = 1;
+    header.write_count = (uint32_t)write_count;
+    header.image_size = vol->disk->size;
+    uint64_t checksum = 0xCBF29CE484222325ULL;
+    for(size_t w = 0; w < write_count; w++){
+        JournalRecord record = { writes[w].offset, writes[w].length };
+        checksum = journalChecksum(checksum, &record, sizeof(record));
+        header.data_bytes += writes[w].length;
+    }
+    for(size_t w = 0; w < write_count; w++){
+        checksum = journalChecksum(checksum, writes[w].bytes, writes[w].length);
+    }
+    header.checksum = checksum;
+
+    int fd = open(journal_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0){
+        return -1;
+    }
+    uint64_t pos = 0;
+    int status = writeAll(fd, &header, sizeof(header), pos);
+    pos += sizeof(header);
+    for(size_t w = 0; status == 0 && w < write_count; w++){
+        JournalRecord record = { writes[w].offset, writes[w].length };
+        status = writeAll(fd, &record, sizeof(record), pos);
+        pos += sizeof(record);
+    }
+    for(size_t w = 0; status == 0 && w < write_count; w++){
+        status = writeAll(fd, writes[w].bytes, writes[w].length, pos);
+        pos += writes[w].length;
+    }
+    if(status == 0){
+        status = fsync(fd);
+    }
+    if(close(fd) != 0){
+        status = -1;
+    }
+    // The new directory entry is what makes the journal findable
+    if(status == 0){
+        status = syncParentDirectory(journal_path);
+    }
+    return status;
+}
+
+// Write every planned change to the image. The coalesced writes go to the
+// journal first, then to the image with pwrite(), followed by a single
+// fsync(); the journal is removed once the image is durable. A mapping sees
+// the new contents straight away; other backends read them again.
+int applyChanges(Volume *vol){
+    ChangeList *list = vol->changes;
+    if(list == NULL || list->count == 0){
+        return 0;
+    }
+    if(list->failed){
+        fprintf(stderr, "Error planning changes, the image is unchanged\n");
+        return -1;
+    }
+    // Checked before the journal exists, so no run is left to replay it
+    if(vol->disk->read_only){
+        fprintf(stderr, "Error writing image: opened read-only, the image is unchanged\n");
+        return -1;
+    }
+    size_t write_count = 0;
+    VolumeWrite *writes = coalesceChanges(vol, &write_count);
+    if(writes == NULL){
+        return -1;
+    }
+    if(writeJournal(vol->journal_path, vol, writes, write_count) != 0){
+        perror("Error writing journal");
+        unlink(vol->journal_path);
+        freeWrites(writes, write_count);
+        return -1;
+    }
+    int status = 0;
+    for(size_t w = 0; status == 0 && w < write_count; w++){
+        status = writeAll(vol->disk->fd, writes[w].bytes, writes[w].length, writes[w].offset);
+    }
+    if(status == 0){
+        status = fsync(vol->disk->fd);
+    }
+    if(status != 0){
+        // The journal stays behind and is replayed by the next run
+        perror("Error writing image");
+    }else{
+        unlink(vol->journal_path);
+        list->count = 0;
+        list->bytes_used = 0;
+        status = reloadVolume(vol);
+    }
+    freeWrites(writes, write_count);
+    return status;
+}
+
+// Finish the writes of a run that stopped part way. A complete journal is
+// written to the image again; a torn one is dropped, since the image is
+// only written once its journal is complete. Returns -1 when a complete
+// journal cannot be replayed.
+int replayJournal(DiskData *disk, const char *journal_path){
+    FILE *in = fopen(journal_path, "rb");
+    if(in == NULL){
+        return 0;
+    }
+    JournalHeader header;
+    JournalRecord *records = NULL;
+    unsigned char *data = NULL;
+    int valid = fread(&header, sizeof(header), 1, in) == 1
+        && memcmp(header.magic, journal_magic, sizeof(journal_magic)) == 0
+        && header.version == 1
+        && header.image_size == disk->size
+        && header.data_bytes <= disk->size;
+    if(valid){
+        records = malloc((header.write_count ? header.write_count : 1) * sizeof(JournalRecord));
+        data = malloc(header.data_bytes ? header.data_bytes : 1);
+        valid = records != NULL && data != NULL
+            && fread(records, sizeof(JournalRecord), header.write_count, in) == header.write_count
+            && fread(data, 1, header.data_bytes, in) == header.data_bytes;
+    }
+    fclose(in);
+    if(valid){
+        uint64_t checksum = journalChecksum(0xCBF29CE484222325ULL, records, header.write_count * sizeof(JournalRecord));
+        checksum = journalChecksum(checksum, data, header.data_bytes);
+        uint64_t total = 0;
+        for(uint32_t w = 0; valid && w < header.write_count; w++){
+            total += records[w].length;
+            valid = records[w].offset <= disk->size && records[w].length <= disk->size - records[w].offset;
+        }
+        valid = valid && total == header.data_bytes && checksum == header.checksum;
+    }
+
+    int status = 0;
+    if(valid){
+        uint64_t pos = 0;
+        for(uint32_t w = 0; status == 0 && w < header.write_count; w++){
+            status = writeAll(disk->fd, data + pos, records[w].length, records[w].offset);
+            pos += records[w].length;
+        }
+        if(status == 0){
+            status = fsync(disk->fd);
+        }
+        if(status != 0){
+            perror("Error replaying journal");
+        }else{
+            fprintf(stderr, "%s: finished the writes of an interrupted run\n", journal_path);
+        }
+    }
+    if(status == 0){
+        unlink(journal_path);
+    }
+    free(records);
+    free(data);
+    return status;
+}
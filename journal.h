@@ -0,0 +1,40 @@
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "volume.h"
+
+#define JOURNAL_SUFFIX ".nyujournal"
+
+// Bytes of unchanged image data worth rewriting to merge two nearby edits
+// into one write
+#define JOURNAL_MERGE_GAP 512
+
+// One planned edit of the image, in the order it was made
+typedef struct {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t data;              // offset of the new bytes in ChangeList.bytes
+} VolumeChange;
+
+// Every edit a command plans, held back until it is applied in one go
+typedef struct ChangeList {
+    VolumeChange *changes;
+    size_t count;
+    size_t cap;
+    unsigned char *bytes;
+    size_t bytes_used;
+    size_t bytes_cap;
+    int failed;                 // an edit could not be recorded
+} ChangeList;
+
+int addChange(ChangeList **list, uint64_t offset, const void *bytes, size_t length);
+void freeChangeList(ChangeList *list);
+void printChanges(const Volume *vol, FILE *out);
+int applyChanges(Volume *vol);
+int replayJournal(DiskData *disk, const char *journal_path);
+
+#endif
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "lfn.h"
+
+int isLfnEntry(const DirEntry *dirEntry){
+    return dirEntry->DIR_Attr == 0x0F;
+}
+
+void lfnReset(LfnState *state){
+    state->count = 0;
+    state->part_count = 0;
+}
+
+// Remember one long name entry. More than a name's worth of entries in a
+// row can only be orphans, so the oldest is dropped.
+void lfnPush(LfnState *state, const DirEntry *dirEntry, uint64_t offset){
+    if(state->count == LFN_MAX_PARTS){
+        memmove(state->parts, state->parts + 1, (LFN_MAX_PARTS - 1) * sizeof(state->parts[0]));
+        memmove(state->offsets, state->offsets + 1, (LFN_MAX_PARTS - 1) * sizeof(state->offsets[0]));
+        state->count--;
+    }
+    state->parts[state->count] = *dirEntry;
+    state->offsets[state->count++] = offset;
+}
+
+// The checksum every long name entry stores for its 11-byte short name
+unsigned char lfnChecksum(const unsigned char *short_name){
+    unsigned char sum = 0;
+    for(int i = 0; i < 11; i++){
+        sum = (unsigned char)(((sum & 1) << 7) + (sum >> 1) + short_name[i]);
+    }
+    return sum;
+}
+
+// Deleting a file overwrites byte 0 of its short name, but the checksum
+// still determines it: the checksum is a bijection of that byte.
+static unsigned char impliedFirstChar(const DirEntry *dirEntry, unsigned char checksum){
+    unsigned char short_name[11];
+    memcpy(short_name, dirEntry->DIR_Name, sizeof(short_name));
+    for(unsigned int c = 0x21; c < 0x100; c++){
+        short_name[0] = (unsigned char)c;
+        if(lfnChecksum(short_name) == checksum){
+            return c == 0xE5 ? 0 : (unsigned char)c;
+        }
+    }
+    return 0;
+}
+
+static size_t putUtf8(char *out, size_t used, uint32_t code){
+    unsigned char bytes[4];
+    size_t len;
+    if(code < 0x80){
+        bytes[0] = (unsigned char)code;
+        len = 1;
+    }else if(code < 0x800){
+        bytes[0] = (unsigned char)(0xC0 | code >> 6);
+        bytes[1] = (unsigned char)(0x80 | (code & 0x3F));
+        len = 2;
+    }else if(code < 0x10000){
+        bytes[0] = (unsigned char)(0xE0 | code >> 12);
+        bytes[1] = (unsigned char)(0x80 | ((code >> 6) & 0x3F));
+        bytes[2] = (unsigned char)(0x80 | (code & 0x3F));
+        len = 3;
+    }else{
+        bytes[0] = (unsigned char)(0xF0 | code >> 18);
+        bytes[1] = (unsigned char)(0x80 | ((code >> 12) & 0x3F));
+        bytes[2] = (unsigned char)(0x80 | ((code >> 6) & 0x3F));
+        bytes[3] = (unsigned char)(0x80 | (code & 0x3F));
+        len = 4;
+    }
+    if(used + len >= LFN_NAME_MAX){
+        return used;
+    }
+    memcpy(out + used, bytes, len);
+    return used + len;
+}
+
+// Convert the UCS-2 characters of parts[start..count), last entry first,
+// to UTF-8. Surrogate pairs are joined; a lone surrogate becomes '?'.
+static size_t decodeName(const LfnState *state, unsigned int start, char *out){
+    size_t used = 0;
+    uint32_t high = 0;
+    for(unsigned int p = state->count; p-- > start;){
+        const LfnEntry *part = (const LfnEntry *)&state->parts[p];
+        unsigned short chars[13];
+        memcpy(chars, part->LDIR_Name1, sizeof(part->LDIR_Name1));
+        memcpy(chars + 5, part->LDIR_Name2, sizeof(part->LDIR_Name2));
+        memcpy(chars + 11, part->LDIR_Name3, sizeof(part->LDIR_Name3));
+        for(int c = 0; c < 13; c++){
+            uint32_t code = chars[c];
+            if(code == 0){
+                p = start;
+                break;
+            }
+            if(code >= 0xD800 && code < 0xDC00){
+                if(high){
+                    used = putUtf8(out, used, '?');
+                }
+                high = code;
+                continue;
+            }
+            if(code >= 0xDC00 && code < 0xE000){
+                code = high ? 0x10000 + ((high - 0xD800) << 10) + (code - 0xDC00) : '?';
+            }else if(high){
+                used = putUtf8(out, used, '?');
+            }
+            high = 0;
+            used = putUtf8(out, used, code);
+        }
+    }
+    if(high){
+        used = putUtf8(out, used, '?');
+    }
+    out[used] = '\0';
+    return used;
+}
+
+// Assemble the long name of the short entry that follows the pending long
+// name entries, and start over for the next entry. Live names must carry
+// consecutive ordinals ending with the 0x40 flag. Deleted names have lost
+// their ordinals, so position decides the order; either way every part
+// must carry the checksum of the short name. Returns NULL when there is
+// no valid long name.
+const char *lfnFinish(LfnState *state, const DirEntry *dirEntry, uint64_t offset){
+    unsigned int count = state->count;
+    int deleted = dirEntry->DIR_Name[0] == 0xE5;
+    state->count = 0;
+    state->part_count = 0;
+    state->first_char = dirEntry->DIR_Name[0];
+    if(count == 0){
+        return NULL;
+    }
+
+    unsigned char checksum = ((const LfnEntry *)&state->parts[count - 1])->LDIR_Chksum;
+    unsigned int start = count;
+    int complete = 0;
+    while(start > 0 && !complete){
+        const LfnEntry *part = (const LfnEntry *)&state->parts[start - 1];
+        unsigned int ordinal = count - start + 1;
+        if(part->LDIR_Chksum != checksum){
+            break;
+        }
+        if(deleted){
+            if(part->LDIR_Ord != 0xE5){
+                break;
+            }
+        }else{
+            if((part->LDIR_Ord & 0x1F) != ordinal){
+                break;
+            }
+            complete = (part->LDIR_Ord & 0x40) != 0;
+        }
+        start--;
+    }
+    if(start == count || (!deleted && !complete)){
+        return NULL;
+    }
+    if(deleted){
+        state->first_char = impliedFirstChar(dirEntry, checksum);
+        if(state->first_char == 0){
+            return NULL;
+        }
+    }else if(lfnChecksum(dirEntry->DIR_Name) != checksum){
+        return NULL;
+    }
+
+    state->count = count;
+    size_t len = decodeName(state, start, state->name);
+    state->count = 0;
+    if(len == 0){
+        return NULL;
+    }
+    // Restoring a deleted name rewrites its entries through the short entry,
+    // which is only possible when they sit right in front of it.
+    unsigned int parts = count - start;
+    int adjacent = 1;
+    for(unsigned int k = 1; adjacent && k <= parts; k++){
+        adjacent = state->offsets[count - k] == offset - k * sizeof(DirEntry);
+    }
+    state->part_count = adjacent ? parts : 0;
+    return state->name;
+}
+
+// Plan giving back the ordinals of the part_count long name entries in
+// front of a short entry, so the restored file keeps its long name.
+void lfnRestore(Volume *vol, uint64_t offset, unsigned int part_count){
+    for(unsigned int k = 1; k <= part_count; k++){
+        unsigned char ordinal = (unsigned char)(k == part_count ? k | 0x40 : k);
+        writeVolume(vol, offset - k * sizeof(DirEntry) + offsetof(LfnEntry, LDIR_Ord), &ordinal, 1);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef _LFN_H_
+#define _LFN_H_
+
+#include "volume.h"
+
+#define LFN_MAX_PARTS 20            // 255 UCS-2 characters, 13 per entry
+#define LFN_NAME_MAX 768            // UTF-8 bytes, including the NUL
+
+#pragma pack(push,1)
+typedef struct {
+    unsigned char LDIR_Ord;
+    unsigned short LDIR_Name1[5];
+    unsigned char LDIR_Attr;
+    unsigned char LDIR_Type;
+    unsigned char LDIR_Chksum;
+    unsigned short LDIR_Name2[6];
+    unsigned short LDIR_FstClusLO;
+    unsigned short LDIR_Name3[2];
+} LfnEntry;
+#pragma pack(pop)
+
+// Long name entries seen since the last short entry of one directory.
+// Everything lives in fixed buffers, so a walk assembles names without
+// touching the heap. Entries are copied, since the cluster holding them
+// may no longer be mapped when the short entry arrives.
+typedef struct {
+    DirEntry parts[LFN_MAX_PARTS];          // pending entries, on-disk order
+    uint64_t offsets[LFN_MAX_PARTS];        // where each one is in the image
+    unsigned int count;
+    char name[LFN_NAME_MAX];                // last assembled name, UTF-8
+    unsigned int part_count;                // entries of that name, if adjacent
+    unsigned char first_char;               // short name byte 0 per checksum
+} LfnState;
+
+int isLfnEntry(const DirEntry *dirEntry);
+void lfnReset(LfnState *state);
+void lfnPush(LfnState *state, const DirEntry *dirEntry, uint64_t offset);
+const char *lfnFinish(LfnState *state, const DirEntry *dirEntry, uint64_t offset);
+unsigned char lfnChecksum(const unsigned char *short_name);
+void lfnRestore(Volume *vol, uint64_t offset, unsigned int part_count);
+
+#endif
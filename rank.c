@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "rank.h"
+#include "recover.h"
+#include "verify.h"
+#include "dirindex.h"
+#include "window.h"
+#include "stats.h"
+
+typedef struct {
+    const Volume *vol;
+    RankedCandidate *ranked;
+} SampleJobs;
+
+// Seconds since 1980 of a FAT write date and time. FAT keeps local time;
+// it is read as UTC only so that entries can be compared.
+static int64_t fatTimestamp(unsigned short date, unsigned short time){
+    struct tm tm = {
+        .tm_year = 80 + (date >> 9),
+        .tm_mon = ((date >> 5) & 0x0F) - 1,
+        .tm_mday = date & 0x1F,
+        .tm_hour = time >> 11,
+        .tm_min = (time >> 5) & 0x3F,
+        .tm_sec = (time & 0x1F) * 2,
+    };
+    return (int64_t)timegm(&tm) - 315532800;
+}
+
+// Byte histogram of data and the bytes in all-zero blocks. Four counter
+// tables take turns so consecutive bytes never wait on the same counter,
+// and each block is tested by OR-ing whole words, which gcc vectorizes.
+void histogramBytes(const unsigned char *data, size_t length, uint32_t counts[256], size_t *zero_bytes){
+    uint32_t lanes[4][256] = {{0}};
+    size_t i = 0;
+    for(; i + 4 <= length; i += 4){
+        lanes[0][data[i]]++;
+        lanes[1][data[i + 1]]++;
+        lanes[2][data[i + 2]]++;
+        lanes[3][data[i + 3]]++;
+    }
+    for(; i < length; i++){
+        lanes[0][data[i]]++;
+    }
+    for(int b = 0; b < 256; b++){
+        counts[b] = lanes[0][b] + lanes[1][b] + lanes[2][b] + lanes[3][b];
+    }
+
+    size_t zeros = 0, block = 0;
+    for(; block + RANK_ZERO_BLOCK <= length; block += RANK_ZERO_BLOCK){
+        uint64_t words[RANK_ZERO_BLOCK / 8];
+        memcpy(words, data + block, RANK_ZERO_BLOCK);
+        uint64_t any = 0;
+        for(size_t w = 0; w < RANK_ZERO_BLOCK / 8; w++){
+            any |= words[w];
+        }
+        zeros += any == 0 ? RANK_ZERO_BLOCK : 0;
+    }
+    // The short block at the end of the file
+    size_t tail = block;
+    while(tail < length && data[tail] == 0){
+        tail++;
+    }
+    zeros += tail == length ? length - block : 0;
+    *zero_bytes = zeros;
+}
+
+// Judge the first RANK_SAMPLE_BYTES a candidate would recover. A start
+// outside the data region leaves nothing to recover, so counts as zeros.
+static int sampleCandidate(const Volume *vol, RankedCandidate *candidate){
+    const DirIndex *index = vol->dir_index;
+    unsigned int cluster = index->first_cluster[candidate->slot];
+    unsigned int size = index->size[candidate->slot];
+    candidate->entropy = 0;
+    candidate->zero_share = 0;
+    if(size == 0){
+        return 0;
+    }
+    if(!isDataCluster(vol, cluster)){
+        candidate->zero_share = 1;
+        return 0;
+    }
+    uint64_t to_end = (uint64_t)(vol->cluster_count - (cluster - 2)) * vol->cluster_size;
+    size_t length = size < RANK_SAMPLE_BYTES ? size : RANK_SAMPLE_BYTES;
+    if(length > to_end){
+        length = (size_t)to_end;
+    }
+
+    VolumeView view;
+    const unsigned char *data = viewRange(vol, clusterOffset(vol, cluster), length, &view);
+    if(data == NULL){
+        return -1;
+    }
+    uint32_t counts[256];
+    size_t zero_bytes;
+    histogramBytes(data, length, counts, &zero_bytes);
+    releaseView(vol, &view);
+    statAdd(STAT_CLUSTERS_VISITED, clustersForSize(vol, (unsigned int)length));
+
+    double entropy = 0;
+    for(int b = 0; b < 256; b++){
+        if(counts[b] != 0){
+            double p = (double)counts[b] / (double)length;
+            entropy -= p * log2(p);
+        }
+    }
+    candidate->entropy = entropy;
+    candidate->zero_share = (double)zero_bytes / (double)length;
+    return 0;
+}
+
+static int sampleJob(void *ctx, size_t job){
+    SampleJobs *jobs = ctx;
+    return sampleCandidate(jobs->vol, &jobs->ranked[job]);
+}
+
+// Best score first; on a tie the later entry on disk, which -r -s would
+// recover, comes first
+static int compareRanked(const void *a, const void *b){
+    const RankedCandidate *x = a, *y = b;
+    if(x->score != y->score){
+        return x->score < y->score ? 1 : -1;
+    }
+    return x->slot < y->slot ? 1 : x->slot > y->slot ? -1 : 0;
+}
+
+// Score deleted entries that share a name and sort them, most likely to
+// recover intact first. A range still free is worth the most, then data
+// that does not look wiped (mostly zero blocks, or a single fill byte),
+// then how recently the entry was written compared with the others.
+// Only the first RANK_SAMPLE_BYTES of each are read, on a pool of threads.
+int rankCandidates(Volume *vol, const long *slots, size_t count, RankedCandidate *ranked){
+    const DirIndex *index = vol->dir_index;
+    int64_t oldest = INT64_MAX, newest = INT64_MIN;
+    for(size_t n = 0; n < count; n++){
+        ranked[n].slot = slots[n];
+        // Before the threads start: the free map may still have to be built
+        ranked[n].range_free = contiguousRangeFree(vol, slots[n]);
+        ranked[n].written = fatTimestamp(index->wrt_date[slots[n]], index->wrt_time[slots[n]]);
+        oldest = ranked[n].written < oldest ? ranked[n].written : oldest;
+        newest = ranked[n].written > newest ? ranked[n].written : newest;
+    }
+    if(count == 0){
+        return 0;
+    }
+
+    SampleJobs jobs = { vol, ranked };
+    if(runPool(count, sampleJob, &jobs) != 0){
+        fprintf(stderr, "Error reading candidate files\n");
+        return -1;
+    }
+
+    for(size_t n = 0; n < count; n++){
+        RankedCandidate *c = &ranked[n];
+        double intact = 1;
+        if(index->size[c->slot] != 0){
+            intact = c->entropy < RANK_FILL_ENTROPY ? 0 : 1 - c->zero_share;
+        }
+        double recent = newest > oldest ? (double)(c->written - oldest) / (double)(newest - oldest) : 1;
+        c->score = (c->range_free ? RANK_FREE_POINTS : 0) + RANK_DATA_POINTS * intact + RANK_RECENT_POINTS * recent;
+    }
+    qsort(ranked, count, sizeof(RankedCandidate), compareRanked);
+    return 0;
+}
+
+// List every deleted file the name may refer to, best candidate first,
+// with what its score is made of. Only reads the volume.
+int rankFile(Volume *vol, char *filename, FILE *out){
+    unsigned int dir_cluster;
+    const char *name;
+    if(dirIndexResolvePath(vol, filename, &dir_cluster, &name) != 0){
+        fprintf(out, "%s: file not found\n", filename);
+        return 0;
+    }
+
+    const DirIndex *index = vol->dir_index;
+    long *slots = NULL;
+    size_t count = 0, cap = 0;
+    DirIndexMatch match;
+    for(long slot = dirIndexFirstMatch(&match, index, dir_cluster, name); slot != DIR_INDEX_NONE; slot = dirIndexNextMatch(&match)){
+        if(!dirIndexIsDeletedFile(index, slot)){
+            continue;
+        }
+        if(count == cap){
+            cap = cap ? cap * 2 : 8;
+            long *grown = realloc(slots, cap * sizeof(long));
+            if(grown == NULL){
+                perror("Error allocating memory");
+                free(slots);
+                return 1;
+            }
+            slots = grown;
+        }
+        slots[count++] = slot;
+    }
+    statAdd(STAT_CANDIDATES, count);
+    if(count == 0){
+        fprintf(out, "%s: file not found\n", filename);
+        return 0;
+    }
+
+    RankedCandidate *ranked = malloc(count * sizeof(RankedCandidate));
+    if(ranked == NULL || rankCandidates(vol, slots, count, ranked) != 0){
+        if(ranked == NULL){
+            perror("Error allocating memory");
+        }
+        free(ranked);
+        free(slots);
+        return 1;
+    }
+
+    fprintf(out, "%s: %zu candidate%s\n", filename, count, count == 1 ? "" : "s");
+    for(size_t n = 0; n < count; n++){
+        const RankedCandidate *c = &ranked[n];
+        unsigned short date = index->wrt_date[c->slot], time = index->wrt_time[c->slot];
+        fprintf(out, "  %zu. score %.1f (size = %u, starting cluster = %u, written %04u-%02u-%02u %02u:%02u:%02u, ",
+                n + 1, c->score, index->size[c->slot], index->first_cluster[c->slot],
+                1980 + (date >> 9), (date >> 5) & 0x0F, date & 0x1F, time >> 11, (time >> 5) & 0x3F, (time & 0x1F) * 2);
+        fprintf(out, "range %s, %.0f%% zeros, %.2f bits/byte)\n", c->range_free ? "free" : "in use",
+                100 * c->zero_share, c->entropy);
+    }
+    free(ranked);
+    free(slots);
+    return 0;
+}
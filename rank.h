@@ -0,0 +1,35 @@
+#ifndef _RANK_H_
+#define _RANK_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "volume.h"
+
+// Bytes read from the start of each candidate to judge its data
+#define RANK_SAMPLE_BYTES (64 * 1024)
+// Runs of zeros are counted in blocks of this many bytes
+#define RANK_ZERO_BLOCK 64
+// Below this many bits per byte the data is a fill pattern, not a file
+#define RANK_FILL_ENTROPY 1.0
+
+// Points each heuristic contributes to a score out of 100
+#define RANK_FREE_POINTS 50.0
+#define RANK_DATA_POINTS 30.0
+#define RANK_RECENT_POINTS 20.0
+
+// What ranking found out about one deleted entry
+typedef struct {
+    long slot;
+    int range_free;             // every cluster of its range still free
+    double entropy;             // bits per byte over the sample
+    double zero_share;          // share of the sample in all-zero blocks
+    int64_t written;            // DIR_WrtDate/DIR_WrtTime in seconds
+    double score;
+} RankedCandidate;
+
+void histogramBytes(const unsigned char *data, size_t length, uint32_t counts[256], size_t *zero_bytes);
+int rankCandidates(Volume *vol, const long *slots, size_t count, RankedCandidate *ranked);
+int rankFile(Volume *vol, char *filename, FILE *out);
+
+#endif
@@ -0,0 +1,385 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "reconstruct.h"
+#include "recover.h"
+#include "verify.h"
+#include "rank.h"
+#include "freemap.h"
+#include "dirindex.h"
+#include "window.h"
+#include "extract.h"
+#include "stats.h"
+
+typedef enum {
+    CONTENT_GENERIC,
+    CONTENT_TEXT,
+    CONTENT_JPEG,
+} ContentFormat;
+
+// A chain being assembled one cluster at a time, and the candidates for
+// the next one
+typedef struct {
+    const Volume *vol;
+    ContentFormat format;
+    unsigned int num_clusters;
+    unsigned int last_bytes;        // bytes used in the final cluster
+    unsigned int depth;             // position being filled
+    uint64_t chain_counts[256];     // bytes of each value in the chain so far
+    uint64_t chain_bytes;
+    double chain_share[256];        // and their share
+    int in_scan;                    // JPEG: past a start of scan
+    int last_restart;               // JPEG: n of the last RSTn, or -1
+    int previous_ends_ff;           // JPEG: a marker is split across the boundary
+    const unsigned int *candidates;
+    double *scores;
+    size_t count;
+} Assembly;
+
+static int isTextByte(unsigned char byte){
+    return byte == '\t' || byte == '\n' || byte == '\r' || (byte >= 0x20 && byte != 0x7F);
+}
+
+// What may follow 0xFF in entropy-coded JPEG data: a stuffed zero, a
+// restart marker, the end of the image, or the tables and start of the
+// next scan of a progressive image
+static int isScanMarker(unsigned char marker){
+    return marker == 0x00 || (marker >= 0xD0 && marker <= 0xD7) || marker == 0xD9 ||
+        marker == 0xC4 || marker == 0xDA || marker == 0xDD;
+}
+
+// Guess the format from the entry's first cluster
+static ContentFormat detectFormat(const unsigned char *data, size_t length){
+    if(length >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF){
+        return CONTENT_JPEG;
+    }
+    size_t text = 0;
+    for(size_t i = 0; i < length; i++){
+        text += isTextByte(data[i]);
+    }
+    return length > 0 && text * 100 >= length * 95 ? CONTENT_TEXT : CONTENT_GENERIC;
+}
+
+static void byteShares(const uint32_t counts[256], size_t length, double *share){
+    for(int b = 0; b < 256; b++){
+        share[b] = length ? (double)counts[b] / (double)length : 0;
+    }
+}
+
+// Take in the cluster just added to the chain
+static void advanceAssembly(Assembly *assembly, unsigned int cluster, const unsigned char *data, size_t length){
+    uint32_t counts[256];
+    size_t zero_bytes;
+    histogramBytes(data, length, counts, &zero_bytes);
+    assembly->chain_bytes += length;
+    for(int b = 0; b < 256; b++){
+        assembly->chain_counts[b] += counts[b];
+        assembly->chain_share[b] = (double)assembly->chain_counts[b] / (double)assembly->chain_bytes;
+    }
+    assembly->depth++;
+    if(assembly->format != CONTENT_JPEG){
+        return;
+    }
+    for(size_t i = 0; i + 1 < length; i++){
+        if(data[i] != 0xFF){
+            continue;
+        }
+        if(data[i + 1] == 0xDA){
+            assembly->in_scan = 1;
+            assembly->last_restart = -1;
+        }else if(assembly->in_scan && data[i + 1] >= 0xD0 && data[i + 1] <= 0xD7){
+            assembly->last_restart = data[i + 1] - 0xD0;
+        }
+    }
+    assembly->previous_ends_ff = length > 0 && data[length - 1] == 0xFF;
+}
+
+// JPEG rules a candidate breaks: bytes after 0xFF that scan data never
+// holds, a restart marker out of sequence, an end of image too early, or
+// a final cluster that does not end the image
+static unsigned int jpegViolations(const Assembly *assembly, const unsigned char *data, size_t length, int final){
+    unsigned int violations = 0;
+    if(assembly->in_scan){
+        int expected = assembly->last_restart;
+        if(assembly->previous_ends_ff && length > 0 && !isScanMarker(data[0])){
+            violations++;
+        }
+        for(size_t i = 0; i + 1 < length; i++){
+            if(data[i] != 0xFF){
+                continue;
+            }
+            unsigned char marker = data[i + 1];
+            if(!isScanMarker(marker)){
+                violations++;
+            }else if(marker >= 0xD0 && marker <= 0xD7){
+                if(expected >= 0 && marker - 0xD0 != (expected + 1) % 8){
+                    violations++;
+                }
+                expected = marker - 0xD0;
+            }else if(marker == 0xD9 && !(final && i + 2 == length)){
+                violations++;
+            }else if(marker == 0xDA){
+                expected = -1;
+            }
+        }
+    }
+    if(final && !(length >= 2 && data[length - 2] == 0xFF && data[length - 1] == 0xD9)){
+        violations++;
+    }
+    return violations;
+}
+
+// How badly a candidate continues the chain, lower being better: the
+// distance between its byte distribution and the chain's so far, plus
+// penalties for what its format rules out
+static int scoreCandidate(const Assembly *assembly, size_t rank, double *score){
+    unsigned int cluster = assembly->candidates[rank];
+    const Volume *vol = assembly->vol;
+    int final = assembly->depth == assembly->num_clusters - 1;
+    size_t length = final ? assembly->last_bytes : vol->cluster_size;
+    VolumeView view;
+    const unsigned char *data = viewClusters(vol, cluster, 1, &view);
+    if(data == NULL){
+        return -1;
+    }
+    uint32_t counts[256];
+    size_t zero_bytes;
+    histogramBytes(data, length, counts, &zero_bytes);
+    double share[256];
+    byteShares(counts, length, share);
+    double distance = 0;
+    for(int b = 0; b < 256; b++){
+        double d = share[b] - assembly->chain_share[b];
+        distance += d < 0 ? -d : d;
+    }
+
+    if(assembly->format == CONTENT_TEXT){
+        double binary = 0;
+        for(int b = 0; b < 256; b++){
+            binary += isTextByte((unsigned char)b) ? 0 : share[b];
+        }
+        distance += RECONSTRUCT_PENALTY * binary;
+    }else if(assembly->format == CONTENT_JPEG){
+        distance += RECONSTRUCT_PENALTY * jpegViolations(assembly, data, length, final);
+    }
+    releaseView(vol, &view);
+    statAdd(STAT_CLUSTERS_VISITED, 1);
+
+    // Fragments mostly follow each other on disk, so of two clusters that
+    // fit about as well the nearer one wins
+    *score = distance + RECONSTRUCT_ORDER_WEIGHT * log2(1.0 + (double)rank);
+    return 0;
+}
+
+// Every job writes only its own score
+static int scoreJob(void *ctx, size_t job){
+    Assembly *assembly = ctx;
+    return scoreCandidate(assembly, job, &assembly->scores[job]);
+}
+
+// Up to max free clusters not yet in the chain, going on from after
+// cluster and round past the end of the volume
+static size_t collectCandidates(const FreeMap *map, const uint64_t *taken, unsigned int cluster, unsigned int *candidates, size_t max){
+    unsigned int total = map->cluster_count;
+    unsigned int start = cluster - 2 + 1 < total ? cluster - 2 + 1 : 0;
+    size_t count = 0;
+    for(unsigned int seen = 0; seen < total && count < max;){
+        unsigned int index = (start + seen) % total;
+        unsigned int bit = index % 64;
+        unsigned int span = 64 - bit;
+        if(span > total - index){
+            span = total - index;
+        }
+        if(span > total - seen){
+            span = total - seen;
+        }
+        uint64_t open = (map->bits[index / 64] & ~taken[index / 64]) >> bit;
+        if(span < 64){
+            open &= ((uint64_t)1 << span) - 1;
+        }
+        while(open != 0 && count < max){
+            unsigned int offset = (unsigned int)__builtin_ctzll(open);
+            candidates[count++] = index + offset + 2;
+            open &= open - 1;
+        }
+        seen += span;
+    }
+    return count;
+}
+
+static uint64_t monotonicNanos(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+// Assemble the chain of a deleted entry from free clusters, greedily: from
+// its first cluster, each next one is the free cluster that continues the
+// previous best. Once seconds have passed the rest are taken in order.
+// Returns 1 when the chain is complete, 0 when the volume has too few free
+// clusters, -1 on error.
+static int assembleChain(Volume *vol, long slot, unsigned int seconds, unsigned int *chain){
+    const DirIndex *index = vol->dir_index;
+    const FreeMap *map = getFreeMap(vol);
+    if(map == NULL){
+        return -1;
+    }
+    Assembly assembly = {0};
+    assembly.vol = vol;
+    assembly.num_clusters = clustersForSize(vol, index->size[slot]);
+    assembly.last_bytes = index->size[slot] - (assembly.num_clusters - 1) * vol->cluster_size;
+    assembly.last_restart = -1;
+
+    size_t words = ((size_t)vol->cluster_count + 63) / 64;
+    uint64_t *taken = calloc(words ? words : 1, sizeof(uint64_t));
+    unsigned int *candidates = malloc(RECONSTRUCT_CANDIDATES * sizeof(unsigned int));
+    double *scores = malloc(RECONSTRUCT_CANDIDATES * sizeof(double));
+    int status = taken && candidates && scores ? 1 : -1;
+    if(status < 0){
+        perror("Error allocating memory");
+    }
+    assembly.candidates = candidates;
+    assembly.scores = scores;
+
+    uint64_t span = statBegin();
+    uint64_t deadline = monotonicNanos() + (uint64_t)seconds * 1000000000ULL;
+    unsigned int cluster = index->first_cluster[slot];
+    int out_of_time = 0;
+    unsigned int scored_depth = 0;
+    while(status > 0){
+        VolumeView view;
+        size_t length = assembly.depth == assembly.num_clusters - 1 ? assembly.last_bytes : vol->cluster_size;
+        const unsigned char *data = viewClusters(vol, cluster, 1, &view);
+        if(data == NULL){
+            status = -1;
+            break;
+        }
+        if(assembly.depth == 0){
+            assembly.format = detectFormat(data, length);
+        }
+        advanceAssembly(&assembly, cluster, data, length);
+        releaseView(vol, &view);
+        chain[assembly.depth - 1] = cluster;
+        taken[(cluster - 2) / 64] |= (uint64_t)1 << ((cluster - 2) % 64);
+        statAdd(STAT_CHAIN_STEPS, 1);
+        if(assembly.depth == assembly.num_clusters){
+            break;
+        }
+
+        int scoring = monotonicNanos() < deadline;
+        assembly.count = collectCandidates(map, taken, cluster, candidates, scoring ? RECONSTRUCT_CANDIDATES : 1);
+        if(assembly.count == 0){
+            status = 0;
+            break;
+        }
+        statAdd(STAT_CANDIDATES, assembly.count);
+        if(!scoring){
+            // Out of time: the next free cluster is the likeliest
+            if(!out_of_time){
+                scored_depth = assembly.depth;
+                out_of_time = 1;
+            }
+            cluster = candidates[0];
+            continue;
+        }
+        if(runPool(assembly.count, scoreJob, &assembly) != 0){
+            fprintf(stderr, "Error reading candidate clusters\n");
+            status = -1;
+            break;
+        }
+        size_t best = 0;
+        for(size_t c = 1; c < assembly.count; c++){
+            if(scores[c] < scores[best]){
+                best = c;
+            }
+        }
+        cluster = candidates[best];
+    }
+    statEnd(SPAN_CHAIN_SEARCH, span);
+    if(status > 0 && out_of_time){
+        fprintf(stderr, "Time budget ran out after %u of %u clusters; the rest were taken in order\n",
+                scored_depth, assembly.num_clusters);
+    }
+
+    free(taken);
+    free(candidates);
+    free(scores);
+    return status;
+}
+
+// Reconstruct a fragmented deleted file with no SHA-1 to check it against
+// and copy it under the -o directory. The guess never reaches the image.
+int reconstructFile(Volume *vol, char *filename, unsigned int seconds, FILE *out){
+    unsigned int dir_cluster;
+    const char *name;
+    if(dirIndexResolvePath(vol, filename, &dir_cluster, &name) != 0){
+        fprintf(out, "%s: file not found\n", filename);
+        return 0;
+    }
+
+    // Without a hash to tell them apart, several candidates are ambiguous
+    DirIndex *index = vol->dir_index;
+    int fileDeleted = 0;
+    long match_slot = DIR_INDEX_NONE;
+    DirIndexMatch match;
+    for(long slot = dirIndexFirstMatch(&match, index, dir_cluster, name); slot != DIR_INDEX_NONE; slot = dirIndexNextMatch(&match)){
+        if(dirIndexIsDeletedFile(index, slot)){
+            fileDeleted++;
+            match_slot = slot;
+        }
+    }
+    statAdd(STAT_CANDIDATES, fileDeleted);
+    if(fileDeleted == 0){
+        fprintf(out, "%s: file not found\n", filename);
+        return 0;
+    }
+    if(fileDeleted > 1){
+        fprintf(out, "%s: multiple candidates found\n", filename);
+        return 0;
+    }
+
+    unsigned int num_clusters = clustersForSize(vol, index->size[match_slot]);
+    const FreeMap *map = getFreeMap(vol);
+    if(map == NULL){
+        return 1;
+    }
+    // A first cluster that is allocated again has been reused
+    if(num_clusters > 0 && !isClusterFree(map, index->first_cluster[match_slot])){
+        fprintf(out, "%s: file not found\n", filename);
+        return 0;
+    }
+    unsigned int *chain = malloc((num_clusters ? num_clusters : 1) * sizeof(unsigned int));
+    if(chain == NULL){
+        perror("Error allocating memory");
+        return 1;
+    }
+    int found = num_clusters > 0 ? assembleChain(vol, match_slot, seconds, chain) : 1;
+    if(found < 0){
+        free(chain);
+        return 1;
+    }
+    if(found == 0){
+        fprintf(out, "%s: file not found\n", filename);
+        free(chain);
+        return 0;
+    }
+
+    dirIndexRestoreName(vol, match_slot, dirIndexRestoredFirstChar(index, match_slot, name));
+    unsigned int fragments = num_clusters > 0;
+    for(unsigned int i = 0; i < num_clusters; i++){
+        markClustersUsed(vol->free_map, chain[i], 1);
+        fragments += i > 0 && chain[i] != chain[i - 1] + 1;
+    }
+    int status = 0;
+    if(extractChain(vol, match_slot, chain, num_clusters) != 0){
+        status = 1;
+    }else{
+        fprintf(out, "%s: successfully reconstructed from %u fragment%s\n", filename, fragments, fragments == 1 ? "" : "s");
+    }
+    free(chain);
+    return status;
+}
@@ -0,0 +1,21 @@
+#ifndef _RECONSTRUCT_H_
+#define _RECONSTRUCT_H_
+
+#include <stdio.h>
+
+#include "volume.h"
+
+// Free clusters after the previous one scored as its successor
+#define RECONSTRUCT_CANDIDATES 256
+// Seconds spent scoring before the remaining clusters are taken in order
+#define RECONSTRUCT_DEFAULT_SECONDS 10
+// Added per doubling of how many free clusters a candidate lies past the
+// previous one; FAT allocators hand out clusters going forward
+#define RECONSTRUCT_ORDER_WEIGHT 0.2
+// Score added per broken JPEG rule, and for a text cluster made wholly
+// of bytes text never holds; byte distributions differ by at most 2
+#define RECONSTRUCT_PENALTY 2.0
+
+int reconstructFile(Volume *vol, char *filename, unsigned int seconds, FILE *out);
+
+#endif
@@ -1,73 +1,59 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <string.h>
 #include <openssl/sha.h>
 
 #include "recover.h"
+#include "batch.h"
+#include "verify.h"
+#include "search.h"
+#include "freemap.h"
+#include "dirindex.h"
+#include "cache.h"
+#include "carve.h"
+#include "hashset.h"
+#include "journal.h"
+#include "stats.h"
+#include "serve.h"
+#include "fatcheck.h"
+#include "extract.h"
+#include "rank.h"
+#include "watch.h"
+#include "reconstruct.h"
+
+
+// Long-only options start past the range of short option characters
+enum {
+    OPT_BUDGET = 256,
+    OPT_RECURSIVE,
+    OPT_CACHE,
+    OPT_CARVE,
+    OPT_HASHSET,
+    OPT_DRY_RUN,
+    OPT_IO,
+    OPT_QUEUE_DEPTH,
+    OPT_STATS,
+    OPT_SERVE,
+    OPT_VERIFY,
+    OPT_RANK,
+    OPT_WATCH,
+    OPT_TIME_BUDGET
+};
+
+// Parse a positive decimal count for a numeric option
+static int parseCount(const char *text, unsigned int *value){
+    char *end = NULL;
+    unsigned long parsed = strtoul(text, &end, 10);
+    if(end == text || *end != '\0' || parsed == 0 || parsed > 1000000){
+        return -1;
+    }
+    *value = (unsigned int)parsed;
+    return 0;
+}
 
-#define SHA_DIGEST_LENGTH 20
-#define EMPTY_SHA1 "da39a3ee5e6b4b0d3255bfef95601890afd80709"
-
-#pragma pack(push,1)
-typedef struct BootEntry {
-    unsigned char BS_jmpBoot[3];
-    unsigned char BS_OEMName[8];
-    unsigned short BPB_BytsPerSec;
-    unsigned char BPB_SecPerClus;
-    unsigned short BPB_RsvdSecCnt;
-    unsigned char BPB_NumFATs;
-    unsigned short BPB_RootEntCnt;
-    unsigned short BPB_TotSec16;
-    unsigned char BPB_Media;
-    unsigned short BPB_FATSz16;
-    unsigned short BPB_SecPerTrk;
-    unsigned short BPB_NumHeads;
-    unsigned int BPB_HiddSec;
-    unsigned int BPB_TotSec32;
-    unsigned int BPB_FATSz32;
-    unsigned short BPB_ExtFlags;
-    unsigned short BPB_FSVer;
-    unsigned int BPB_RootClus;
-    unsigned short BPB_FSInfo;
-    unsigned short BPB_BkBootSec;
-    unsigned char BPB_Reserved[12];
-    unsigned char BS_DrvNum;
-    unsigned char BS_Reserved1;
-    unsigned char BS_BootSig;
-    unsigned int BS_VolID;
-    unsigned char BS_VolLab[11];
-    unsigned char BS_FilSysType[8];
-} BootEntry;
-#pragma pack(pop)
-
-#pragma pack(push,1)
-typedef struct DirEntry {
-    unsigned char DIR_Name[11];
-    unsigned char DIR_Attr;
-    unsigned char DIR_NTRes;
-    unsigned char DIR_CrtTimeTenth; 
-    unsigned short DIR_CrtTime;     
-    unsigned short DIR_CrtDate;    
-    unsigned short DIR_LstAccDate;  
-    unsigned short DIR_FstClusHI;
-    unsigned short DIR_WrtTime;
-    unsigned short DIR_WrtDate;
-    unsigned short DIR_FstClusLO;
-    unsigned int DIR_FileSize;
-} DirEntry;
-#pragma pack(pop)
-
-typedef struct {
-    int fd;
-    size_t size;
-    unsigned char *data;
-} DiskData;
- 
 int recover(int argc, char **argv){
 
     // Milestone 1: validate usage
@@ -77,499 +63,639 @@ int recover(int argc, char **argv){
     return 0;
 }
 
-int validate_usage(int argc, char **argv){
-    char *error_message = 
+void printUsage(FILE *out){
+    const char *error_message =
     "Usage: ./nyufile disk <options>\n"
     "  -i                     Print the file system information.\n"
     "  -l                     List the root directory.\n"
     "  -r filename [-s sha1]  Recover a contiguous file.\n"
     "  -R filename -s sha1    Recover a possibly non-contiguous file.\n";
+    fprintf(out, "%s", error_message);
+}
 
-    if(argc < 2){
-        printf("%s", error_message);
-        return 1;
-    }
-
-    if (access(argv[1], F_OK) == -1) {
-        printf("%s", error_message);
-        return 1;
-    }
-
-    int option;
-    int i_flag = 0, l_flag = 0, r_flag = 0, R_flag = 0, s_flag = 0;
-    char *filename = NULL;
-    char *sha1 = NULL;
+// Parse the options in argv[1..argc-1]; argv[0] is not an option. Returns
+// -1 on a usage error. Strings in cmd point into argv. getopt_long() keeps
+// global state, so only one thread may parse at a time.
+int parseCommandLine(int argc, char **argv, CommandLine *cmd){
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->budget = DEFAULT_CLUSTER_BUDGET;
+    cmd->stats = STATS_OFF;
+    cmd->io_config.mode = DISK_IO_MMAP;
+    cmd->io_config.queue_depth = DISK_IO_DEFAULT_QUEUE_DEPTH;
 
-    optind = 2;
+    // Start over from argv[1] whatever an earlier parse left behind
+    optind = 0;
 
     // Set opterr to 0 to disable default error messages generated by getopt()
     opterr = 0;
 
-    while ((option = getopt(argc, argv, "ilr:R:s:")) != -1) {
+    static const struct option long_options[] = {
+        {"budget", required_argument, NULL, OPT_BUDGET},
+        {"recursive", no_argument, NULL, OPT_RECURSIVE},
+        {"cache", optional_argument, NULL, OPT_CACHE},
+        {"carve", required_argument, NULL, OPT_CARVE},
+        {"hashset", required_argument, NULL, OPT_HASHSET},
+        {"dry-run", no_argument, NULL, OPT_DRY_RUN},
+        {"io", required_argument, NULL, OPT_IO},
+        {"queue-depth", required_argument, NULL, OPT_QUEUE_DEPTH},
+        {"stats", optional_argument, NULL, OPT_STATS},
+        {"serve", required_argument, NULL, OPT_SERVE},
+        {"verify", no_argument, NULL, OPT_VERIFY},
+        {"rank", no_argument, NULL, OPT_RANK},
+        {"watch", optional_argument, NULL, OPT_WATCH},
+        {"time-budget", required_argument, NULL, OPT_TIME_BUDGET},
+        {NULL, 0, NULL, 0}
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "ilcr:R:s:b:o:", long_options, NULL)) != -1) {
         switch(option){
             case 'i':
-                i_flag = 1;
-                break;          
+                cmd->i_flag = 1;
+                break;
             case 'l':
-                l_flag = 1;
+                cmd->l_flag = 1;
+                break;
+            case 'c':
+                cmd->c_flag = 1;
                 break;
             case 'r':
                 if(optarg == NULL){
-                    printf("%s", error_message);
-                    return 1;
+                    return -1;
                 }
-                r_flag = 1;
-                filename = optarg;
+                cmd->r_flag = 1;
+                cmd->filename = optarg;
                 break;
             case 's':
                 if(optarg == NULL){
-                    printf("%s", error_message);
-                    return 1;
+                    return -1;
                 }
-                s_flag = 1;
-                sha1 = optarg;
+                cmd->s_flag = 1;
+                cmd->sha1 = optarg;
                 break;
             case 'R':
                 if(optarg == NULL){
-                    printf("%s", error_message);
-                    return 1;
+                    return -1;
+                }
+                cmd->R_flag = 1;
+                cmd->filename = optarg;
+                break;
+            case 'b':
+                if(optarg == NULL){
+                    return -1;
+                }
+                cmd->b_flag = 1;
+                cmd->manifest = optarg;
+                break;
+            case 'o':
+                if(optarg == NULL){
+                    return -1;
+                }
+                cmd->out_dir = optarg;
+                cmd->io_config.read_only = 1;
+                cmd->process_options = 1;
+                break;
+            case OPT_RECURSIVE:
+                cmd->recursive = 1;
+                break;
+            case OPT_CACHE:
+                cmd->use_cache = 1;
+                cmd->cache_path = optarg;
+                cmd->process_options = 1;
+                break;
+            case OPT_CARVE:
+                cmd->carve_dir = optarg;
+                break;
+            case OPT_HASHSET:
+                cmd->hashset_path = optarg;
+                break;
+            case OPT_DRY_RUN:
+                cmd->dry_run = 1;
+                cmd->process_options = 1;
+                break;
+            case OPT_IO:
+                if(parseDiskIoMode(optarg, &cmd->io_config.mode) != 0){
+                    return -1;
+                }
+                cmd->process_options = 1;
+                break;
+            case OPT_QUEUE_DEPTH:
+                if(parseCount(optarg, &cmd->io_config.queue_depth) != 0 || cmd->io_config.queue_depth > DISK_IO_MAX_QUEUE_DEPTH){
+                    return -1;
+                }
+                cmd->process_options = 1;
+                break;
+            case OPT_STATS:
+                if(optarg == NULL || strcmp(optarg, "text") == 0){
+                    cmd->stats = STATS_TEXT;
+                }else if(strcmp(optarg, "json") == 0){
+                    cmd->stats = STATS_JSON;
+                }else{
+                    return -1;
+                }
+                cmd->process_options = 1;
+                break;
+            case OPT_SERVE:
+                cmd->serve_path = optarg;
+                cmd->process_options = 1;
+                break;
+            case OPT_VERIFY:
+                cmd->verify = 1;
+                break;
+            case OPT_RANK:
+                cmd->rank = 1;
+                break;
+            case OPT_WATCH:
+                cmd->watch_interval = WATCH_DEFAULT_INTERVAL;
+                if(optarg != NULL && parseCount(optarg, &cmd->watch_interval) != 0){
+                    return -1;
+                }
+                // Watching a device in use must never write to it
+                cmd->io_config.read_only = 1;
+                cmd->process_options = 1;
+                break;
+            case OPT_TIME_BUDGET:
+                if(parseCount(optarg, &cmd->time_budget) != 0){
+                    return -1;
+                }
+                break;
+            case OPT_BUDGET:
+                if(parseCount(optarg, &cmd->budget) != 0){
+                    return -1;
                 }
-                R_flag = 1;
-                filename = optarg;
                 break;
             default:
-                printf("%s", error_message);
-                return 1;
+                return -1;
         }
     }
 
-    if(i_flag){
-        // Milestone 2: Print the file system information.
-        return printFSInfo(argv);
-    }else if(l_flag){
-        // Milestone 3: list the root directory.
-        return listRootDir(argv);
-    }else if(r_flag && !s_flag){
-        // Recover a contiguous file without shal
-        return recoverFile(argv[1], filename);
-    }else if(r_flag && s_flag){
-        // Recover a contiguous file shal
-        recoverFileWithSha1(argv[1], filename, sha1);
-    }else if(R_flag && s_flag){
-        // Recover a possibly non-contiguous file.
-        printf("Recover a possibly non-contiguous file.\n");
-    }else if(R_flag && !s_flag){
-        printf("%s", error_message);
-        return 1;
+    // With no SHA-1 to check it, a reconstructed chain is only a guess,
+    // so it goes to a file under -o and never into the image
+    if(cmd->R_flag && !cmd->s_flag && !cmd->out_dir){
+        return -1;
+    }
+    // --verify only checks what -r -s would recover
+    if(cmd->verify && !(cmd->r_flag && cmd->s_flag)){
+        return -1;
+    }
+    // --rank orders the candidates -r alone would refuse to choose from
+    if(cmd->rank && !(cmd->r_flag && !cmd->s_flag)){
+        return -1;
+    }
+    // -o never writes the image, so there is nothing to dry-run
+    if(cmd->out_dir && cmd->dry_run){
+        return -1;
+    }
+    // A server takes its commands from the socket
+    if(cmd->serve_path && (hasCommand(cmd) || cmd->dry_run)){
+        return -1;
+    }
+    // Watching runs on its own until stopped
+    if(cmd->watch_interval && (hasCommand(cmd) || cmd->dry_run || cmd->serve_path)){
+        return -1;
     }
-
     return 0;
 }
 
-DiskData *getDiskData(const char  *disk_path){
-    DiskData *disk_data = malloc(sizeof(DiskData));
-    if (!disk_data) {
-        perror("Error allocating memory");
-        return NULL;
-    }
-    // Open file
-    disk_data->fd = open(disk_path, O_RDWR);
-    if (disk_data->fd < 0) {
-        perror("Error opening file");
-        free(disk_data);
-        return NULL;
-    }
-    // Get file size
-    struct stat st;
-    if (fstat(disk_data->fd, &st) == -1) {
-        perror("Error getting file stats");
-        close(disk_data->fd);
-        free(disk_data);
-        return NULL;
-    }
-    disk_data->size = st.st_size;
-    // Map file into memory
-    disk_data->data = mmap(NULL, disk_data->size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_data->fd, 0);
-    if (disk_data->data == MAP_FAILED) {
-        perror("Error mapping file");
-        close(disk_data->fd);
-        free(disk_data);
-        return NULL;
-    }
-
-    return disk_data;
+int hasCommand(const CommandLine *cmd){
+    return cmd->i_flag || cmd->l_flag || cmd->c_flag || cmd->r_flag || cmd->R_flag || cmd->b_flag || cmd->carve_dir || cmd->hashset_path;
 }
 
-void freeDiskData(DiskData *disk_data) {
-    if(disk_data) {
-        if (disk_data->data != MAP_FAILED) {
-            munmap(disk_data->data, disk_data->size);
-        }
-        if (disk_data->fd >= 0) {
-            close(disk_data->fd);
+// A command that only reads the image and the index, so it may run
+// alongside others
+int isReadOnlyCommand(const CommandLine *cmd){
+    return cmd->i_flag || cmd->l_flag || cmd->c_flag || cmd->verify || cmd->rank || (cmd->carve_dir && !cmd->r_flag && !cmd->R_flag && !cmd->b_flag);
+}
+
+// Run the command of a parsed command line on an open volume, writing its
+// output to out, then apply the edits it planned (or show them). The
+// output of a command that writes is held back until its edits are on
+// disk, so a failed write never reads as a recovery.
+int runCommand(Volume *vol, const CommandLine *cmd, FILE *out){
+    int writes = !isReadOnlyCommand(cmd) && !cmd->dry_run && !cmd->out_dir;
+    if(writes && vol->disk->read_only){
+        fprintf(stderr, "Error writing image: opened read-only, the image is unchanged\n");
+        return 1;
+    }
+    FILE *report = out;
+    char *held = NULL;
+    size_t held_size = 0;
+    if(writes){
+        report = open_memstream(&held, &held_size);
+        if(report == NULL){
+            perror("Error allocating memory");
+            return 1;
         }
-        free(disk_data);
     }
-}
 
-BootEntry *getBootEntry(const char *disk_path){
-    BootEntry *boot_entry = (BootEntry *)malloc(sizeof(BootEntry));
-    if (boot_entry == NULL) {
-        perror("Failed to allocate memory for BootEntry.\n");
-        return NULL;
+    int status = 0, applied = 1;
+    uint64_t span = statBegin();
+    if(cmd->i_flag){
+        // Milestone 2: Print the file system information.
+        status = printFSInfo(vol, report);
+    }else if(cmd->l_flag){
+        // Milestone 3: list the root directory.
+        status = cmd->recursive ? listVolume(vol, report) : listRootDir(vol, report);
+    }else if(cmd->c_flag){
+        // Check that every FAT copy agrees with the active one
+        status = checkFats(vol, report);
+    }else if(cmd->r_flag && cmd->verify){
+        // Check a candidate's SHA-1 without recovering it
+        status = verifyFile(vol, cmd->filename, cmd->sha1, report);
+    }else if(cmd->r_flag && cmd->rank){
+        // Rank the deleted files a name may refer to without recovering any
+        status = rankFile(vol, cmd->filename, report);
+    }else if(cmd->r_flag && !cmd->s_flag){
+        // Recover a contiguous file without shal
+        status = recoverFile(vol, cmd->filename, report);
+    }else if(cmd->r_flag && cmd->s_flag){
+        // Recover a contiguous file shal
+        status = recoverFileWithSha1(vol, cmd->filename, cmd->sha1, report);
+    }else if(cmd->b_flag){
+        // Recover every file listed in the manifest in one directory pass
+        status = recoverBatch(vol, cmd->manifest, report);
+    }else if(cmd->R_flag && cmd->s_flag){
+        // Recover a possibly non-contiguous file.
+        status = recoverNonContiguous(vol, cmd->filename, cmd->sha1, cmd->budget, report);
+    }else if(cmd->R_flag){
+        // Reassemble a fragmented file by how well its clusters fit together
+        status = reconstructFile(vol, cmd->filename, cmd->time_budget ? cmd->time_budget : RECONSTRUCT_DEFAULT_SECONDS, report);
+    }else if(cmd->carve_dir){
+        // Carve files by signature out of the free clusters
+        status = carveVolume(vol, cmd->carve_dir, report);
+    }else if(cmd->hashset_path){
+        // Recover every deleted file whose SHA-1 is in the list, whatever its name
+        status = recoverHashSet(vol, cmd->hashset_path, report);
     }
-    DiskData *diskData = getDiskData(disk_path);
-    if(diskData == NULL){
-        return NULL;
+    statEnd(SPAN_COMMAND, span);
+
+    // Commands only plan their edits; write them all at once, or just show
+    // them. With -o the files were copied out and the plan is dropped.
+    span = statBegin();
+    if(status == 0 && cmd->dry_run){
+        printChanges(vol, out);
+    }else if(status == 0 && !cmd->out_dir && applyChanges(vol) != 0){
+        status = 1;
+        applied = 0;
     }
-    memcpy(boot_entry, diskData->data, sizeof(BootEntry)); // Copy data into boot_entry
-    freeDiskData(diskData);
-    return boot_entry;
+    statEnd(SPAN_APPLY, span);
+    if(writes){
+        fclose(report);
+        // Nothing the command reported happened when its edits failed
+        if(applied){
+            fwrite(held, 1, held_size, out);
+        }
+        free(held);
+    }
+    return status;
 }
 
-int printFSInfo(char **argv){
-    BootEntry *bs = getBootEntry(argv[1]);
-    if(bs != NULL){
-        printf("Number of FATs = %d\n", bs->BPB_NumFATs);
-        printf("Number of bytes per sector = %d\n", bs->BPB_BytsPerSec);
-        printf("Number of sectors per cluster = %d\n", bs->BPB_SecPerClus);
-        printf("Number of reserved sectors = %d\n", bs->BPB_RsvdSecCnt);
-        free(bs);  
+int validate_usage(int argc, char **argv){
+    if(argc < 2){
+        printUsage(stdout);
+        return 1;
     }
-    return 0;
-}
 
-int listRootDir(char **argv){
-    BootEntry *bs = getBootEntry(argv[1]);
-    if(bs == NULL){
+    if (access(argv[1], F_OK) == -1) {
+        printUsage(stdout);
         return 1;
     }
-    unsigned int first_data_sector = bs->BPB_RsvdSecCnt + (bs->BPB_NumFATs * bs->BPB_FATSz32);
-    unsigned int first_root_dir_cluster = bs->BPB_RootClus;
-    unsigned int root_dir_size = bs->BPB_BytsPerSec * bs->BPB_SecPerClus;
 
-    DiskData *diskData = getDiskData(argv[1]);
-    if(diskData == NULL){
-        free(bs);
+    // The options follow the disk, which takes the place of argv[0]
+    CommandLine cmd;
+    if(parseCommandLine(argc - 1, argv + 1, &cmd) != 0){
+        printUsage(stdout);
         return 1;
     }
+    if(!hasCommand(&cmd) && !cmd.serve_path && !cmd.watch_interval){
+        return 0;
+    }
+
+    // Open the image once; every command below shares this mapping
+    startStats(cmd.stats);
+    uint64_t span = statBegin();
+    Volume *vol = openVolume(argv[1], &cmd.io_config);
+    statEnd(SPAN_OPEN, span);
+    if(vol == NULL){
+        return 1;
+    }
+    vol->extract_dir = cmd.out_dir;
+
+    // Reuse the index, free map and digests of an earlier run when the
+    // sidecar cache still matches the image
+    char *default_cache_path = NULL;
+    if(cmd.use_cache && cmd.cache_path == NULL){
+        default_cache_path = malloc(strlen(argv[1]) + sizeof(CACHE_SUFFIX));
+        if(default_cache_path == NULL){
+            perror("Error allocating memory");
+            closeVolume(vol);
+            return 1;
+        }
+        sprintf(default_cache_path, "%s%s", argv[1], CACHE_SUFFIX);
+        cmd.cache_path = default_cache_path;
+    }
+    if(cmd.use_cache){
+        span = statBegin();
+        loadScanCache(vol, cmd.cache_path);
+        statEnd(SPAN_CACHE_LOAD, span);
+    }
 
-    int entry_count = 0;
-    // Follow the cluster chain in the FAT
-    unsigned int current_cluster = first_root_dir_cluster;
-    while (current_cluster < 0x0FFFFFF7) {
-        unsigned int first_sector = first_data_sector + ((current_cluster - 2) * bs->BPB_SecPerClus);
-        unsigned char *dir_data = diskData->data + (first_sector * bs->BPB_BytsPerSec);
-        
-        for(unsigned int i = 0; i< root_dir_size; i+= sizeof(DirEntry)){
-            DirEntry *dirEntry = (DirEntry *)(dir_data + i);
+    int status;
+    if(cmd.serve_path){
+        // Answer commands over the socket until told to stop
+        status = serveVolume(vol, cmd.serve_path);
+    }else if(cmd.watch_interval){
+        // Report deletions as they happen until told to stop
+        status = watchVolume(vol, cmd.watch_interval, stdout);
+    }else{
+        status = runCommand(vol, &cmd, stdout);
+    }
 
-            // skip deleted directory
-            if(dirEntry->DIR_Name[0] == 0x00 || dirEntry->DIR_Name[0] == 0xE5){
-                continue;
-            }
-            // skep LFN
-            if(dirEntry->DIR_Attr == 0x0F){
-                continue;
+    // A dry run or -o leaves the index ahead of the image, and a watched
+    // image has moved on since it was indexed, so neither is cached
+    if(cmd.use_cache && status == 0 && !cmd.dry_run && !cmd.out_dir && !cmd.watch_interval){
+        span = statBegin();
+        saveScanCache(vol, cmd.cache_path);
+        statEnd(SPAN_CACHE_SAVE, span);
+    }
+    free(default_cache_path);
+    closeVolume(vol);
+    // Stats go to stderr so the command output stays as it is
+    fflush(stdout);
+    printStats(stderr);
+    return status;
+}
+
+int printFSInfo(Volume *vol, FILE *out){
+    const BootEntry *bs = &vol->bs;
+    fprintf(out, "Number of FATs = %d\n", bs->BPB_NumFATs);
+    fprintf(out, "Number of bytes per sector = %d\n", bs->BPB_BytsPerSec);
+    fprintf(out, "Number of sectors per cluster = %d\n", bs->BPB_SecPerClus);
+    fprintf(out, "Number of reserved sectors = %d\n", bs->BPB_RsvdSecCnt);
+    return 0;
+}
+
+// Print one live entry of the directory index the way -l always has. With
+// paths, entries are shown by their long name when they have one.
+static void printListedSlot(const DirIndex *index, long slot, int with_paths, FILE *out){
+    const char *name = index->names[slot];
+    if(with_paths){
+        fprintf(out, "%s/", index->paths + index->dir_path[slot]);
+        if(dirIndexLongName(index, slot)){
+            fprintf(out, "%s%s (", dirIndexLongName(index, slot), index->attr[slot] == 0x10 ? "/" : "");
+            if(index->attr[slot] != 0x10){
+                fprintf(out, "size = %u%s", index->size[slot], index->size[slot] != 0 ? ", " : "");
             }
-            // print the 8.3 filename
-            for(int j = 0; j< 8; j++){
-                if(dirEntry->DIR_Name[j] != ' '){
-                    printf("%c",dirEntry->DIR_Name[j]);
-                }
+            if(index->attr[slot] == 0x10 || index->size[slot] != 0){
+                fprintf(out, "starting cluster = %u", index->first_cluster[slot]);
             }
+            fprintf(out, ")\n");
+            return;
+        }
+    }
 
-            //if the entry is a directory, you should append a / indicator.
-            if(dirEntry->DIR_Attr == 0x10){
-                // Directory entry
-                printf("/ (starting cluster = %u)\n", dirEntry->DIR_FstClusLO);
-            }else{
-                // Non Empty Entry
-                    for(int k = 8; k< 11; k++){
-                        if(dirEntry->DIR_Name[k] != ' '){
-                            if(k == 8){
-                                printf(".");
-                            }
-                            printf("%c",dirEntry->DIR_Name[k]);
-                        }
-                    }
-                // File entry
-                printf(" (size = %u", dirEntry->DIR_FileSize);
-                if (dirEntry->DIR_FileSize != 0) {
-                    printf(", starting cluster = %u", dirEntry->DIR_FstClusLO);
-                }
-                printf(")\n");
-            }
-            entry_count++;
+    //if the entry is a directory, you should append a / indicator.
+    if(index->attr[slot] == 0x10){
+        // Directory entry: the listing shows only the name part
+        fprintf(out, "%.*s/ (starting cluster = %u)\n", (int)strcspn(name, "."), name, index->first_cluster[slot]);
+    }else{
+        // File entry
+        fprintf(out, "%s (size = %u", name, index->size[slot]);
+        if (index->size[slot] != 0) {
+            fprintf(out, ", starting cluster = %u", index->first_cluster[slot]);
         }
-        // Find the next cluster in the FAT
-        unsigned int fat_offset = bs->BPB_RsvdSecCnt * bs->BPB_BytsPerSec + current_cluster * 4;
-        current_cluster = *((unsigned int *)(diskData->data + fat_offset)) & 0x0FFFFFFF;
-    }
-    printf("Total number of entries = %u\n", entry_count);
-    // Clean up
-    freeDiskData(diskData);
-    free(bs);
-    return 0;
+        fprintf(out, ")\n");
+    }
 }
 
-int recoverFile(const char *disk_path, char *filename){
-    BootEntry *bs = getBootEntry(disk_path);
-    if(bs == NULL){
+// List the live entries of the directory index, either those of the root
+// directory or, with paths, every one in walk order
+static int listIndexed(Volume *vol, int recursive, FILE *out){
+    const DirIndex *index = recursive ? getDirIndex(vol) : getDirIndexFor(vol, vol->bs.BPB_RootClus, "");
+    if(index == NULL){
         return 1;
     }
-    unsigned int first_data_sector = bs->BPB_RsvdSecCnt + (bs->BPB_NumFATs * bs->BPB_FATSz32);
-    unsigned int first_root_dir_cluster = bs->BPB_RootClus;
-    unsigned int root_dir_size = bs->BPB_BytsPerSec * bs->BPB_SecPerClus;
-
-    DiskData *diskData = getDiskData(disk_path);
-    if(diskData == NULL){
-        free(bs);
-        return 1;
+    unsigned int entry_count = 0;
+    for(size_t slot = 0; slot < index->count; slot++){
+        // skip deleted entries
+        if((unsigned char)index->names[slot][0] == 0xE5){
+            continue;
+        }
+        if(!recursive && index->parent[slot] != vol->bs.BPB_RootClus){
+            continue;
+        }
+        printListedSlot(index, (long)slot, recursive, out);
+        entry_count++;
     }
+    fprintf(out, "Total number of entries = %u\n", entry_count);
+    return 0;
+}
 
-    int fileDeleted = 0;
-    DirEntry *newDirEntry = NULL;
-
-    // Follow the cluster chain in the FAT
-    unsigned int current_cluster = first_root_dir_cluster;
-    while (current_cluster < 0x0FFFFFF7) {
-        unsigned int first_sector = first_data_sector + ((current_cluster - 2) * bs->BPB_SecPerClus);
-        unsigned char *dir_data = diskData->data + (first_sector * bs->BPB_BytsPerSec);
-        
-        for(unsigned int i = 0; i< root_dir_size; i+= sizeof(DirEntry)){
-            DirEntry *dirEntry = (DirEntry *)(dir_data + i);
-
-            // skip current directory
-            if(dirEntry->DIR_Name[0] == 0x00){
-                continue;
-            }
-            // skip LFN
-            if(dirEntry->DIR_Attr == 0x0F){
-                continue;
-            }
+int listRootDir(Volume *vol, FILE *out){
+    return listIndexed(vol, 0, out);
+}
 
-            // skip direcotry files
-            if(dirEntry->DIR_Attr == 0x10){
-                continue;
-            }
+// List every directory reachable from the root, one full path per line
+int listVolume(Volume *vol, FILE *out){
+    return listIndexed(vol, 1, out);
+}
 
-            char matchFilename[12];
-            int nameEnd = 0;
-            // Copy the filename part
-            for(int j = 0; j< 8; j++){
-                if(dirEntry->DIR_Name[j] != ' '){
-                    matchFilename[nameEnd++] = dirEntry->DIR_Name[j];
-                }
-            }
+// Restore a deleted entry: put back the first character of its name and
+// rebuild a contiguous cluster chain covering its size in every FAT, or,
+// with -o, copy the file out instead. The range must already have been
+// checked with contiguousRangeFree(). Returns -1 when extraction fails.
+int restoreContiguousFile(Volume *vol, long slot, char first_char){
+    DirIndex *index = vol->dir_index;
+    dirIndexRestoreName(vol, slot, first_char);
+    unsigned int starting_cluster = index->first_cluster[slot];
+    unsigned int num_clusters = clustersForSize(vol, index->size[slot]);
+    for (unsigned int i = 0; i < num_clusters && !vol->extract_dir; i++) {
+        unsigned int current_cluster = starting_cluster + i;
+        // Mark the final cluster in the chain as end-of-file
+        setFatEntry(vol, current_cluster, i < num_clusters - 1 ? current_cluster + 1 : FAT_EOC);
+    }
+    // Extraction claims the clusters too, so -o recovers the same files
+    if(vol->free_map && num_clusters > 0){
+        markClustersUsed(vol->free_map, starting_cluster, num_clusters);
+    }
+    if(vol->extract_dir){
+        ClusterRun run = { starting_cluster, num_clusters };
+        return extractFile(vol, slot, &run, 1);
+    }
+    return 0;
+}
 
-            // Copy the extension part
-            for(int k = 8; k < 11; k++) {
-                if(dirEntry->DIR_Name[k] != ' '){
-                    if(k == 8){
-                        // Add the '.' character
-                        matchFilename[nameEnd++] = '.';
-                    }
-                    matchFilename[nameEnd++] = dirEntry->DIR_Name[k];
-                }
-            }
-            matchFilename[nameEnd] = '\0';
+// A deleted file can only be restored contiguously if every cluster of its
+// range lies in the data region and is still free in the active FAT.
+// Rewriting a cluster some other file owns would cross-link the two.
+int contiguousRangeFree(Volume *vol, long slot){
+    const DirIndex *index = vol->dir_index;
+    if(index->size[slot] == 0){
+        return 1;
+    }
+    const FreeMap *map = getFreeMap(vol);
+    if(map == NULL){
+        return 0;
+    }
+    unsigned int num_clusters = clustersForSize(vol, index->size[slot]);
+    return isRangeFree(map, index->first_cluster[slot], num_clusters);
+}
 
-            if(dirEntry->DIR_Name[0] == 0xE5 && strcmp(matchFilename + 1, filename +1) == 0){
-                fileDeleted++;
-                newDirEntry = dirEntry;
-            }
+int recoverFile(Volume *vol, char *filename, FILE *out){
+    unsigned int dir_cluster;
+    const char *name;
+    if(dirIndexResolvePath(vol, filename, &dir_cluster, &name) != 0){
+        fprintf(out, "%s: file not found\n", filename);
+        return 0;
+    }
+
+    int fileDeleted = 0;
+    long match_slot = DIR_INDEX_NONE;
+
+    // Every entry the name may refer to, in on-disk order
+    const DirIndex *index = vol->dir_index;
+    DirIndexMatch match;
+    for(long slot = dirIndexFirstMatch(&match, index, dir_cluster, name); slot != DIR_INDEX_NONE; slot = dirIndexNextMatch(&match)){
+        if(dirIndexIsDeletedFile(index, slot)){
+            fileDeleted++;
+            match_slot = slot;
         }
-        // Find the next cluster in the FAT
-        unsigned int fat_offset = bs->BPB_RsvdSecCnt * bs->BPB_BytsPerSec + current_cluster * 4;
-        current_cluster = *((unsigned int *)(diskData->data + fat_offset)) & 0x0FFFFFFF;
     }
 
+    statAdd(STAT_CANDIDATES, fileDeleted);
     if(fileDeleted == 0){
-        printf("%s: file not found\n", filename);
+        fprintf(out, "%s: file not found\n", filename);
     }else if(fileDeleted > 1){
-        printf("%s: multiple candidates found\n", filename);
+        fprintf(out, "%s: multiple candidates found\n", filename);
+    }else if(!contiguousRangeFree(vol, match_slot)){
+        fprintf(out, "%s: file not found\n", filename);
     }else{
-        newDirEntry->DIR_Name[0] = filename[0];
-        if(newDirEntry->DIR_FileSize != 0){
-            unsigned int starting_cluster = newDirEntry->DIR_FstClusLO;
-            unsigned int current_cluster = starting_cluster;
-            unsigned int next_cluster = 0;
-            unsigned int end_of_file = 0x0FFFFFFF;
-
-            // bs->BPB_BytsPerSec - 1 to ensure we got the near whole integer
-            unsigned int num_clusters = (newDirEntry->DIR_FileSize + bs->BPB_BytsPerSec * bs->BPB_SecPerClus - 1) / (bs->BPB_BytsPerSec * bs->BPB_SecPerClus);
-            for (unsigned int fat_num = 0; fat_num < bs->BPB_NumFATs; fat_num++) {
-                // Traverse the chain of clusters in the FAT
-                for (unsigned int i = 0; i < num_clusters; i++) {
-                    // Get the offset of the current cluster in the FAT
-                    unsigned int fat_offset = (bs->BPB_RsvdSecCnt + fat_num * bs->BPB_FATSz32) * bs->BPB_BytsPerSec + current_cluster * 4;
-
-                    // Update the FAT entry to point to the next cluster in the chain
-                    if (i < num_clusters - 1) {
-                        next_cluster = current_cluster + 1;
-                        memcpy(diskData->data + fat_offset, &next_cluster, sizeof(next_cluster));
-                    }
-                    // Mark the final cluster in the chain as end-of-file
-                    else {
-                        memcpy(diskData->data + fat_offset, &end_of_file, sizeof(end_of_file));
-                    }
-
-                    // Update the current cluster to the next cluster
-                    current_cluster = next_cluster;
-                }
-                // Reset the current cluster to the starting cluster for the next FAT
-                current_cluster = starting_cluster;
-            }
+        if(restoreContiguousFile(vol, match_slot, dirIndexRestoredFirstChar(index, match_slot, name)) != 0){
+            return 1;
         }
-        printf("%s: successfully recovered\n", filename);
+        fprintf(out, "%s: successfully recovered\n", filename);
     }
-
-    // Clean up
-    freeDiskData(diskData);
-    free(bs);
     return 0;
 }
 
-int recoverFileWithSha1(const char *disk_path, char *filename, char *sha1){
-    BootEntry *bs = getBootEntry(disk_path);
-    if(bs == NULL){
-        return 1;
-    }
-    unsigned int first_data_sector = bs->BPB_RsvdSecCnt + (bs->BPB_NumFATs * bs->BPB_FATSz32);
-    unsigned int first_root_dir_cluster = bs->BPB_RootClus;
-    unsigned int root_dir_size = bs->BPB_BytsPerSec * bs->BPB_SecPerClus;
-
-    DiskData *diskData = getDiskData(disk_path);
-    if(diskData == NULL){
-        free(bs);
-        return 1;
+int recoverFileWithSha1(Volume *vol, char *filename, char *sha1, FILE *out){
+    unsigned int dir_cluster;
+    const char *name;
+    if(dirIndexResolvePath(vol, filename, &dir_cluster, &name) != 0){
+        fprintf(out, "%s: file not found\n", filename);
+        return 0;
     }
 
     int fileDeleted = 0;
-    DirEntry *newDirEntry = NULL;
+    long match_slot = DIR_INDEX_NONE;
     unsigned char sha1_byte_array[SHA_DIGEST_LENGTH];
     hex_string_to_byte_array(sha1, sha1_byte_array, SHA_DIGEST_LENGTH);
 
-
-    // Follow the cluster chain in the FAT
-    unsigned int current_cluster = first_root_dir_cluster;
-    while (current_cluster < 0x0FFFFFF7) {
-        unsigned int first_sector = first_data_sector + ((current_cluster - 2) * bs->BPB_SecPerClus);
-        unsigned char *dir_data = diskData->data + (first_sector * bs->BPB_BytsPerSec);
-        
-        for(unsigned int i = 0; i< root_dir_size; i+= sizeof(DirEntry)){
-            DirEntry *dirEntry = (DirEntry *)(dir_data + i);
-
-            // skip current directory
-            if(dirEntry->DIR_Name[0] == 0x00){
-                continue;
-            }
-            // skip LFN
-            if(dirEntry->DIR_Attr == 0x0F){
-                continue;
-            }
-
-            // skip direcotry files
-            if(dirEntry->DIR_Attr == 0x10){
-                continue;
-            }
-
-            char matchFilename[12];
-            int nameEnd = 0;
-            // Copy the filename part
-            for(int j = 0; j< 8; j++){
-                if(dirEntry->DIR_Name[j] != ' '){
-                    matchFilename[nameEnd++] = dirEntry->DIR_Name[j];
-                }
+    // Collect the deleted entries whose name matches before hashing anything
+    const DirIndex *index = vol->dir_index;
+    long *slots = NULL;
+    size_t candidate_count = 0, candidate_cap = 0;
+    DirIndexMatch match;
+    for(long slot = dirIndexFirstMatch(&match, index, dir_cluster, name); slot != DIR_INDEX_NONE; slot = dirIndexNextMatch(&match)){
+        // only deleted files can be recovered
+        if(!dirIndexIsDeletedFile(index, slot) || !contiguousRangeFree(vol, slot)){
+            continue;
+        }
+        if(candidate_count == candidate_cap){
+            candidate_cap = candidate_cap ? candidate_cap * 2 : 8;
+            long *grown = realloc(slots, candidate_cap * sizeof(long));
+            if(grown == NULL){
+                perror("Error allocating memory");
+                free(slots);
+                return 1;
             }
+            slots = grown;
+        }
+        slots[candidate_count++] = slot;
+    }
 
-            // Copy the extension part
-            for(int k = 8; k < 11; k++) {
-                if(dirEntry->DIR_Name[k] != ' '){
-                    if(k == 8){
-                        // Add the '.' character
-                        matchFilename[nameEnd++] = '.';
-                    }
-                    matchFilename[nameEnd++] = dirEntry->DIR_Name[k];
-                }
-            }
-            matchFilename[nameEnd] = '\0';
-
-            if(dirEntry->DIR_Name[0] == 0xE5){
-                if(dirEntry->DIR_FileSize != 0){
-                    unsigned int starting_cluster = dirEntry->DIR_FstClusLO;
-                    unsigned int dir_offset = (first_data_sector + (starting_cluster - 2) * bs->BPB_SecPerClus) * bs->BPB_BytsPerSec;
-                    unsigned char* file_content = (unsigned char*) malloc(dirEntry->DIR_FileSize * sizeof(unsigned char));
-
-                    // Read the entire file content with a single memcpy call
-                    memcpy(file_content, diskData->data + dir_offset, dirEntry->DIR_FileSize);
-                    unsigned char computed_hash[SHA_DIGEST_LENGTH];
-                    SHA1(file_content, dirEntry->DIR_FileSize, computed_hash);
-                    if(strcmp(matchFilename + 1, filename +1) == 0 && memcmp(computed_hash, sha1_byte_array, SHA_DIGEST_LENGTH) == 0){
-                        fileDeleted++;
-                        newDirEntry = dirEntry;
-                    }
-                    free(file_content);
-                }else if(strcmp(matchFilename + 1, filename +1) == 0 && strcmp(sha1, EMPTY_SHA1) == 0){
-                    fileDeleted++;
-                    newDirEntry = dirEntry;
-                }
-            }
+    unsigned char (*computed_hashes)[SHA_DIGEST_LENGTH] = malloc((candidate_count ? candidate_count : 1) * SHA_DIGEST_LENGTH);
+    if(computed_hashes == NULL || hashIndexedEntries(vol, slots, candidate_count, computed_hashes) != 0){
+        free(computed_hashes);
+        free(slots);
+        return 1;
+    }
 
+    // Merge in directory order so the last matching entry still wins
+    for(size_t n = 0; n < candidate_count; n++){
+        int matched;
+        if(index->size[slots[n]] != 0){
+            matched = memcmp(computed_hashes[n], sha1_byte_array, SHA_DIGEST_LENGTH) == 0;
+        }else{
+            matched = strcmp(sha1, EMPTY_SHA1) == 0;
+        }
+        if(matched){
+            fileDeleted++;
+            match_slot = slots[n];
         }
-        // Find the next cluster in the FAT
-        unsigned int fat_offset = bs->BPB_RsvdSecCnt * bs->BPB_BytsPerSec + current_cluster * 4;
-        current_cluster = *((unsigned int *)(diskData->data + fat_offset)) & 0x0FFFFFFF;
     }
+    free(computed_hashes);
+    free(slots);
 
     if(fileDeleted == 0){
-        printf("%s: file not found\n", filename);
+        fprintf(out, "%s: file not found\n", filename);
     }else{
-        newDirEntry->DIR_Name[0] = filename[0];
-        if(newDirEntry->DIR_FileSize != 0){
-            unsigned int starting_cluster = newDirEntry->DIR_FstClusLO;
-            unsigned int current_cluster = starting_cluster;
-            unsigned int next_cluster = 0;
-            unsigned int end_of_file = 0x0FFFFFFF;
-
-            // bs->BPB_BytsPerSec - 1 to ensure we got the near whole integer
-            unsigned int num_clusters = (newDirEntry->DIR_FileSize + bs->BPB_BytsPerSec * bs->BPB_SecPerClus - 1) / (bs->BPB_BytsPerSec * bs->BPB_SecPerClus);
-            for (unsigned int fat_num = 0; fat_num < bs->BPB_NumFATs; fat_num++) {
-                // Traverse the chain of clusters in the FAT
-                for (unsigned int i = 0; i < num_clusters; i++) {
-                    // Get the offset of the current cluster in the FAT
-                    unsigned int fat_offset = (bs->BPB_RsvdSecCnt + fat_num * bs->BPB_FATSz32) * bs->BPB_BytsPerSec + current_cluster * 4;
-
-                    // Update the FAT entry to point to the next cluster in the chain
-                    if (i < num_clusters - 1) {
-                        next_cluster = current_cluster + 1;
-                        memcpy(diskData->data + fat_offset, &next_cluster, sizeof(next_cluster));
-                    }
-                    // Mark the final cluster in the chain as end-of-file
-                    else {
-                        memcpy(diskData->data + fat_offset, &end_of_file, sizeof(end_of_file));
-                    }
-
-                    // Update the current cluster to the next cluster
-                    current_cluster = next_cluster;
-                }
-                // Reset the current cluster to the starting cluster for the next FAT
-                current_cluster = starting_cluster;
-            }
+        if(restoreContiguousFile(vol, match_slot, dirIndexRestoredFirstChar(index, match_slot, name)) != 0){
+            return 1;
         }
-        printf("%s: successfully recovered with SHA-1\n", filename);
+        fprintf(out, "%s: successfully recovered with SHA-1\n", filename);
     }
+    return 0;
+}
 
-    // Clean up
-    freeDiskData(diskData);
-    free(bs);
+// Report whether a deleted file that -r -s would recover has the given
+// SHA-1, without recovering it. Only reads the volume: digests already in
+// the index are used, the rest are hashed but not kept.
+int verifyFile(Volume *vol, char *filename, char *sha1, FILE *out){
+    unsigned int dir_cluster;
+    const char *name;
+    if(dirIndexResolvePath(vol, filename, &dir_cluster, &name) != 0){
+        fprintf(out, "%s: file not found\n", filename);
+        return 0;
+    }
+
+    unsigned char sha1_byte_array[SHA_DIGEST_LENGTH];
+    hex_string_to_byte_array(sha1, sha1_byte_array, SHA_DIGEST_LENGTH);
+
+    const DirIndex *index = vol->dir_index;
+    int matched = 0;
+    DirIndexMatch match;
+    for(long slot = dirIndexFirstMatch(&match, index, dir_cluster, name); slot != DIR_INDEX_NONE && !matched; slot = dirIndexNextMatch(&match)){
+        if(!dirIndexIsDeletedFile(index, slot) || !contiguousRangeFree(vol, slot)){
+            continue;
+        }
+        statAdd(STAT_CANDIDATES, 1);
+        if(index->size[slot] == 0){
+            matched = strcmp(sha1, EMPTY_SHA1) == 0;
+            continue;
+        }
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        if(index->has_digest[slot]){
+            memcpy(digest, index->digests[slot], SHA_DIGEST_LENGTH);
+        }else if(hashContiguous(vol, index->first_cluster[slot], index->size[slot], digest) != 0){
+            fprintf(stderr, "Error hashing candidate files\n");
+            return 1;
+        }
+        matched = memcmp(digest, sha1_byte_array, SHA_DIGEST_LENGTH) == 0;
+    }
+
+    if(matched){
+        fprintf(out, "%s: matches SHA-1\n", filename);
+    }else{
+        fprintf(out, "%s: file not found\n", filename);
+    }
     return 0;
 }
 
 void hex_string_to_byte_array(const char *hex_string, unsigned char *byte_array, size_t length) {
     for (size_t i = 0; i < length; i++) {
-        sscanf(hex_string + 2 * i, "%02x", (unsigned int *)&byte_array[i]);
+        unsigned int byte = 0;
+        sscanf(hex_string + 2 * i, "%02x", &byte);
+        byte_array[i] = (unsigned char)byte;
     }
 }
-
@@ -1,12 +1,54 @@
 #ifndef _RECOVER_H_
 #define _RECOVER_H_
 
+#include <stdio.h>
+
+#include "volume.h"
+#include "diskio.h"
+#include "stats.h"
+
+#define SHA_DIGEST_LENGTH 20
+#define EMPTY_SHA1 "da39a3ee5e6b4b0d3255bfef95601890afd80709"
+
+// The options of one invocation, from the command line or a --serve client
+typedef struct {
+    int i_flag, l_flag, c_flag, r_flag, R_flag, s_flag, b_flag;
+    char *filename;
+    char *sha1;
+    char *manifest;
+    char *carve_dir;
+    char *hashset_path;
+    char *out_dir;              // -o: copy recovered files here, leave the image alone
+    unsigned int budget;
+    unsigned int time_budget;       // --time-budget: seconds -R without -s spends scoring
+    int recursive;
+    int verify;
+    int rank;
+    int dry_run;
+    int use_cache;
+    char *cache_path;
+    char *serve_path;
+    unsigned int watch_interval;    // --watch: seconds between passes, 0 when not watching
+    StatsFormat stats;
+    DiskIoConfig io_config;
+    int process_options;        // set by options about the process rather than a command
+} CommandLine;
+
 int recover(int argc, char **argv);
 int validate_usage(int argc, char **argv);
-int printFSInfo(char **argv);
-int listRootDir(char **argv);
-int recoverFile(const char *disk_path, char *filename);
-int recoverFileWithSha1(const char *disk_path, char *filename, char *sha1);
+void printUsage(FILE *out);
+int parseCommandLine(int argc, char **argv, CommandLine *cmd);
+int hasCommand(const CommandLine *cmd);
+int isReadOnlyCommand(const CommandLine *cmd);
+int runCommand(Volume *vol, const CommandLine *cmd, FILE *out);
+int printFSInfo(Volume *vol, FILE *out);
+int listRootDir(Volume *vol, FILE *out);
+int listVolume(Volume *vol, FILE *out);
+int recoverFile(Volume *vol, char *filename, FILE *out);
+int recoverFileWithSha1(Volume *vol, char *filename, char *sha1, FILE *out);
+int verifyFile(Volume *vol, char *filename, char *sha1, FILE *out);
+int restoreContiguousFile(Volume *vol, long slot, char first_char);
+int contiguousRangeFree(Volume *vol, long slot);
 void hex_string_to_byte_array(const char *hex_string, unsigned char *byte_array, size_t length);
 
 #endif
@@ -0,0 +1,321 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/evp.h>
+
+#include "search.h"
+#include "recover.h"
+#include "freemap.h"
+#include "dirindex.h"
+#include "window.h"
+#include "extract.h"
+#include "stats.h"
+
+typedef struct {
+    const Volume *vol;
+    const unsigned char *target;
+    unsigned int num_clusters;
+    unsigned int last_bytes;        // bytes used in the final cluster
+    const FreeMap *map;
+    unsigned int *pool;             // candidate clusters
+    unsigned int pool_size;
+    unsigned int ahead;             // pool[0..ahead) follow the first cluster, the rest precede it
+    unsigned char *used;            // per pool slot
+    unsigned int jumps_left;        // discontinuities still allowed
+    unsigned long steps;            // clusters hashed so far
+    unsigned int *chain;            // chain[0] is the entry's first cluster
+    EVP_MD_CTX **prefix;            // prefix[d] has hashed chain[0..d]
+} ChainSearch;
+
+static int searchFrom(ChainSearch *search, unsigned int depth);
+
+// Hash one more cluster on top of the prefix state for depth - 1, then
+// either compare the digest or keep extending the chain.
+static int tryCluster(ChainSearch *search, unsigned int depth, unsigned int cluster){
+    const Volume *vol = search->vol;
+    unsigned int bytes = depth == search->num_clusters - 1 ? search->last_bytes : vol->cluster_size;
+    EVP_MD_CTX *ctx = search->prefix[depth];
+    if(++search->steps > MAX_SEARCH_STEPS){
+        return -2;
+    }
+    if(depth > 0 && EVP_MD_CTX_copy_ex(ctx, search->prefix[depth - 1]) != 1){
+        return -1;
+    }
+    VolumeView view;
+    const unsigned char *data = viewClusters(vol, cluster, 1, &view);
+    if(data == NULL){
+        return -1;
+    }
+    int updated = EVP_DigestUpdate(ctx, data, bytes);
+    releaseView(vol, &view);
+    statAdd(STAT_CHAIN_STEPS, 1);
+    statAdd(STAT_CLUSTERS_VISITED, 1);
+    statAdd(STAT_BYTES_HASHED, bytes);
+    if(updated != 1){
+        return -1;
+    }
+    search->chain[depth] = cluster;
+    if(depth == search->num_clusters - 1){
+        // Finalize a copy so the prefix state stays reusable
+        EVP_MD_CTX *final = EVP_MD_CTX_new();
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        int status = final && EVP_MD_CTX_copy_ex(final, ctx) == 1 && EVP_DigestFinal_ex(final, digest, NULL) == 1 ? 0 : -1;
+        EVP_MD_CTX_free(final);
+        if(status != 0){
+            return -1;
+        }
+        return memcmp(digest, search->target, SHA_DIGEST_LENGTH) == 0;
+    }
+    return searchFrom(search, depth + 1);
+}
+
+static int trySlot(ChainSearch *search, unsigned int depth, unsigned int slot){
+    search->used[slot] = 1;
+    int found = tryCluster(search, depth, search->pool[slot]);
+    search->used[slot] = 0;
+    return found;
+}
+
+// Pool slot holding cluster, or -1. Both parts of the pool are ascending.
+static int poolSlot(const ChainSearch *search, unsigned int cluster){
+    int after = cluster > search->chain[0];
+    unsigned int low = after ? 0 : search->ahead;
+    unsigned int end = after ? search->ahead : search->pool_size;
+    unsigned int high = end;
+    while(low < high){
+        unsigned int mid = low + (high - low) / 2;
+        if(search->pool[mid] < cluster){
+            low = mid + 1;
+        }else{
+            high = mid;
+        }
+    }
+    return low < end && search->pool[low] == cluster ? (int)low : -1;
+}
+
+// Depth-first search over orderings of the candidate pool. Continuing with
+// the cluster right after the previous one is free; any other choice spends
+// one jump, so with a small jump allowance only layouts made of a few
+// contiguous fragments are explored.
+static int searchFrom(ChainSearch *search, unsigned int depth){
+    int next_slot = poolSlot(search, search->chain[depth - 1] + 1);
+    if(next_slot >= 0 && !search->used[next_slot]){
+        int found = trySlot(search, depth, (unsigned int)next_slot);
+        if(found != 0){
+            return found;
+        }
+    }
+    if(search->jumps_left == 0){
+        return 0;
+    }
+    search->jumps_left--;
+    int found = 0;
+    for(unsigned int slot = 0; found == 0 && slot < search->pool_size; slot++){
+        if((int)slot == next_slot || search->used[slot]){
+            continue;
+        }
+        found = trySlot(search, depth, slot);
+    }
+    search->jumps_left++;
+    return found;
+}
+
+// The budget free clusters nearest the first cluster, where the rest of a
+// fragmented file most likely lies, taken from the free runs. Up to a
+// quarter come before it, since a file written into a gap can go on in an
+// earlier one; either side makes up what the other lacks.
+static int buildPool(ChainSearch *search, unsigned int first_cluster, unsigned int budget){
+    const FreeMap *map = search->map;
+    unsigned int *before = malloc(budget * sizeof(unsigned int));   // nearest first
+    if(before == NULL){
+        return -1;
+    }
+    // Restores leave the run list behind the bitmap
+    unsigned int after_count = 0;
+    for(size_t r = 0; after_count < budget && r < map->run_count; r++){
+        unsigned int start = map->runs[r].start > first_cluster ? map->runs[r].start : first_cluster + 1;
+        unsigned int end = map->runs[r].start + map->runs[r].length;
+        for(unsigned int cluster = start; after_count < budget && cluster < end; cluster++){
+            if(isClusterFree(map, cluster)){
+                search->pool[after_count++] = cluster;
+            }
+        }
+    }
+    unsigned int before_count = 0;
+    for(size_t r = map->run_count; before_count < budget && r-- > 0;){
+        if(map->runs[r].start >= first_cluster){
+            continue;
+        }
+        unsigned int end = map->runs[r].start + map->runs[r].length;
+        end = end < first_cluster ? end : first_cluster;
+        for(unsigned int cluster = end; before_count < budget && cluster-- > map->runs[r].start;){
+            if(isClusterFree(map, cluster)){
+                before[before_count++] = cluster;
+            }
+        }
+    }
+
+    unsigned int back = budget - after_count > budget / 4 ? budget - after_count : budget / 4;
+    back = back < before_count ? back : before_count;
+    search->ahead = after_count < budget - back ? after_count : budget - back;
+    for(unsigned int n = 0; n < back; n++){
+        search->pool[search->ahead + n] = before[back - 1 - n];
+    }
+    search->pool_size = search->ahead + back;
+    free(before);
+    return 0;
+}
+
+// Look for an ordering of free clusters that reproduces the SHA-1 of a
+// deleted entry. Returns 1 and fills chain when found, 0 when not, -1 on
+// error.
+static int findChain(Volume *vol, long slot, const unsigned char *target, unsigned int budget, unsigned int *chain){
+    unsigned int first_cluster = vol->dir_index->first_cluster[slot];
+    unsigned int size = vol->dir_index->size[slot];
+    unsigned int num_clusters = clustersForSize(vol, size);
+    const FreeMap *map = getFreeMap(vol);
+    if(map == NULL){
+        return -1;
+    }
+    // A first cluster that is allocated again has been reused
+    if(!isClusterFree(map, first_cluster)){
+        return 0;
+    }
+
+    ChainSearch search = {0};
+    search.vol = vol;
+    search.map = map;
+    search.target = target;
+    search.num_clusters = num_clusters;
+    search.last_bytes = size - (num_clusters - 1) * vol->cluster_size;
+    search.pool = malloc(budget * sizeof(unsigned int));
+    search.used = calloc(budget, 1);
+    search.chain = chain;
+    search.prefix = calloc(num_clusters, sizeof(EVP_MD_CTX *));
+    int status = search.pool && search.used && search.prefix ? 0 : -1;
+    for(unsigned int d = 0; status == 0 && d < num_clusters; d++){
+        search.prefix[d] = EVP_MD_CTX_new();
+        if(search.prefix[d] == NULL){
+            status = -1;
+        }
+    }
+    if(status == 0){
+        status = buildPool(&search, first_cluster, budget);
+    }
+    uint64_t span = statBegin();
+    // Deepen the jump allowance one fragment at a time: a contiguous file
+    // costs a single digest, a file in a few fragments only a handful of
+    // subtrees, and the last round is the exhaustive search.
+    for(unsigned int jumps = 0; status == 0 && num_clusters - 1 <= search.pool_size && jumps < num_clusters; jumps++){
+        search.jumps_left = jumps;
+        if(EVP_DigestInit_ex(search.prefix[0], EVP_sha1(), NULL) != 1){
+            status = -1;
+            break;
+        }
+        status = tryCluster(&search, 0, first_cluster);
+        if(status != 0){
+            break;
+        }
+    }
+    statEnd(SPAN_CHAIN_SEARCH, span);
+
+    if(search.prefix){
+        for(unsigned int d = 0; d < num_clusters; d++){
+            EVP_MD_CTX_free(search.prefix[d]);
+        }
+    }
+    free(search.prefix);
+    free(search.used);
+    free(search.pool);
+    if(status == -2){
+        // Out of search steps: report the file as not found
+        fprintf(stderr, "Cluster chain search gave up after %lu steps\n", (unsigned long)MAX_SEARCH_STEPS);
+        status = 0;
+    }else if(status < 0){
+        fprintf(stderr, "Error searching for cluster chain\n");
+    }
+    return status;
+}
+
+int recoverNonContiguous(Volume *vol, char *filename, char *sha1, unsigned int budget, FILE *out){
+    unsigned int dir_cluster;
+    const char *name;
+    if(dirIndexResolvePath(vol, filename, &dir_cluster, &name) != 0){
+        fprintf(out, "%s: file not found\n", filename);
+        return 0;
+    }
+
+    int fileDeleted = 0;
+    int status = 0;
+    unsigned char sha1_byte_array[SHA_DIGEST_LENGTH];
+    hex_string_to_byte_array(sha1, sha1_byte_array, SHA_DIGEST_LENGTH);
+
+    // A chain can be no longer than the budget plus the first cluster
+    unsigned int *chain = malloc((budget + 1) * sizeof(unsigned int));
+    unsigned int *found_chain = malloc((budget + 1) * sizeof(unsigned int));
+    unsigned int found_length = 0;
+    if(chain == NULL || found_chain == NULL){
+        perror("Error allocating memory");
+        free(chain);
+        free(found_chain);
+        return 1;
+    }
+
+    // Every deleted entry sharing the name, in on-disk order
+    DirIndex *index = vol->dir_index;
+    long match_slot = DIR_INDEX_NONE;
+    DirIndexMatch match;
+    for(long slot = dirIndexFirstMatch(&match, index, dir_cluster, name); slot != DIR_INDEX_NONE; slot = dirIndexNextMatch(&match)){
+        // only deleted files can be recovered
+        if(!dirIndexIsDeletedFile(index, slot)){
+            continue;
+        }
+        if(index->size[slot] == 0){
+            if(strcmp(sha1, EMPTY_SHA1) == 0){
+                fileDeleted++;
+                match_slot = slot;
+                found_length = 0;
+            }
+            continue;
+        }
+        if(clustersForSize(vol, index->size[slot]) > budget + 1){
+            continue;
+        }
+        statAdd(STAT_CANDIDATES, 1);
+        int found = findChain(vol, slot, sha1_byte_array, budget, chain);
+        if(found < 0){
+            free(chain);
+            free(found_chain);
+            return 1;
+        }
+        if(found){
+            // As with -r -s, the last matching entry wins
+            fileDeleted++;
+            match_slot = slot;
+            found_length = clustersForSize(vol, index->size[slot]);
+            memcpy(found_chain, chain, found_length * sizeof(unsigned int));
+        }
+    }
+
+    if(fileDeleted == 0){
+        fprintf(out, "%s: file not found\n", filename);
+    }else{
+        dirIndexRestoreName(vol, match_slot, dirIndexRestoredFirstChar(index, match_slot, name));
+        // Link the discovered chain in every FAT, or with -o copy it out
+        for(unsigned int i = 0; i < found_length; i++){
+            if(!vol->extract_dir){
+                setFatEntry(vol, found_chain[i], i < found_length - 1 ? found_chain[i + 1] : FAT_EOC);
+            }
+            markClustersUsed(vol->free_map, found_chain[i], 1);
+        }
+        if(vol->extract_dir && extractChain(vol, match_slot, found_chain, found_length) != 0){
+            status = 1;
+        }else{
+            fprintf(out, "%s: successfully recovered with SHA-1\n", filename);
+        }
+    }
+    free(chain);
+    free(found_chain);
+    return status;
+}
@@ -0,0 +1,15 @@
+#ifndef _SEARCH_H_
+#define _SEARCH_H_
+
+#include <stdio.h>
+
+#include "volume.h"
+
+// Free clusters around the first cluster considered for a non-contiguous chain
+#define DEFAULT_CLUSTER_BUDGET 20
+// Upper bound on clusters hashed while searching for one entry's chain
+#define MAX_SEARCH_STEPS (1UL << 22)
+
+int recoverNonContiguous(Volume *vol, char *filename, char *sha1, unsigned int budget, FILE *out);
+
+#endif
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE    // open_memstream, pthread_rwlockattr_setkind_np
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "serve.h"
+#include "recover.h"
+#include "journal.h"
+#include "dirindex.h"
+#include "freemap.h"
+
+// Everything the connection threads share
+typedef struct {
+    Volume *vol;
+    int listen_fd;
+    pthread_rwlock_t lock;      // read-only commands share it, edits hold it alone
+    pthread_mutex_t parse_lock; // getopt_long() keeps global state
+    pthread_mutex_t count_lock;
+    pthread_cond_t idle;
+    struct Connection *open;    // connections still being served
+    unsigned int connections;
+    int failed;                 // an edit could not be written; stop serving
+} Server;
+
+typedef struct Connection {
+    Server *server;
+    int fd;
+    struct Connection *prev, *next;
+} Connection;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stopServing(int signum){
+    stopping = 1;
+}
+
+static int writeAllFd(int fd, const char *data, size_t length){
+    while(length > 0){
+        ssize_t written = write(fd, data, length);
+        if(written < 0 && errno == EINTR){
+            continue;
+        }
+        if(written <= 0){
+            return -1;
+        }
+        data += written;
+        length -= (size_t)written;
+    }
+    return 0;
+}
+
+// Split a request line into words. Double quotes group words with spaces,
+// as they would in a shell. Returns the word count, or -1 when there are
+// too many or a quote is left open.
+static int splitRequest(char *line, char **words, int max_words){
+    int count = 0;
+    char *p = line;
+    for(;;){
+        while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'){
+            p++;
+        }
+        if(*p == '\0'){
+            return count;
+        }
+        if(count == max_words){
+            return -1;
+        }
+        char *word = p, *end = p;
+        while(*p != '\0' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n'){
+            if(*p == '"'){
+                char *close = strchr(p + 1, '"');
+                if(close == NULL){
+                    return -1;
+                }
+                memmove(end, p + 1, (size_t)(close - p - 1));
+                end += close - p - 1;
+                p = close + 1;
+            }else{
+                *end++ = *p++;
+            }
+        }
+        if(*p != '\0'){
+            p++;
+        }
+        *end = '\0';
+        words[count++] = word;
+    }
+}
+
+// Run one request and write its output, then "END <status>", to the client.
+// Output is rendered while the lock is held and sent once it is released,
+// so a slow client never holds up the others.
+static int answerRequest(Server *server, int fd, char *line){
+    char *argv[SERVE_MAX_ARGS + 2] = { "request" };
+    int argc = splitRequest(line, argv + 1, SERVE_MAX_ARGS);
+
+    char *output = NULL;
+    size_t output_size = 0;
+    FILE *out = open_memstream(&output, &output_size);
+    if(out == NULL){
+        perror("Error allocating memory");
+        return -1;
+    }
+
+    int status = 1;
+    CommandLine cmd;
+    int parsed = -1;
+    if(argc > 0){
+        argc++;
+        argv[argc] = NULL;
+        pthread_mutex_lock(&server->parse_lock);
+        parsed = parseCommandLine(argc, argv, &cmd);
+        pthread_mutex_unlock(&server->parse_lock);
+    }
+    // Options about the process were fixed when the server started
+    if(parsed != 0 || cmd.process_options || !hasCommand(&cmd)){
+        printUsage(out);
+    }else if(isReadOnlyCommand(&cmd)){
+        pthread_rwlock_rdlock(&server->lock);
+        status = runCommand(server->vol, &cmd, out);
+        fflush(out);
+        pthread_rwlock_unlock(&server->lock);
+    }else{
+        pthread_rwlock_wrlock(&server->lock);
+        if(server->failed){
+            fprintf(out, "Server is stopping after a failed write\n");
+        }else{
+            status = runCommand(server->vol, &cmd, out);
+            // Edits left planned mean the index no longer matches the
+            // image; the journal, if any, is replayed by the next run
+            if(server->vol->changes && server->vol->changes->count > 0){
+                server->failed = 1;
+                shutdown(server->listen_fd, SHUT_RDWR);
+            }
+        }
+        fflush(out);
+        pthread_rwlock_unlock(&server->lock);
+    }
+    fprintf(out, "END %d\n", status);
+    fclose(out);
+    int sent = writeAllFd(fd, output, output_size);
+    free(output);
+    return sent;
+}
+
+static void *serveConnection(void *arg){
+    Connection *conn = arg;
+    Server *server = conn->server;
+    FILE *in = fdopen(conn->fd, "r");
+    if(in != NULL){
+        char *line = NULL;
+        size_t line_cap = 0;
+        ssize_t length;
+        while((length = getline(&line, &line_cap, in)) > 0){
+            if(length > SERVE_MAX_LINE){
+                break;
+            }
+            line[strcspn(line, "\r\n")] = '\0';
+            if(strcmp(line, "quit") == 0){
+                break;
+            }
+            if(strcmp(line, "shutdown") == 0){
+                // Wakes accept() in serveVolume()
+                stopping = 1;
+                shutdown(server->listen_fd, SHUT_RDWR);
+                break;
+            }
+            if(answerRequest(server, conn->fd, line) != 0){
+                break;
+            }
+        }
+        free(line);
+    }
+
+    // Off the list before the descriptor is closed and its number reused
+    pthread_mutex_lock(&server->count_lock);
+    if(conn->prev){
+        conn->prev->next = conn->next;
+    }else{
+        server->open = conn->next;
+    }
+    if(conn->next){
+        conn->next->prev = conn->prev;
+    }
+    pthread_mutex_unlock(&server->count_lock);
+    if(in != NULL){
+        fclose(in);
+    }else{
+        close(conn->fd);
+    }
+    free(conn);
+
+    pthread_mutex_lock(&server->count_lock);
+    if(--server->connections == 0){
+        pthread_cond_signal(&server->idle);
+    }
+    pthread_mutex_unlock(&server->count_lock);
+    return NULL;
+}
+
+// Listen on a Unix socket at path. A socket file left by a server that is
+// gone is replaced; one that still answers is not.
+static int listenOn(const char *path){
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        fprintf(stderr, "Error opening socket: path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0){
+        perror("Error opening socket");
+        return -1;
+    }
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if(!bound && errno == EADDRINUSE){
+        int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+        int live = probe >= 0 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if(probe >= 0){
+            close(probe);
+        }
+        if(live){
+            fprintf(stderr, "Error opening socket: %s is in use\n", path);
+            close(fd);
+            return -1;
+        }
+        unlink(path);
+        bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    }
+    if(!bound || listen(fd, SOMAXCONN) != 0){
+        perror("Error opening socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Answer requests on a Unix socket until SIGINT, SIGTERM or a "shutdown"
+// request. Each line a client sends holds the options of one command, as
+// on the command line after the disk; the reply is that command's output
+// followed by "END <status>". Clients are served on threads of their own.
+int serveVolume(Volume *vol, const char *socket_path){
+    // Build the index and free map now rather than on the first request,
+    // so read-only requests never change the volume
+    if(getDirIndex(vol) == NULL || getFreeMap(vol) == NULL){
+        return 1;
+    }
+
+    Server server = { .vol = vol, .open = NULL, .connections = 0, .failed = 0 };
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    // A steady stream of readers must not starve a recovery
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&server.lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&server.parse_lock, NULL);
+    pthread_mutex_init(&server.count_lock, NULL);
+    pthread_cond_init(&server.idle, NULL);
+
+    server.listen_fd = listenOn(socket_path);
+    if(server.listen_fd < 0){
+        return 1;
+    }
+
+    // Without SA_RESTART the signal interrupts accept()
+    struct sigaction action = { .sa_handler = stopServing };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    // Connection threads inherit this mask, so only this thread is stopped
+    sigset_t stop_signals, old_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+
+    printf("Serving %s\n", socket_path);
+    fflush(stdout);
+
+    while(!stopping){
+        int fd = accept(server.listen_fd, NULL, NULL);
+        if(fd < 0){
+            if(errno == EINTR || errno == ECONNABORTED){
+                continue;
+            }
+            // shutdown() on the listening socket ends up here
+            break;
+        }
+        Connection *conn = malloc(sizeof(Connection));
+        if(conn == NULL){
+            perror("Error allocating memory");
+            close(fd);
+            continue;
+        }
+        conn->server = &server;
+        conn->fd = fd;
+        conn->prev = NULL;
+        pthread_mutex_lock(&server.count_lock);
+        conn->next = server.open;
+        if(server.open){
+            server.open->prev = conn;
+        }
+        server.open = conn;
+        server.connections++;
+        pthread_mutex_unlock(&server.count_lock);
+
+        pthread_t thread;
+        pthread_attr_t thread_attr;
+        pthread_attr_init(&thread_attr);
+        pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+        pthread_sigmask(SIG_BLOCK, &stop_signals, &old_mask);
+        int created = pthread_create(&thread, &thread_attr, serveConnection, conn);
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+        pthread_attr_destroy(&thread_attr);
+        if(created != 0){
+            fprintf(stderr, "Error starting connection thread\n");
+            pthread_mutex_lock(&server.count_lock);
+            server.open = conn->next;
+            if(conn->next){
+                conn->next->prev = NULL;
+            }
+            server.connections--;
+            pthread_mutex_unlock(&server.count_lock);
+            close(fd);
+            free(conn);
+        }
+    }
+
+    close(server.listen_fd);
+    unlink(socket_path);
+
+    // Requests in flight finish and are answered; then every client reads
+    // end of file, so no thread is left using the volume
+    pthread_mutex_lock(&server.count_lock);
+    for(Connection *conn = server.open; conn != NULL; conn = conn->next){
+        shutdown(conn->fd, SHUT_RD);
+    }
+    while(server.connections > 0){
+        pthread_cond_wait(&server.idle, &server.count_lock);
+    }
+    pthread_mutex_unlock(&server.count_lock);
+
+    pthread_cond_destroy(&server.idle);
+    pthread_mutex_destroy(&server.count_lock);
+    pthread_mutex_destroy(&server.parse_lock);
+    pthread_rwlock_destroy(&server.lock);
+    return server.failed ? 1 : 0;
+}
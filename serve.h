@@ -0,0 +1,12 @@
+#ifndef _SERVE_H_
+#define _SERVE_H_
+
+#include "volume.h"
+
+// Longest request line a client may send
+#define SERVE_MAX_LINE 8192
+#define SERVE_MAX_ARGS 64
+
+int serveVolume(Volume *vol, const char *socket_path);
+
+#endif
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "stats.h"
+
+static const char *counter_names[STAT_COUNTER_COUNT] = {
+    "clusters_visited",
+    "dir_entries",
+    "fat_links",
+    "bytes_hashed",
+    "candidates",
+    "chain_steps",
+    "bytes_loaded",
+};
+
+static const char *span_names[SPAN_COUNT] = {
+    "open",
+    "cache_load",
+    "command",
+    "dir_scan",
+    "free_map",
+    "hashing",
+    "chain_search",
+    "load",
+    "apply",
+    "cache_save",
+};
+
+#ifndef NYUFILE_NO_STATS
+
+StatsFormat stats_format = STATS_OFF;
+uint64_t stat_counters[STAT_COUNTER_COUNT];
+static uint64_t span_nanos[SPAN_COUNT];
+static uint64_t span_calls[SPAN_COUNT];
+static uint64_t stats_start;
+
+// Nanoseconds on the monotonic clock
+uint64_t statClock(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+void statRecord(StatSpan span, uint64_t start){
+    __atomic_fetch_add(&span_nanos[span], statClock() - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&span_calls[span], 1, __ATOMIC_RELAXED);
+}
+
+void startStats(StatsFormat format){
+    stats_format = format;
+    stats_start = statClock();
+}
+
+static double seconds(uint64_t nanos){
+    return (double)nanos / 1e9;
+}
+
+static double timevalSeconds(const struct timeval *tv){
+    return (double)tv->tv_sec + (double)tv->tv_usec / 1e6;
+}
+
+// Print what the run spent, as aligned text or a single JSON object
+void printStats(FILE *out){
+    if(stats_format == STATS_OFF){
+        return;
+    }
+    uint64_t wall = statClock() - stats_start;
+    struct rusage usage = {0};
+    getrusage(RUSAGE_SELF, &usage);
+    if(stats_format == STATS_JSON){
+        fprintf(out, "{\"wall_seconds\":%.6f,\"user_seconds\":%.6f,\"system_seconds\":%.6f,", seconds(wall),
+                timevalSeconds(&usage.ru_utime), timevalSeconds(&usage.ru_stime));
+        fprintf(out, "\"minor_faults\":%ld,\"major_faults\":%ld,\"max_rss_kb\":%ld,", usage.ru_minflt, usage.ru_majflt, usage.ru_maxrss);
+        fprintf(out, "\"spans\":{");
+        for(int s = 0; s < SPAN_COUNT; s++){
+            fprintf(out, "%s\"%s\":{\"seconds\":%.6f,\"calls\":%llu}", s ? "," : "", span_names[s],
+                    seconds(span_nanos[s]), (unsigned long long)span_calls[s]);
+        }
+        fprintf(out, "},\"counters\":{");
+        for(int c = 0; c < STAT_COUNTER_COUNT; c++){
+            fprintf(out, "%s\"%s\":%llu", c ? "," : "", counter_names[c], (unsigned long long)stat_counters[c]);
+        }
+        fprintf(out, "}}\n");
+        return;
+    }
+    fprintf(out, "Stats:\n");
+    fprintf(out, "  %-18s %12.6f s\n", "wall", seconds(wall));
+    fprintf(out, "  %-18s %12.6f s\n", "user", timevalSeconds(&usage.ru_utime));
+    fprintf(out, "  %-18s %12.6f s\n", "system", timevalSeconds(&usage.ru_stime));
+    fprintf(out, "  %-18s %12ld\n", "minor_faults", usage.ru_minflt);
+    fprintf(out, "  %-18s %12ld\n", "major_faults", usage.ru_majflt);
+    fprintf(out, "  %-18s %12ld KB\n", "max_rss", usage.ru_maxrss);
+    for(int s = 0; s < SPAN_COUNT; s++){
+        if(span_calls[s]){
+            fprintf(out, "  %-18s %12.6f s in %llu calls\n", span_names[s], seconds(span_nanos[s]), (unsigned long long)span_calls[s]);
+        }
+    }
+    for(int c = 0; c < STAT_COUNTER_COUNT; c++){
+        fprintf(out, "  %-18s %12llu\n", counter_names[c], (unsigned long long)stat_counters[c]);
+    }
+}
+
+#else
+
+void startStats(StatsFormat format){
+    if(format != STATS_OFF){
+        fprintf(stderr, "Stats are not built in; rebuild without STATS=0\n");
+    }
+}
+
+void printStats(FILE *out){
+}
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Counters and timed spans for --stats. While stats are off every call
+// below is one predictable branch; building with -DNYUFILE_NO_STATS
+// (make STATS=0) removes them altogether.
+
+typedef enum {
+    STAT_CLUSTERS_VISITED,      // data clusters read by walks, hashing and searches
+    STAT_DIR_ENTRIES,           // directory entries decoded
+    STAT_FAT_LINKS,             // cluster chain links followed
+    STAT_BYTES_HASHED,
+    STAT_CANDIDATES,            // deleted entries weighed as a match
+    STAT_CHAIN_STEPS,           // clusters tried by the -R search
+    STAT_BYTES_LOADED,          // bytes brought in by the I/O backend
+    STAT_COUNTER_COUNT
+} StatCounter;
+
+// Spans nest: loading counts inside whatever span asked for the bytes
+typedef enum {
+    SPAN_OPEN,
+    SPAN_CACHE_LOAD,
+    SPAN_COMMAND,
+    SPAN_DIR_SCAN,
+    SPAN_FREE_MAP,
+    SPAN_HASHING,
+    SPAN_CHAIN_SEARCH,
+    SPAN_LOAD,
+    SPAN_APPLY,
+    SPAN_CACHE_SAVE,
+    SPAN_COUNT
+} StatSpan;
+
+typedef enum {
+    STATS_OFF,
+    STATS_TEXT,
+    STATS_JSON
+} StatsFormat;
+
+void startStats(StatsFormat format);
+void printStats(FILE *out);
+
+#ifdef NYUFILE_NO_STATS
+
+static inline void statAdd(StatCounter counter, uint64_t amount){}
+static inline uint64_t statBegin(void){ return 0; }
+static inline void statEnd(StatSpan span, uint64_t start){}
+
+#else
+
+extern StatsFormat stats_format;
+extern uint64_t stat_counters[STAT_COUNTER_COUNT];
+
+uint64_t statClock(void);
+void statRecord(StatSpan span, uint64_t start);
+
+// Safe from any thread
+static inline void statAdd(StatCounter counter, uint64_t amount){
+    if(stats_format != STATS_OFF){
+        __atomic_fetch_add(&stat_counters[counter], amount, __ATOMIC_RELAXED);
+    }
+}
+
+// uint64_t start = statBegin(); ... statEnd(SPAN_X, start);
+static inline uint64_t statBegin(void){
+    return stats_format != STATS_OFF ? statClock() : 0;
+}
+
+static inline void statEnd(StatSpan span, uint64_t start){
+    if(stats_format != STATS_OFF){
+        statRecord(span, start);
+    }
+}
+
+#endif
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int uringSetup(unsigned int entries, struct io_uring_params *params){
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags){
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+// Create a ring of the given depth. Returns -1, with errno set, when the
+// kernel has no io_uring or does not allow it; callers then fall back to
+// plain reads.
+int uringInit(Uring *ring, unsigned int entries){
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = uringSetup(entries, &params);
+    if(ring->fd < 0){
+        return -1;
+    }
+    ring->entries = params.sq_entries;
+    ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if(ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED){
+        int saved = errno;
+        uringFree(ring);
+        errno = saved;
+        return -1;
+    }
+    unsigned char *sq = ring->sq_ring;
+    unsigned char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+void uringFree(Uring *ring){
+    if(ring->sq_ring && ring->sq_ring != MAP_FAILED){
+        munmap(ring->sq_ring, ring->sq_ring_len);
+    }
+    if(ring->cq_ring && ring->cq_ring != MAP_FAILED){
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+    if(ring->sqes && ring->sqes != MAP_FAILED){
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if(ring->fd >= 0){
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+static void queueRead(Uring *ring, int fd, unsigned char *buffer, size_t length, uint64_t offset, uint64_t tag){
+    unsigned int tail = *ring->sq_tail;
+    unsigned int index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = (uint32_t)length;
+    sqe->off = offset;
+    sqe->user_data = tag;
+    ring->sq_array[index] = index;
+    // The kernel must see the entry before the new tail
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Read length bytes at offset into buffer, piece bytes per request, with
+// as many requests in flight as the ring holds. Bytes past the end of the
+// file read as zero. Entries the kernel does not take at once are offered
+// again, and after an error every read already taken is waited for, since
+// the caller frees buffer; a ring that cannot even wait is torn down.
+// Returns 0, or -1 with errno set.
+int uringRead(Uring *ring, int fd, unsigned char *buffer, size_t length, uint64_t offset, size_t piece){
+    size_t pieces = (length + piece - 1) / piece;
+    size_t next = 0;
+    unsigned int pending = 0;           // queued, not yet taken by the kernel
+    unsigned int in_flight = 0;
+    int error = 0;
+    while(next < pieces || pending > 0 || in_flight > 0){
+        while(!error && next < pieces && in_flight + pending < ring->entries){
+            size_t start = next * piece;
+            size_t len = length - start < piece ? length - start : piece;
+            queueRead(ring, fd, buffer + start, len, offset + start, next);
+            next++;
+            pending++;
+        }
+        // Only wait when a completion is sure to come
+        int entered;
+        do{
+            entered = uringEnter(ring->fd, pending, in_flight > 0 ? 1 : 0, IORING_ENTER_GETEVENTS);
+        }while(entered < 0 && errno == EINTR);
+        if(entered >= 0){
+            pending -= (unsigned int)entered;
+            in_flight += (unsigned int)entered;
+        }else if(errno == EAGAIN || errno == EBUSY){
+            // The kernel is short of room, which reaping completions below
+            // gives back. When there are none yet, wait for one rather than
+            // offer the entries again at once.
+            if(in_flight > 0 && *ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)){
+                uringEnter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS);
+            }else if(in_flight == 0){
+                sched_yield();
+            }
+        }else if(pending > 0){
+            // The ring refused the call itself. Entries it never took are
+            // withdrawn; reads it did take are still waited for.
+            error = error ? error : errno;
+            __atomic_store_n(ring->sq_tail, *ring->sq_tail - pending, __ATOMIC_RELEASE);
+            pending = 0;
+        }else{
+            // Not even a wait is accepted, so the reads still in flight can
+            // never be reaped. Closing the ring cancels them before the
+            // caller frees buffer.
+            error = error ? error : errno;
+            uringFree(ring);
+            break;
+        }
+
+        unsigned int head = *ring->cq_head;
+        unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != tail; head++){
+            const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            size_t start = (size_t)cqe->user_data * piece;
+            size_t len = length - start < piece ? length - start : piece;
+            if(cqe->res < 0){
+                error = error ? error : -cqe->res;
+            }else if((size_t)cqe->res < len){
+                // Only the end of the file cuts a direct read short
+                memset(buffer + start + cqe->res, 0, len - (size_t)cqe->res);
+            }
+            in_flight--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+        if(error && pending == 0 && in_flight == 0){
+            break;
+        }
+    }
+    if(error){
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
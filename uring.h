@@ -0,0 +1,33 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+// A minimal io_uring, set up with the raw system calls: a submission and
+// a completion ring mapped from the kernel, used for batches of reads.
+typedef struct {
+    int fd;
+    unsigned int entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+} Uring;
+
+int uringInit(Uring *ring, unsigned int entries);
+void uringFree(Uring *ring);
+int uringRead(Uring *ring, int fd, unsigned char *buffer, size_t length, uint64_t offset, size_t piece);
+
+#endif
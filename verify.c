@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "verify.h"
+#include "dirindex.h"
+#include "window.h"
+#include "stats.h"
+
+typedef struct {
+    PoolJob run;
+    void *ctx;
+    size_t count;
+    size_t next;                // next job to hand out
+    pthread_mutex_t lock;
+    int failed;
+} Pool;
+
+typedef struct {
+    const Volume *vol;
+    const unsigned int *clusters;
+    const unsigned int *sizes;
+    unsigned char (*digests)[SHA_DIGEST_LENGTH];
+} HashJobs;
+
+// Stream the SHA-1 of size bytes stored contiguously from cluster, straight
+// out of the mapping. Memory use stays constant whatever the file size.
+int hashContiguous(const Volume *vol, unsigned int cluster, unsigned int size, unsigned char *digest){
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if(ctx == NULL || EVP_DigestInit_ex(ctx, EVP_sha1(), NULL) != 1){
+        EVP_MD_CTX_free(ctx);
+        return -1;
+    }
+    int status = 0;
+    // A contiguous file is a single run of the image, viewed a piece at a time
+    uint64_t offset = clusterOffset(vol, cluster);
+    for(uint64_t done = 0; status == 0 && done < size;){
+        size_t piece = size - done < VIEW_CHUNK ? (size_t)(size - done) : VIEW_CHUNK;
+        VolumeView view;
+        const unsigned char *data = viewRange(vol, offset + done, piece, &view);
+        if(data == NULL){
+            status = -1;
+            break;
+        }
+        adviseRange(data, piece, MADV_SEQUENTIAL);
+        if(EVP_DigestUpdate(ctx, data, piece) != 1){
+            status = -1;
+        }
+        releaseView(vol, &view);
+        done += piece;
+    }
+    if(status == 0 && EVP_DigestFinal_ex(ctx, digest, NULL) != 1){
+        status = -1;
+    }
+    EVP_MD_CTX_free(ctx);
+    statAdd(STAT_BYTES_HASHED, size);
+    statAdd(STAT_CLUSTERS_VISITED, clustersForSize(vol, size));
+    return status;
+}
+
+static void *poolWorker(void *arg){
+    Pool *pool = arg;
+    for(;;){
+        pthread_mutex_lock(&pool->lock);
+        size_t job = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if(job >= pool->count){
+            break;
+        }
+        if(pool->run(pool->ctx, job) != 0){
+            pthread_mutex_lock(&pool->lock);
+            pool->failed = 1;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    return NULL;
+}
+
+// One thread per online CPU, but never more threads than jobs
+unsigned int verifyThreadCount(size_t jobs){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus < 1){
+        cpus = 1;
+    }
+    if((size_t)cpus > jobs){
+        cpus = (long)jobs;
+    }
+    return cpus < 1 ? 1 : (unsigned int)cpus;
+}
+
+// Run jobs 0 to count - 1 on a pool sized to the machine, each job handed
+// out once. The calling thread is one of the workers, and a thread that
+// cannot be started leaves its share to the others. Returns -1 when any
+// job failed.
+int runPool(size_t count, PoolJob run, void *ctx){
+    Pool pool = { run, ctx, count, 0, PTHREAD_MUTEX_INITIALIZER, 0 };
+    if(count == 0){
+        return 0;
+    }
+    unsigned int extra_threads = verifyThreadCount(count) - 1;
+    pthread_t *threads = extra_threads ? malloc(extra_threads * sizeof(pthread_t)) : NULL;
+    unsigned int started = 0;
+    for(; threads && started < extra_threads; started++){
+        if(pthread_create(&threads[started], NULL, poolWorker, &pool) != 0){
+            break;
+        }
+    }
+    poolWorker(&pool);
+    for(unsigned int t = 0; t < started; t++){
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&pool.lock);
+    return pool.failed ? -1 : 0;
+}
+
+// Every job writes only its own slot, so results come back in input order
+static int hashJob(void *ctx, size_t job){
+    HashJobs *jobs = ctx;
+    return hashContiguous(jobs->vol, jobs->clusters[job], jobs->sizes[job], jobs->digests[job]);
+}
+
+// Compute the SHA-1 of sizes[i] bytes stored contiguously from clusters[i]
+// for every deleted entry, on a pool sized to the machine. digests[i]
+// always corresponds to entry i.
+int hashEntries(const Volume *vol, const unsigned int *clusters, const unsigned int *sizes, size_t count, unsigned char (*digests)[SHA_DIGEST_LENGTH]){
+    HashJobs jobs = { vol, clusters, sizes, digests };
+    if(count == 0){
+        return 0;
+    }
+
+    uint64_t span = statBegin();
+    int status = runPool(count, hashJob, &jobs);
+    statEnd(SPAN_HASHING, span);
+    if(status != 0){
+        fprintf(stderr, "Error hashing candidate files\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Like hashEntries() for directory index slots, but every digest computed
+// once is kept in the index, so a cached index never hashes an entry twice.
+int hashIndexedEntries(Volume *vol, const long *slots, size_t count, unsigned char (*digests)[SHA_DIGEST_LENGTH]){
+    DirIndex *index = vol->dir_index;
+    unsigned int *clusters = calloc(count ? count : 1, sizeof(unsigned int));
+    unsigned int *sizes = calloc(count ? count : 1, sizeof(unsigned int));
+    size_t *positions = malloc((count ? count : 1) * sizeof(size_t));
+    unsigned char (*computed)[SHA_DIGEST_LENGTH] = malloc((count ? count : 1) * SHA_DIGEST_LENGTH);
+    if(clusters == NULL || sizes == NULL || positions == NULL || computed == NULL){
+        perror("Error allocating memory");
+        free(clusters);
+        free(sizes);
+        free(positions);
+        free(computed);
+        return -1;
+    }
+    statAdd(STAT_CANDIDATES, count);
+    size_t miss_count = 0;
+    for(size_t n = 0; n < count; n++){
+        if(index->has_digest[slots[n]]){
+            memcpy(digests[n], index->digests[slots[n]], SHA_DIGEST_LENGTH);
+        }else{
+            clusters[miss_count] = index->first_cluster[slots[n]];
+            sizes[miss_count] = index->size[slots[n]];
+            positions[miss_count++] = n;
+        }
+    }
+    int status = hashEntries(vol, clusters, sizes, miss_count, computed);
+    for(size_t m = 0; status == 0 && m < miss_count; m++){
+        long slot = slots[positions[m]];
+        memcpy(digests[positions[m]], computed[m], SHA_DIGEST_LENGTH);
+        memcpy(index->digests[slot], computed[m], SHA_DIGEST_LENGTH);
+        index->has_digest[slot] = 1;
+        index->dirty = 1;
+    }
+    free(clusters);
+    free(sizes);
+    free(positions);
+    free(computed);
+    return status;
+}
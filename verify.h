@@ -0,0 +1,17 @@
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+#include <openssl/sha.h>
+
+#include "volume.h"
+
+// One job of runPool(), given its number: returns 0, or -1 when it failed
+typedef int (*PoolJob)(void *ctx, size_t job);
+
+int hashContiguous(const Volume *vol, unsigned int cluster, unsigned int size, unsigned char *digest);
+int hashEntries(const Volume *vol, const unsigned int *clusters, const unsigned int *sizes, size_t count, unsigned char (*digests)[SHA_DIGEST_LENGTH]);
+int hashIndexedEntries(Volume *vol, const long *slots, size_t count, unsigned char (*digests)[SHA_DIGEST_LENGTH]);
+unsigned int verifyThreadCount(size_t jobs);
+int runPool(size_t count, PoolJob run, void *ctx);
+
+#endif
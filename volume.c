@@ -0,0 +1,312 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "volume.h"
+#include "freemap.h"
+#include "dirindex.h"
+#include "journal.h"
+#include "window.h"
+#include "stats.h"
+
+DiskData *getDiskData(const char  *disk_path, const DiskIoConfig *config){
+    static const DiskIoConfig default_config = { DISK_IO_MMAP, DISK_IO_DEFAULT_QUEUE_DEPTH, 0 };
+    if (config == NULL) {
+        config = &default_config;
+    }
+    DiskData *disk_data = calloc(1, sizeof(DiskData));
+    if (!disk_data) {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    disk_data->backend = diskBackend(config->mode);
+    // Open file; a read-only image can still be inspected and dry-run
+    disk_data->read_only = config->read_only;
+    disk_data->fd = open(disk_path, config->read_only ? O_RDONLY : O_RDWR);
+    if (disk_data->fd < 0 && !config->read_only && (errno == EACCES || errno == EROFS)) {
+        disk_data->read_only = 1;
+        disk_data->fd = open(disk_path, O_RDONLY);
+    }
+    if (disk_data->fd < 0) {
+        perror("Error opening file");
+        free(disk_data);
+        return NULL;
+    }
+    // Get file size
+    struct stat st;
+    if (fstat(disk_data->fd, &st) == -1) {
+        perror("Error getting file stats");
+        close(disk_data->fd);
+        free(disk_data);
+        return NULL;
+    }
+    // A block device reports no size of its own, so ask where it ends
+    disk_data->size = (uint64_t)st.st_size;
+    if (S_ISBLK(st.st_mode)) {
+        off_t end = lseek(disk_data->fd, 0, SEEK_END);
+        disk_data->size = end > 0 ? (uint64_t)end : 0;
+    }
+    if (disk_data->backend->open(disk_data, disk_path, config) != 0) {
+        close(disk_data->fd);
+        free(disk_data);
+        return NULL;
+    }
+    // Load the image whole when the backend and address space allow it and
+    // a window at a time otherwise. Nothing writes through either: edits
+    // are planned with writeVolume() and applied by applyChanges().
+    if (disk_data->backend->whole && disk_data->size <= WINDOW_MAP_WHOLE_MAX) {
+        disk_data->data = disk_data->backend->load(disk_data, 0, disk_data->size);
+        if (disk_data->data == NULL) {
+            freeDiskData(disk_data);
+            return NULL;
+        }
+    } else {
+        disk_data->windows = newWindowCache(disk_data);
+        if (disk_data->windows == NULL) {
+            freeDiskData(disk_data);
+            return NULL;
+        }
+    }
+
+    return disk_data;
+}
+
+void freeDiskData(DiskData *disk_data) {
+    if(disk_data) {
+        if (disk_data->data != NULL) {
+            disk_data->backend->unload(disk_data, disk_data->data, disk_data->size);
+        }
+        freeWindowCache(disk_data->windows);
+        disk_data->backend->close(disk_data);
+        if (disk_data->fd >= 0) {
+            close(disk_data->fd);
+        }
+        free(disk_data);
+    }
+}
+
+// Load the active FAT by itself, from the page it starts in
+static int loadFat(Volume *vol){
+    long page_size = sysconf(_SC_PAGESIZE);
+    uint64_t fat_start = fatEntryOffset(vol, vol->active_fat, 0);
+    uint64_t map_start = fat_start - fat_start % (uint64_t)page_size;
+    size_t map_len = (size_t)(fat_start - map_start + vol->fat_size);
+    unsigned char *fat_map = vol->disk->backend->load(vol->disk, map_start, map_len);
+    if(fat_map == NULL){
+        return -1;
+    }
+    if(vol->fat_map){
+        vol->disk->backend->unload(vol->disk, vol->fat_map, vol->fat_map_len);
+    }
+    vol->fat_map = fat_map;
+    vol->fat_map_len = map_len;
+    vol->fat = fat_map + (fat_start - map_start);
+    return 0;
+}
+
+static int isPowerOfTwo(unsigned int value){
+    return value != 0 && (value & (value - 1)) == 0;
+}
+
+// Check the fields every command relies on before trusting any offset
+// derived from them.
+static int validateBootEntry(const BootEntry *bs, uint64_t disk_size){
+    if(bs->BPB_BytsPerSec < 512 || bs->BPB_BytsPerSec > 4096 || !isPowerOfTwo(bs->BPB_BytsPerSec)){
+        return -1;
+    }
+    if(!isPowerOfTwo(bs->BPB_SecPerClus)){
+        return -1;
+    }
+    if(bs->BPB_NumFATs == 0 || bs->BPB_FATSz32 == 0 || bs->BPB_RsvdSecCnt == 0){
+        return -1;
+    }
+    if(bs->BPB_RootClus < 2){
+        return -1;
+    }
+    uint64_t data_offset = ((uint64_t)bs->BPB_RsvdSecCnt + (uint64_t)bs->BPB_NumFATs * bs->BPB_FATSz32) * bs->BPB_BytsPerSec;
+    if(data_offset >= disk_size){
+        return -1;
+    }
+    return 0;
+}
+
+Volume *openVolume(const char *disk_path, const DiskIoConfig *config){
+    Volume *vol = calloc(1, sizeof(Volume));
+    if(vol == NULL){
+        perror("Error allocating memory");
+        return NULL;
+    }
+    vol->journal_path = malloc(strlen(disk_path) + sizeof(JOURNAL_SUFFIX));
+    if(vol->journal_path == NULL){
+        perror("Error allocating memory");
+        free(vol);
+        return NULL;
+    }
+    sprintf(vol->journal_path, "%s%s", disk_path, JOURNAL_SUFFIX);
+    vol->disk = getDiskData(disk_path, config);
+    if(vol->disk == NULL){
+        closeVolume(vol);
+        return NULL;
+    }
+    // Finish the writes of an earlier run before trusting anything on disk;
+    // an image opened read-only, by request or for lack of permission, is
+    // taken as it is
+    if(vol->disk->read_only){
+        if(access(vol->journal_path, F_OK) == 0){
+            fprintf(stderr, "%s: unfinished writes in %s are not replayed on a read-only image\n", disk_path, vol->journal_path);
+        }
+    }else if(replayJournal(vol->disk, vol->journal_path) != 0){
+        closeVolume(vol);
+        return NULL;
+    }
+    if(vol->disk->size < sizeof(BootEntry)){
+        fprintf(stderr, "%s: image too small for a FAT32 boot sector\n", disk_path);
+        closeVolume(vol);
+        return NULL;
+    }
+    if(pread(vol->disk->fd, &vol->bs, sizeof(BootEntry), 0) != (ssize_t)sizeof(BootEntry)){
+        perror("Error reading boot sector");
+        closeVolume(vol);
+        return NULL;
+    }
+    if(validateBootEntry(&vol->bs, vol->disk->size) != 0){
+        fprintf(stderr, "%s: invalid FAT32 boot sector\n", disk_path);
+        closeVolume(vol);
+        return NULL;
+    }
+
+    const BootEntry *bs = &vol->bs;
+    vol->cluster_size = bs->BPB_BytsPerSec * bs->BPB_SecPerClus;
+    vol->entries_per_cluster = vol->cluster_size / sizeof(DirEntry);
+    vol->fat_offset = (uint64_t)bs->BPB_RsvdSecCnt * bs->BPB_BytsPerSec;
+    vol->fat_size = (uint64_t)bs->BPB_FATSz32 * bs->BPB_BytsPerSec;
+    vol->data_offset = vol->fat_offset + bs->BPB_NumFATs * vol->fat_size;
+
+    // With mirroring off (bit 7 of BPB_ExtFlags) only the FAT named by the
+    // low bits is in use; otherwise every copy mirrors FAT #0
+    vol->fat_mirrored = !(bs->BPB_ExtFlags & FAT_NO_MIRRORING);
+    vol->active_fat = vol->fat_mirrored ? 0 : bs->BPB_ExtFlags & FAT_ACTIVE_MASK;
+    if(vol->active_fat >= bs->BPB_NumFATs){
+        vol->active_fat = 0;
+    }
+
+    // The active FAT stays in memory for the whole run; every chain walk
+    // reads it
+    if(vol->disk->data){
+        vol->fat = vol->disk->data + fatEntryOffset(vol, vol->active_fat, 0);
+    }else if(loadFat(vol) != 0){
+        closeVolume(vol);
+        return NULL;
+    }
+
+    // The cluster count is bounded by both the image and the FAT size so
+    // a truncated image never yields pointers past the mapping.
+    uint64_t image_clusters = (vol->disk->size - vol->data_offset) / vol->cluster_size;
+    uint64_t fat_clusters = vol->fat_size / 4 - 2;
+    vol->cluster_count = (unsigned int)(image_clusters < fat_clusters ? image_clusters : fat_clusters);
+    return vol;
+}
+
+void closeVolume(Volume *vol){
+    if(vol){
+        freeFreeMap(vol->free_map);
+        freeDirIndex(vol->dir_index);
+        freeChangeList(vol->changes);
+        if(vol->fat_map){
+            vol->disk->backend->unload(vol->disk, vol->fat_map, vol->fat_map_len);
+        }
+        freeDiskData(vol->disk);
+        free(vol->journal_path);
+        free(vol);
+    }
+}
+
+// Bring the bytes read so far up to date after applyChanges() wrote the
+// image. A mapping follows the writes by itself; a backend holding copies
+// drops its idle windows and reads the active FAT again.
+int reloadVolume(Volume *vol){
+    if(vol->disk->backend->coherent){
+        return 0;
+    }
+    dropWindows(vol->disk->windows);
+    return vol->fat_map ? loadFat(vol) : 0;
+}
+
+int isDataCluster(const Volume *vol, unsigned int cluster){
+    return cluster >= 2 && cluster - 2 < vol->cluster_count;
+}
+
+// Byte offset of a data cluster in the image
+uint64_t clusterOffset(const Volume *vol, unsigned int cluster){
+    return vol->data_offset + (uint64_t)(cluster - 2) * vol->cluster_size;
+}
+
+uint64_t fatEntryOffset(const Volume *vol, unsigned int fat_num, unsigned int cluster){
+    return vol->fat_offset + fat_num * vol->fat_size + (uint64_t)cluster * 4;
+}
+
+// Raw entry of the active FAT with the reserved high bits masked off
+unsigned int fatEntry(const Volume *vol, unsigned int cluster){
+    unsigned int value;
+    memcpy(&value, vol->fat + (uint64_t)cluster * 4, sizeof(value));
+    return value & FAT_ENTRY_MASK;
+}
+
+// Follow one link of a cluster chain. Free, reserved and out-of-range
+// entries all end the chain so a damaged FAT never walks off the image.
+unsigned int nextCluster(const Volume *vol, unsigned int cluster){
+    unsigned int next = fatEntry(vol, cluster);
+    statAdd(STAT_FAT_LINKS, 1);
+    if(next < FAT_EOC_MIN && !isDataCluster(vol, next)){
+        return FAT_EOC;
+    }
+    return next;
+}
+
+// Plan a new value for an entry of the active FAT. The other copies are
+// brought in line when the changes are applied, see coalesceChanges().
+void setFatEntry(Volume *vol, unsigned int cluster, unsigned int value){
+    writeVolume(vol, fatEntryOffset(vol, vol->active_fat, cluster), &value, sizeof(value));
+}
+
+// Plan a write of the image. Reads keep seeing the old contents until
+// applyChanges() writes every planned change at once.
+int writeVolume(Volume *vol, uint64_t offset, const void *bytes, size_t length){
+    return addChange(&vol->changes, offset, bytes, length);
+}
+
+// FAT32 splits the first cluster across two 16-bit fields
+unsigned int entryFirstCluster(const DirEntry *dirEntry){
+    return ((unsigned int)dirEntry->DIR_FstClusHI << 16 | dirEntry->DIR_FstClusLO) & FAT_ENTRY_MASK;
+}
+
+unsigned int clustersForSize(const Volume *vol, unsigned int size){
+    return (unsigned int)(((uint64_t)size + vol->cluster_size - 1) / vol->cluster_size);
+}
+
+// Render the 8.3 name as "NAME.EXT"; out must hold at least 13 bytes
+void formatShortName(const DirEntry *dirEntry, char *out){
+    int nameEnd = 0;
+    // Copy the filename part
+    for(int j = 0; j< 8; j++){
+        if(dirEntry->DIR_Name[j] != ' '){
+            out[nameEnd++] = dirEntry->DIR_Name[j];
+        }
+    }
+    // Copy the extension part
+    for(int k = 8; k < 11; k++) {
+        if(dirEntry->DIR_Name[k] != ' '){
+            if(k == 8){
+                // Add the '.' character
+                out[nameEnd++] = '.';
+            }
+            out[nameEnd++] = dirEntry->DIR_Name[k];
+        }
+    }
+    out[nameEnd] = '\0';
+}
@@ -0,0 +1,118 @@
+#ifndef _VOLUME_H_
+#define _VOLUME_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "diskio.h"
+
+#define FAT_ENTRY_MASK 0x0FFFFFFF
+#define FAT_EOC 0x0FFFFFFF
+#define FAT_EOC_MIN 0x0FFFFFF7
+// BPB_ExtFlags: bit 7 turns FAT mirroring off, bits 0-3 then name the
+// active FAT
+#define FAT_NO_MIRRORING 0x80
+#define FAT_ACTIVE_MASK 0x0F
+
+#pragma pack(push,1)
+typedef struct BootEntry {
+    unsigned char BS_jmpBoot[3];
+    unsigned char BS_OEMName[8];
+    unsigned short BPB_BytsPerSec;
+    unsigned char BPB_SecPerClus;
+    unsigned short BPB_RsvdSecCnt;
+    unsigned char BPB_NumFATs;
+    unsigned short BPB_RootEntCnt;
+    unsigned short BPB_TotSec16;
+    unsigned char BPB_Media;
+    unsigned short BPB_FATSz16;
+    unsigned short BPB_SecPerTrk;
+    unsigned short BPB_NumHeads;
+    unsigned int BPB_HiddSec;
+    unsigned int BPB_TotSec32;
+    unsigned int BPB_FATSz32;
+    unsigned short BPB_ExtFlags;
+    unsigned short BPB_FSVer;
+    unsigned int BPB_RootClus;
+    unsigned short BPB_FSInfo;
+    unsigned short BPB_BkBootSec;
+    unsigned char BPB_Reserved[12];
+    unsigned char BS_DrvNum;
+    unsigned char BS_Reserved1;
+    unsigned char BS_BootSig;
+    unsigned int BS_VolID;
+    unsigned char BS_VolLab[11];
+    unsigned char BS_FilSysType[8];
+} BootEntry;
+#pragma pack(pop)
+
+#pragma pack(push,1)
+typedef struct DirEntry {
+    unsigned char DIR_Name[11];
+    unsigned char DIR_Attr;
+    unsigned char DIR_NTRes;
+    unsigned char DIR_CrtTimeTenth;
+    unsigned short DIR_CrtTime;
+    unsigned short DIR_CrtDate;
+    unsigned short DIR_LstAccDate;
+    unsigned short DIR_FstClusHI;
+    unsigned short DIR_WrtTime;
+    unsigned short DIR_WrtDate;
+    unsigned short DIR_FstClusLO;
+    unsigned int DIR_FileSize;
+} DirEntry;
+#pragma pack(pop)
+
+typedef struct DiskData {
+    int fd;                             // buffered descriptor, also used for writes
+    int read_only;                      // fd is O_RDONLY: nothing is written or replayed
+    uint64_t size;
+    const DiskBackend *backend;         // how reads reach memory, see diskio.c
+    void *io;                           // the backend's own state
+    unsigned char *data;                // whole image, or NULL
+    struct WindowCache *windows;        // windowed reads, see window.c
+} DiskData;
+
+// An open FAT32 volume. The boot sector is parsed and validated once and
+// the active FAT stays in memory; data clusters are reached through views
+// (window.h) so an image of any size fits the address space.
+typedef struct Volume {
+    DiskData *disk;
+    BootEntry bs;                       // copy of the boot sector
+    unsigned int cluster_size;          // bytes per cluster
+    unsigned int entries_per_cluster;   // directory entries per cluster
+    unsigned int cluster_count;         // number of data clusters
+    uint64_t fat_offset;                // byte offset of FAT #0
+    uint64_t fat_size;                  // bytes per FAT copy
+    uint64_t data_offset;               // byte offset of cluster 2
+    unsigned int active_fat;            // FAT #0 unless mirroring is off
+    int fat_mirrored;                   // edits go to every FAT copy
+    const unsigned char *fat;           // the active FAT
+    unsigned char *fat_map;             // loaded on its own, when the image is not whole
+    size_t fat_map_len;
+    struct FreeMap *free_map;           // built on first use, see freemap.c
+    struct DirIndex *dir_index;         // built on first use, see dirindex.c
+    struct ChangeList *changes;         // planned writes, see journal.c
+    char *journal_path;
+    const char *extract_dir;            // recovered files are copied here instead, see extract.c
+} Volume;
+
+DiskData *getDiskData(const char *disk_path, const DiskIoConfig *config);
+void freeDiskData(DiskData *disk_data);
+
+Volume *openVolume(const char *disk_path, const DiskIoConfig *config);
+void closeVolume(Volume *vol);
+int reloadVolume(Volume *vol);
+
+int isDataCluster(const Volume *vol, unsigned int cluster);
+uint64_t clusterOffset(const Volume *vol, unsigned int cluster);
+uint64_t fatEntryOffset(const Volume *vol, unsigned int fat_num, unsigned int cluster);
+unsigned int fatEntry(const Volume *vol, unsigned int cluster);
+unsigned int nextCluster(const Volume *vol, unsigned int cluster);
+void setFatEntry(Volume *vol, unsigned int cluster, unsigned int value);
+int writeVolume(Volume *vol, uint64_t offset, const void *bytes, size_t length);
+unsigned int entryFirstCluster(const DirEntry *dirEntry);
+unsigned int clustersForSize(const Volume *vol, unsigned int size);
+void formatShortName(const DirEntry *dirEntry, char *out);
+
+#endif
@@ -0,0 +1,505 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+
+#include "watch.h"
+#include "chain.h"
+#include "dirwalk.h"
+#include "window.h"
+#include "stats.h"
+
+// A directory reachable from the root, as the last pass left it
+typedef struct {
+    unsigned int cluster;       // first cluster
+    char *path;                 // "" for the root
+    unsigned int *chain;        // its clusters, in chain order
+    uint64_t *sums;             // checksum of each at the last pass
+    size_t length;
+    uint64_t *deleted;          // image offsets of its deleted entries, sorted
+    size_t deleted_count;
+    unsigned int *children;     // first clusters of its live subdirectories
+    size_t child_count;
+    unsigned int moved;         // pass in which its path last changed
+    int pending;                // to be decoded again in this pass
+    int reached;
+} WatchedDir;
+
+typedef struct {
+    Volume *vol;
+    FILE *out;
+    WatchedDir *dirs;
+    size_t count;
+    size_t cap;
+    int32_t *slots;             // open addressing on first cluster, -1 when empty
+    size_t slot_count;          // a power of two, at least twice count
+    uint64_t *fat_sums;         // checksum of each WATCH_FAT_BLOCK of the active FAT
+    unsigned char *fat_changed; // since the last pass
+    size_t fat_blocks;
+    unsigned int pass;
+} Watch;
+
+typedef struct {
+    unsigned int cluster;
+    char *path;
+} ChildDir;
+
+// What one decode of a directory found
+typedef struct {
+    Watch *watch;
+    const WatchedDir *dir;
+    uint64_t *deleted;
+    size_t deleted_count;
+    size_t deleted_cap;
+    ChildDir *children;
+    size_t child_count;
+    size_t child_cap;
+} DirScan;
+
+// Checksum of a directory cluster or FAT block, a word at a time. It only
+// has to tell whether the bytes changed since the last pass.
+static uint64_t blockSum(const unsigned char *data, size_t length){
+    uint64_t sum = length;
+    size_t i = 0;
+    for(; i + 8 <= length; i += 8){
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        sum = (sum ^ word) * 0x100000001B3ULL;
+        sum ^= sum >> 29;
+    }
+    for(; i < length; i++){
+        sum = (sum ^ data[i]) * 0x100000001B3ULL;
+    }
+    return sum;
+}
+
+static size_t slotOf(const Watch *watch, unsigned int cluster){
+    size_t mask = watch->slot_count - 1;
+    size_t slot = (cluster * 0x9E3779B1u) & mask;
+    while(watch->slots[slot] >= 0 && watch->dirs[watch->slots[slot]].cluster != cluster){
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static long findDir(const Watch *watch, unsigned int cluster){
+    return watch->slots[slotOf(watch, cluster)];
+}
+
+static int rehashDirs(Watch *watch, size_t slot_count){
+    int32_t *slots = malloc(slot_count * sizeof(int32_t));
+    if(slots == NULL){
+        return -1;
+    }
+    free(watch->slots);
+    watch->slots = slots;
+    watch->slot_count = slot_count;
+    memset(slots, 0xFF, slot_count * sizeof(int32_t));
+    for(size_t d = 0; d < watch->count; d++){
+        slots[slotOf(watch, watch->dirs[d].cluster)] = (int32_t)d;
+    }
+    return 0;
+}
+
+// Start watching a directory; it is read in this pass. Takes the path.
+static long addDir(Watch *watch, unsigned int cluster, char *path){
+    if(watch->count == watch->cap){
+        size_t cap = watch->cap ? watch->cap * 2 : 64;
+        WatchedDir *dirs = realloc(watch->dirs, cap * sizeof(WatchedDir));
+        if(dirs == NULL){
+            return -1;
+        }
+        watch->dirs = dirs;
+        watch->cap = cap;
+    }
+    if((watch->count + 1) * 2 > watch->slot_count && rehashDirs(watch, watch->slot_count * 2) != 0){
+        return -1;
+    }
+    WatchedDir *dir = &watch->dirs[watch->count];
+    memset(dir, 0, sizeof(*dir));
+    dir->cluster = cluster;
+    dir->path = path;
+    dir->moved = watch->pass;
+    dir->pending = 1;
+    watch->slots[slotOf(watch, cluster)] = (int32_t)watch->count;
+    return (long)watch->count++;
+}
+
+static void freeDir(WatchedDir *dir){
+    free(dir->path);
+    free(dir->chain);
+    free(dir->sums);
+    free(dir->deleted);
+    free(dir->children);
+}
+
+// Checksum the active FAT a block at a time and note which blocks
+// changed. Returns whether any did.
+static int checkFat(Watch *watch){
+    const Volume *vol = watch->vol;
+    int changed = 0;
+    for(size_t b = 0; b < watch->fat_blocks; b++){
+        uint64_t start = (uint64_t)b * WATCH_FAT_BLOCK;
+        size_t length = vol->fat_size - start < WATCH_FAT_BLOCK ? (size_t)(vol->fat_size - start) : WATCH_FAT_BLOCK;
+        uint64_t sum = blockSum(vol->fat + start, length);
+        watch->fat_changed[b] = sum != watch->fat_sums[b];
+        watch->fat_sums[b] = sum;
+        changed |= watch->fat_changed[b];
+    }
+    return changed;
+}
+
+// Whether a FAT entry of the directory's chain is in a block that changed
+static int chainMoved(const Watch *watch, const WatchedDir *dir){
+    for(size_t c = 0; c < dir->length; c++){
+        if(watch->fat_changed[(uint64_t)dir->chain[c] * 4 / WATCH_FAT_BLOCK]){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Follow the directory's chain again. Clusters that stay where they were
+// keep their checksum; the others are read as changed.
+static int followChain(Watch *watch, WatchedDir *dir){
+    unsigned int *chain = NULL;
+    uint64_t *sums = NULL;
+    size_t length = 0, cap = 0;
+    ChainWalk walk;
+    ChainExtent extent;
+    startChain(&walk, watch->vol, dir->cluster, 1);
+    while(nextExtent(&walk, &extent)){
+        for(unsigned int c = 0; c < extent.count; c++){
+            if(length == cap){
+                cap = cap ? cap * 2 : 8;
+                unsigned int *grown_chain = realloc(chain, cap * sizeof(unsigned int));
+                uint64_t *grown_sums = grown_chain ? realloc(sums, cap * sizeof(uint64_t)) : NULL;
+                chain = grown_chain ? grown_chain : chain;
+                sums = grown_sums ? grown_sums : sums;
+                if(grown_chain == NULL || grown_sums == NULL){
+                    free(chain);
+                    free(sums);
+                    return -1;
+                }
+            }
+            chain[length] = extent.first + c;
+            sums[length] = length < dir->length && dir->chain[length] == chain[length] ? dir->sums[length] : 0;
+            length++;
+        }
+    }
+    free(dir->chain);
+    free(dir->sums);
+    dir->chain = chain;
+    dir->sums = sums;
+    dir->length = length;
+    return 0;
+}
+
+// Checksum every cluster of the directory, viewing consecutive clusters
+// together. Returns 1 if any changed since the last pass, or -1.
+static int checkClusters(Watch *watch, WatchedDir *dir){
+    const Volume *vol = watch->vol;
+    size_t max_run = VIEW_CHUNK / vol->cluster_size ? VIEW_CHUNK / vol->cluster_size : 1;
+    int changed = 0;
+    for(size_t c = 0; c < dir->length;){
+        size_t run = 1;
+        while(c + run < dir->length && run < max_run && dir->chain[c + run] == dir->chain[c] + run){
+            run++;
+        }
+        VolumeView view;
+        const unsigned char *data = viewClusters(vol, dir->chain[c], (unsigned int)run, &view);
+        if(data == NULL){
+            return -1;
+        }
+        for(size_t r = 0; r < run; r++){
+            uint64_t sum = blockSum(data + r * vol->cluster_size, vol->cluster_size);
+            changed |= sum != dir->sums[c + r];
+            dir->sums[c + r] = sum;
+        }
+        releaseView(vol, &view);
+        statAdd(STAT_CLUSTERS_VISITED, run);
+        c += run;
+    }
+    return changed;
+}
+
+static int compareOffsets(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int wasDeleted(const WatchedDir *dir, uint64_t offset){
+    return dir->deleted_count > 0 &&
+        bsearch(&offset, dir->deleted, dir->deleted_count, sizeof(uint64_t), compareOffsets) != NULL;
+}
+
+// One line per newly deleted entry, named as -r would take it. A short
+// name whose first character could not be recovered starts with '?'.
+static void reportDeleted(FILE *out, const DirWalkEntry *item){
+    const DirEntry *entry = item->entry;
+    char short_name[13];
+    const char *name = item->long_name;
+    if(name == NULL){
+        DirEntry named = *entry;
+        named.DIR_Name[0] = item->first_char == 0xE5 ? '?' : item->first_char;
+        formatShortName(&named, short_name);
+        name = short_name;
+    }
+    if(entry->DIR_Attr & 0x10){
+        fprintf(out, "deleted %s/%s/ (starting cluster = %u)\n", item->dir_path, name, entryFirstCluster(entry));
+    }else{
+        fprintf(out, "deleted %s/%s (size = %u, starting cluster = %u)\n", item->dir_path, name, entry->DIR_FileSize, entryFirstCluster(entry));
+    }
+}
+
+static int scanEntry(Volume *vol, const DirWalkEntry *item, void *ctx){
+    DirScan *scan = ctx;
+    const DirEntry *entry = item->entry;
+    if(isLfnEntry(entry)){
+        return 0;
+    }
+    if(entry->DIR_Name[0] == 0xE5){
+        if(scan->deleted_count == scan->deleted_cap){
+            size_t cap = scan->deleted_cap ? scan->deleted_cap * 2 : 16;
+            uint64_t *deleted = realloc(scan->deleted, cap * sizeof(uint64_t));
+            if(deleted == NULL){
+                return -1;
+            }
+            scan->deleted = deleted;
+            scan->deleted_cap = cap;
+        }
+        scan->deleted[scan->deleted_count++] = item->offset;
+        // The first pass only learns what is already deleted
+        if(scan->watch->pass > 1 && !wasDeleted(scan->dir, item->offset)){
+            reportDeleted(scan->watch->out, item);
+        }
+        return 0;
+    }
+    if(!isLiveDirectory(entry) || !isDataCluster(vol, entryFirstCluster(entry))){
+        return 0;
+    }
+
+    char short_name[13];
+    const char *name = item->long_name;
+    if(name == NULL){
+        formatShortName(entry, short_name);
+        name = short_name;
+    }
+    size_t length = strlen(item->dir_path) + 1 + strlen(name);
+    if(length >= DIR_PATH_MAX){
+        // Nothing below it can be named; the rest is still watched
+        fprintf(stderr, "%s: a subdirectory path is longer than %d bytes and is not watched\n",
+                item->dir_path[0] ? item->dir_path : "/", DIR_PATH_MAX - 1);
+        return 0;
+    }
+    if(scan->child_count == scan->child_cap){
+        size_t cap = scan->child_cap ? scan->child_cap * 2 : 16;
+        ChildDir *children = realloc(scan->children, cap * sizeof(ChildDir));
+        if(children == NULL){
+            return -1;
+        }
+        scan->children = children;
+        scan->child_cap = cap;
+    }
+    char *path = malloc(length + 1);
+    if(path == NULL){
+        return -1;
+    }
+    sprintf(path, "%s/%s", item->dir_path, name);
+    scan->children[scan->child_count].cluster = entryFirstCluster(entry);
+    scan->children[scan->child_count++].path = path;
+    return 0;
+}
+
+// Read a directory whose clusters changed, report the entries deleted
+// since the last pass and start watching subdirectories not seen before.
+static int decodeDir(Watch *watch, size_t index){
+    WatchedDir *dir = &watch->dirs[index];
+    if(dir->chain == NULL && (followChain(watch, dir) != 0 || checkClusters(watch, dir) < 0)){
+        return -1;
+    }
+
+    DirScan scan = { watch, dir, NULL, 0, 0, NULL, 0, 0 };
+    int status = walkDirectory(watch->vol, dir->cluster, dir->path, scanEntry, &scan);
+    unsigned int *children = status == 0 ? malloc((scan.child_count ? scan.child_count : 1) * sizeof(unsigned int)) : NULL;
+    if(children == NULL){
+        for(size_t c = 0; c < scan.child_count; c++){
+            free(scan.children[c].path);
+        }
+        free(scan.children);
+        free(scan.deleted);
+        return -1;
+    }
+    qsort(scan.deleted, scan.deleted_count, sizeof(uint64_t), compareOffsets);
+    free(dir->deleted);
+    dir->deleted = scan.deleted;
+    dir->deleted_count = scan.deleted_count;
+    for(size_t c = 0; c < scan.child_count; c++){
+        children[c] = scan.children[c].cluster;
+    }
+    free(dir->children);
+    dir->children = children;
+    dir->child_count = scan.child_count;
+
+    // dir may move while directories are added
+    for(size_t c = 0; c < scan.child_count; c++){
+        char *path = scan.children[c].path;
+        long child = findDir(watch, scan.children[c].cluster);
+        if(child < 0){
+            if(addDir(watch, scan.children[c].cluster, path) < 0){
+                status = -1;
+                free(path);
+            }
+            continue;
+        }
+        // A directory moved elsewhere takes its new path, once per pass so
+        // a cross-linked tree cannot keep renaming itself
+        WatchedDir *known = &watch->dirs[child];
+        if(strcmp(known->path, path) != 0 && known->moved != watch->pass){
+            free(known->path);
+            known->path = path;
+            known->moved = watch->pass;
+            known->pending = 1;
+        }else{
+            free(path);
+        }
+    }
+    free(scan.children);
+    return status;
+}
+
+// Forget directories no live entry leads to any more, so their clusters
+// can be reused without being read as directories
+static int dropUnreached(Watch *watch){
+    size_t *stack = malloc((watch->count ? watch->count : 1) * sizeof(size_t));
+    if(stack == NULL){
+        return -1;
+    }
+    for(size_t d = 0; d < watch->count; d++){
+        watch->dirs[d].reached = 0;
+    }
+    size_t depth = 0;
+    watch->dirs[0].reached = 1;
+    stack[depth++] = 0;
+    while(depth > 0){
+        const WatchedDir *dir = &watch->dirs[stack[--depth]];
+        for(size_t c = 0; c < dir->child_count; c++){
+            long child = findDir(watch, dir->children[c]);
+            if(child >= 0 && !watch->dirs[child].reached){
+                watch->dirs[child].reached = 1;
+                stack[depth++] = (size_t)child;
+            }
+        }
+    }
+    free(stack);
+
+    size_t kept = 0;
+    for(size_t d = 0; d < watch->count; d++){
+        if(watch->dirs[d].reached){
+            watch->dirs[kept++] = watch->dirs[d];
+        }else{
+            freeDir(&watch->dirs[d]);
+        }
+    }
+    if(kept == watch->count){
+        return 0;
+    }
+    watch->count = kept;
+    return rehashDirs(watch, watch->slot_count);
+}
+
+// One pass: find what changed from checksums and decode only that
+static int watchPass(Watch *watch){
+    int fat_changed = checkFat(watch);
+    for(size_t d = 0; d < watch->count; d++){
+        WatchedDir *dir = &watch->dirs[d];
+        if(fat_changed && chainMoved(watch, dir) && followChain(watch, dir) != 0){
+            return -1;
+        }
+        int changed = checkClusters(watch, dir);
+        if(changed < 0){
+            return -1;
+        }
+        dir->pending |= changed;
+    }
+
+    int decoded = 0;
+    for(int progress = 1; progress;){
+        progress = 0;
+        // Directories added on the way are decoded in the same loop
+        for(size_t d = 0; d < watch->count; d++){
+            if(watch->dirs[d].pending){
+                watch->dirs[d].pending = 0;
+                if(decodeDir(watch, d) != 0){
+                    return -1;
+                }
+                progress = decoded = 1;
+            }
+        }
+    }
+    return decoded ? dropUnreached(watch) : 0;
+}
+
+// Poll the volume every interval seconds until SIGINT or SIGTERM and print
+// each entry deleted since the previous pass. Checksums of the active FAT
+// and of every directory cluster from the previous pass single out what
+// changed; only those directories are decoded again. The first pass
+// takes note of the tree and reports nothing.
+int watchVolume(Volume *vol, unsigned int interval, FILE *out){
+    Watch watch = { .vol = vol, .out = out };
+    watch.fat_blocks = (size_t)((vol->fat_size + WATCH_FAT_BLOCK - 1) / WATCH_FAT_BLOCK);
+    watch.fat_sums = calloc(watch.fat_blocks, sizeof(uint64_t));
+    watch.fat_changed = calloc(watch.fat_blocks, 1);
+    char *root_path = calloc(1, 1);
+    if(watch.fat_sums == NULL || watch.fat_changed == NULL || root_path == NULL ||
+       rehashDirs(&watch, 64) != 0 || addDir(&watch, vol->bs.BPB_RootClus, root_path) < 0){
+        perror("Error allocating memory");
+        free(watch.fat_sums);
+        free(watch.fat_changed);
+        free(watch.slots);
+        free(watch.dirs);
+        if(watch.count == 0){
+            free(root_path);
+        }
+        return 1;
+    }
+
+    // Blocked signals wait for sigtimedwait(), so one that arrives during
+    // a pass still ends the next pause
+    sigset_t stop_signals, old_mask;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &stop_signals, &old_mask);
+
+    int status = 0;
+    for(;;){
+        watch.pass++;
+        // Windows loaded without a mapping would show the image as it was
+        if(reloadVolume(vol) != 0 || watchPass(&watch) != 0){
+            fprintf(stderr, "Error reading the volume\n");
+            status = 1;
+            break;
+        }
+        if(watch.pass == 1){
+            fprintf(out, "Watching %zu director%s\n", watch.count, watch.count == 1 ? "y" : "ies");
+        }
+        fflush(out);
+        struct timespec pause = { (time_t)interval, 0 };
+        if(sigtimedwait(&stop_signals, NULL, &pause) >= 0){
+            break;
+        }
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    for(size_t d = 0; d < watch.count; d++){
+        freeDir(&watch.dirs[d]);
+    }
+    free(watch.dirs);
+    free(watch.slots);
+    free(watch.fat_sums);
+    free(watch.fat_changed);
+    return status;
+}
@@ -0,0 +1,14 @@
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+#include <stdio.h>
+
+#include "volume.h"
+
+#define WATCH_DEFAULT_INTERVAL 5
+// Bytes of the active FAT checksummed together
+#define WATCH_FAT_BLOCK 4096
+
+int watchVolume(Volume *vol, unsigned int interval, FILE *out);
+
+#endif
@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "window.h"
+
+// One mapped stretch of the image. Pinned windows are in use by some view
+// and are never unmapped; the least recently used unpinned one makes room.
+typedef struct Window {
+    uint64_t start;
+    size_t length;
+    unsigned char *data;        // NULL when the slot is empty
+    unsigned int pins;
+    uint64_t last_use;
+} Window;
+
+typedef struct WindowCache {
+    Window slots[WINDOW_SLOTS];
+    const DiskData *disk;
+    size_t window_size;
+    uint64_t clock;
+    size_t page_size;
+    pthread_mutex_t lock;
+} WindowCache;
+
+WindowCache *newWindowCache(const DiskData *disk){
+    WindowCache *cache = calloc(1, sizeof(WindowCache));
+    if(cache == NULL){
+        perror("Error allocating memory");
+        return NULL;
+    }
+    long page_size = sysconf(_SC_PAGESIZE);
+    cache->page_size = page_size > 0 ? (size_t)page_size : 4096;
+    cache->disk = disk;
+    cache->window_size = disk->backend->window_size;
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+void freeWindowCache(WindowCache *cache){
+    if(cache){
+        for(unsigned int s = 0; s < WINDOW_SLOTS; s++){
+            if(cache->slots[s].data){
+                cache->disk->backend->unload(cache->disk, cache->slots[s].data, cache->slots[s].length);
+            }
+        }
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+    }
+}
+
+// Forget every window not in use, so the next view reads the image again
+void dropWindows(WindowCache *cache){
+    if(cache == NULL){
+        return;
+    }
+    pthread_mutex_lock(&cache->lock);
+    for(unsigned int s = 0; s < WINDOW_SLOTS; s++){
+        Window *window = &cache->slots[s];
+        if(window->data && window->pins == 0){
+            cache->disk->backend->unload(cache->disk, window->data, window->length);
+            window->data = NULL;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Pick the window for a range: the aligned window-sized block it lies in,
+// or one starting at its first page when it straddles two blocks. Returns
+// 0 when the range is too long for any window.
+static int placeWindow(const WindowCache *cache, const DiskData *disk, uint64_t offset, size_t length, uint64_t *start, size_t *window_len){
+    size_t window_size = cache->window_size;
+    uint64_t aligned = offset - offset % window_size;
+    if(offset + length > aligned + window_size){
+        aligned = offset - offset % cache->page_size;
+        if(offset + length > aligned + window_size){
+            return 0;
+        }
+    }
+    *start = aligned;
+    *window_len = disk->size - aligned < window_size ? (size_t)(disk->size - aligned) : window_size;
+    return 1;
+}
+
+static Window *findWindow(WindowCache *cache, uint64_t offset, size_t length){
+    for(unsigned int s = 0; s < WINDOW_SLOTS; s++){
+        Window *window = &cache->slots[s];
+        if(window->data && offset >= window->start && offset + length <= window->start + window->length){
+            return window;
+        }
+    }
+    return NULL;
+}
+
+// The empty slot, or else the least recently used unpinned window
+static Window *victimWindow(WindowCache *cache){
+    Window *victim = NULL;
+    for(unsigned int s = 0; s < WINDOW_SLOTS; s++){
+        Window *window = &cache->slots[s];
+        if(window->data == NULL){
+            return window;
+        }
+        if(window->pins == 0 && (victim == NULL || window->last_use < victim->last_use)){
+            victim = window;
+        }
+    }
+    return victim;
+}
+
+// Pin length bytes of the image at offset and return them. A wholly mapped
+// image hands out pointers into it; otherwise the range comes from a cached
+// window, loading one on demand. A range that fits no window, or arrives
+// while every window is pinned, is loaded on its own. Safe to call from
+// several threads.
+const unsigned char *viewRange(const Volume *vol, uint64_t offset, size_t length, VolumeView *view){
+    const DiskData *disk = vol->disk;
+    view->window = NULL;
+    view->private_map = NULL;
+    view->private_len = 0;
+    if(disk->data){
+        return disk->data + offset;
+    }
+    WindowCache *cache = disk->windows;
+    pthread_mutex_lock(&cache->lock);
+    Window *window = findWindow(cache, offset, length);
+    uint64_t start;
+    size_t window_len;
+    if(window == NULL && placeWindow(cache, disk, offset, length, &start, &window_len)){
+        window = victimWindow(cache);
+        if(window){
+            if(window->data){
+                disk->backend->unload(disk, window->data, window->length);
+            }
+            window->data = disk->backend->load(disk, start, window_len);
+            window->start = start;
+            window->length = window_len;
+            window->pins = 0;
+            if(window->data == NULL){
+                pthread_mutex_unlock(&cache->lock);
+                return NULL;
+            }
+        }
+    }
+    if(window){
+        window->pins++;
+        window->last_use = ++cache->clock;
+        view->window = window;
+        pthread_mutex_unlock(&cache->lock);
+        return window->data + (offset - window->start);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    uint64_t map_start = offset - offset % cache->page_size;
+    view->private_len = (size_t)(offset - map_start) + length;
+    view->private_map = disk->backend->load(disk, map_start, view->private_len);
+    return view->private_map ? view->private_map + (offset - map_start) : NULL;
+}
+
+// View count whole clusters starting at cluster
+const unsigned char *viewClusters(const Volume *vol, unsigned int cluster, unsigned int count, VolumeView *view){
+    uint64_t offset = clusterOffset(vol, cluster);
+    uint64_t length = (uint64_t)count * vol->cluster_size;
+    if(offset + length > vol->disk->size){
+        length = vol->disk->size - offset;
+    }
+    return viewRange(vol, offset, (size_t)length, view);
+}
+
+void releaseView(const Volume *vol, VolumeView *view){
+    if(view->window){
+        WindowCache *cache = vol->disk->windows;
+        pthread_mutex_lock(&cache->lock);
+        view->window->pins--;
+        pthread_mutex_unlock(&cache->lock);
+        view->window = NULL;
+    }
+    if(view->private_map){
+        vol->disk->backend->unload(vol->disk, view->private_map, view->private_len);
+        view->private_map = NULL;
+    }
+}
+
+// Pass an madvise() hint for viewed bytes, widened to whole pages
+void adviseRange(const unsigned char *data, size_t length, int advice){
+    if(length == 0){
+        return;
+    }
+    uintptr_t page_size = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)data & ~(page_size - 1);
+    uintptr_t end = (uintptr_t)data + length;
+    madvise((void *)start, end - start, advice);
+}
+
+// Ask the kernel to start reading a range of the image that is about to be
+// viewed. Only reads through the page cache gain from it; a backend that
+// loads its own copies would read the range twice.
+void prefetchRange(const Volume *vol, uint64_t offset, uint64_t length){
+    const DiskData *disk = vol->disk;
+    if(length == 0 || !disk->backend->coherent){
+        return;
+    }
+    if(disk->data){
+        adviseRange(disk->data + offset, (size_t)length, MADV_WILLNEED);
+    }else{
+        posix_fadvise(disk->fd, (off_t)offset, (off_t)length, POSIX_FADV_WILLNEED);
+    }
+}
@@ -0,0 +1,34 @@
+#ifndef _WINDOW_H_
+#define _WINDOW_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "volume.h"
+
+// Images up to this size are mapped whole; larger ones, any image on a
+// 32-bit host past a few hundred MB, and every image read with O_DIRECT
+// are loaded a window at a time.
+#define WINDOW_MAP_WHOLE_MAX (sizeof(void *) >= 8 ? (uint64_t)1 << 40 : (uint64_t)256 << 20)
+#define WINDOW_SIZE ((size_t)32 << 20)
+#define WINDOW_SLOTS 8
+// Callers that stream through the image view it in pieces of this size
+#define VIEW_CHUNK (WINDOW_SIZE / 2)
+
+// A pinned range of the image. The bytes stay loaded until releaseView().
+typedef struct {
+    struct Window *window;      // cached window holding the range, or NULL
+    unsigned char *private_map; // loaded on its own when no window could take it
+    size_t private_len;
+} VolumeView;
+
+struct WindowCache *newWindowCache(const DiskData *disk);
+void freeWindowCache(struct WindowCache *cache);
+void dropWindows(struct WindowCache *cache);
+const unsigned char *viewRange(const Volume *vol, uint64_t offset, size_t length, VolumeView *view);
+const unsigned char *viewClusters(const Volume *vol, unsigned int cluster, unsigned int count, VolumeView *view);
+void releaseView(const Volume *vol, VolumeView *view);
+void adviseRange(const unsigned char *data, size_t length, int advice);
+void prefetchRange(const Volume *vol, uint64_t offset, uint64_t length);
+
+#endif